@@ -0,0 +1,247 @@
+/*
+ * compare the deduplication of fixed size blocks, as done by ddumbfs, with
+ * content defined chunks cut by a FastCDC (Gear rolling hash) chunker
+ *
+ * the chunks are never bigger than the block size, like if they had to fit
+ * in the slots of the block file, the average is half the block size
+ *
+ * cmpchunk [block_size] file...
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "gsha1.h"
+
+#define BUFFER_SIZE (4*1024*1024)
+
+int c_block_size=128*1024;
+
+long long int now_usec()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec*1000000LL+tv.tv_usec;
+}
+
+/*
+ * a minimal set of hashes to count the unique chunks
+ */
+struct hash_set
+{
+    unsigned char (*hashes)[20];
+    char *used;
+    long long int size;
+    long long int count;
+};
+
+struct dedup
+{
+    char *name;
+    struct hash_set set;
+    long long int chunks;
+    long long int bytes;
+    long long int unique_bytes;
+    long long int cut_time;     // usec spent searching for boundaries
+};
+
+static int hash_set_add(struct hash_set *s, const unsigned char *hash);
+
+static void hash_set_grow(struct hash_set *s)
+{
+    struct hash_set n;
+    long long int i;
+
+    n.size=s->size?s->size*2:1024*1024;
+    n.count=0;
+    n.hashes=malloc(n.size*20);
+    n.used=calloc(n.size, 1);
+    if (n.hashes==NULL || n.used==NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (i=0; i<s->size; i++) if (s->used[i]) hash_set_add(&n, s->hashes[i]);
+    free(s->hashes);
+    free(s->used);
+    *s=n;
+}
+
+/*
+ * return 1 if the hash was not in the set
+ */
+static int hash_set_add(struct hash_set *s, const unsigned char *hash)
+{
+    if (2*(s->count+1)>s->size) hash_set_grow(s);
+
+    uint64_t h;
+    memcpy(&h, hash, sizeof(h));
+    long long int i=h%s->size;
+    while (s->used[i])
+    {
+        if (0==memcmp(s->hashes[i], hash, 20)) return 0;
+        i=(i+1)%s->size;
+    }
+    s->used[i]=1;
+    memcpy(s->hashes[i], hash, 20);
+    s->count++;
+    return 1;
+}
+
+static void dedup_add(struct dedup *d, const char *chunk, int len)
+{
+    unsigned char hash[20];
+
+    sha1_buffer(chunk, len, hash);
+    d->chunks++;
+    d->bytes+=len;
+    if (hash_set_add(&d->set, hash)) d->unique_bytes+=len;
+}
+
+/*
+ * FastCDC with normalized chunking, the small mask is used before the
+ * average size and the large one after
+ */
+uint64_t gear[256];
+int cdc_min, cdc_avg, cdc_max;
+uint64_t cdc_mask_s, cdc_mask_l;
+
+static void cdc_init(int block_size)
+{
+    int i, bits=0;
+    uint64_t x=0x2545f4914f6cdd1dULL;
+
+    for (i=0; i<256; i++)
+    {   // xorshift, any fixed random table will do
+        x^=x<<13; x^=x>>7; x^=x<<17;
+        gear[i]=x;
+    }
+    cdc_max=block_size;
+    cdc_avg=block_size/2;
+    cdc_min=block_size/8;
+    while ((1<<bits)<cdc_avg) bits++;
+    // the high bits of the Gear hash depend on the last 64 bytes
+    cdc_mask_s=~0ULL<<(64-(bits+1));
+    cdc_mask_l=~0ULL<<(64-(bits-1));
+}
+
+/*
+ * return the length of the next chunk
+ */
+static int cdc_cut(const unsigned char *p, int n)
+{
+    uint64_t fp=0;
+    int i, normal;
+
+    if (n<=cdc_min) return n;
+    if (n>cdc_max) n=cdc_max;
+    normal=(n<cdc_avg)?n:cdc_avg;
+
+    // the bytes before cdc_min can't be a boundary, they are skipped
+    for (i=cdc_min; i<normal; i++)
+    {
+        fp=(fp<<1)+gear[p[i]];
+        if (!(fp & cdc_mask_s)) return i+1;
+    }
+    for (; i<n; i++)
+    {
+        fp=(fp<<1)+gear[p[i]];
+        if (!(fp & cdc_mask_l)) return i+1;
+    }
+    return n;
+}
+
+static int chunk_file(const char *filename, struct dedup *fixed, struct dedup *cdc, char *buffer)
+{
+    FILE *file=fopen(filename, "r");
+    if (file==NULL)
+    {
+        perror(filename);
+        return 1;
+    }
+
+    int len=0;      // bytes in buffer
+    int fixed_off=0, cdc_off=0;
+    int eof=0;
+    while (!eof || cdc_off<len)
+    {
+        if (!eof && len-cdc_off<cdc_max)
+        {   // move the remaining at the beginning and refill
+            int keep=(fixed_off<cdc_off)?fixed_off:cdc_off;
+            memmove(buffer, buffer+keep, len-keep);
+            len-=keep;
+            fixed_off-=keep;
+            cdc_off-=keep;
+            int n=fread(buffer+len, 1, BUFFER_SIZE-len, file);
+            if (n<=0) eof=1;
+            else len+=n;
+        }
+
+        while (fixed_off+c_block_size<=len || (eof && fixed_off<len))
+        {
+            int n=(len-fixed_off<c_block_size)?len-fixed_off:c_block_size;
+            dedup_add(fixed, buffer+fixed_off, n);
+            fixed_off+=n;
+        }
+
+        while (cdc_off<len && (eof || len-cdc_off>=cdc_max))
+        {
+            long long int start=now_usec();
+            int n=cdc_cut((unsigned char *)buffer+cdc_off, len-cdc_off);
+            cdc->cut_time+=now_usec()-start;
+            dedup_add(cdc, buffer+cdc_off, n);
+            cdc_off+=n;
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+static void dedup_print(struct dedup *d)
+{
+    fprintf(stderr, "%-8s chunks: %9lld avg: %7lld unique: %9.1f Mo dedup: %5.1f%%",
+            d->name, d->chunks, d->chunks?d->bytes/d->chunks:0, d->unique_bytes/1024.0/1024,
+            d->bytes?100.0*(d->bytes-d->unique_bytes)/d->bytes:0.0);
+    if (d->cut_time) fprintf(stderr, " cut: %.1f Mo/s", (float)d->bytes*1000000/d->cut_time/1024/1024);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int i=1;
+    struct dedup fixed, cdc;
+
+    if (argc>1 && atoi(argv[1])>0)
+    {
+        c_block_size=atoi(argv[1]);
+        i++;
+    }
+    if (i>=argc)
+    {
+        fprintf(stderr, "usage: cmpchunk [block_size] file...\n");
+        return 1;
+    }
+
+    char *buffer=malloc(BUFFER_SIZE);
+    if (buffer==NULL || c_block_size<64 || c_block_size*2>BUFFER_SIZE)
+    {
+        fprintf(stderr, "bad block size: %d\n", c_block_size);
+        return 1;
+    }
+
+    memset(&fixed, 0, sizeof(fixed));
+    memset(&cdc, 0, sizeof(cdc));
+    fixed.name="fixed";
+    cdc.name="fastcdc";
+    cdc_init(c_block_size);
+
+    for (; i<argc; i++) chunk_file(argv[i], &fixed, &cdc, buffer);
+
+    fprintf(stderr, "block size: %d  total: %.1f Mo\n", c_block_size, fixed.bytes/1024.0/1024);
+    dedup_print(&fixed);
+    dedup_print(&cdc);
+    return 0;
+}
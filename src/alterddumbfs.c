@@ -680,6 +680,10 @@ int main(int argc, char *argv[])
     {
         fprintf(stderr, "cannot create .autofsck file, abort (%s)\n", strerror(errno));
     }
+    if (ddfs_refcount_invalidate()==-1)
+    {
+        fprintf(stderr, "cannot remove %s (%s)\n", REFCOUNT_FILENAME, strerror(errno));
+    }
 
     int i=0;
     for (i=0; i<swap_consecutiv_num; i++) swap_consecutive_non_empty_nodes();
@@ -5,6 +5,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <errno.h>
 #include <time.h>
@@ -265,6 +266,7 @@ int bit_array_init(struct bit_array *ba, long long int size, int zero_or_one)
     ba->size=size;
     ba->isize=(size+BIT_INT_BIT_COUNT1)/BIT_INT_BIT_COUNT;
     ba->allocated=0;
+    ba->dirty=NULL;
     ba->array=malloc(ba->isize*BIT_INT_BYTE);
     if (ba->array==NULL) return 1;
     ba->allocated=1;
@@ -286,6 +288,7 @@ int bit_array_init2(struct bit_array *ba, long long int size, void *buffer)
     ba->size=size;
     ba->isize=(size+BIT_INT_BIT_COUNT1)/BIT_INT_BIT_COUNT;
     ba->allocated=0;
+    ba->dirty=NULL;
     ba->array=(bit_int *)buffer;
     ba->end=ba->array+ba->isize;
     ba->last=ba->end-1;
@@ -300,8 +303,34 @@ int bit_array_init2(struct bit_array *ba, long long int size, void *buffer)
 void bit_array_release(struct bit_array *ba)
 {
     if (ba->allocated) free(ba->array);
+    free(ba->dirty);
+    ba->dirty=NULL;
 }
 
+/*
+ * return the number of pages of BIT_ARRAY_PAGE_SIZE bytes
+ */
+long long int bit_array_page_count(struct bit_array *ba)
+{
+    return (ba->isize*BIT_INT_BYTE+BIT_ARRAY_PAGE_SIZE-1)/BIT_ARRAY_PAGE_SIZE;
+}
+
+/*
+ * start to track the modified pages, all pages are dirty at start.
+ * The caller reset the bytes of ba->dirty when it has handled the pages.
+ */
+int bit_array_track_dirty(struct bit_array *ba)
+{
+    long long int pages=bit_array_page_count(ba);
+    if (ba->dirty==NULL) ba->dirty=malloc(pages);
+    if (ba->dirty==NULL) return 1;
+    memset(ba->dirty, 1, pages);
+    return 0;
+}
+
+#define bit_array_dirty(ba, bit_addr) { if ((ba)->dirty) (ba)->dirty[(bit_addr)>>BIT_ARRAY_PAGE_SHIFT]=1; }
+#define bit_array_dirty_all(ba) { if ((ba)->dirty) memset((ba)->dirty, 1, bit_array_page_count(ba)); }
+
 void bit_array_reset(struct bit_array *ba, int zero_or_one)
 {
     bit_int value;
@@ -309,12 +338,14 @@ void bit_array_reset(struct bit_array *ba, int zero_or_one)
     else value=bit_int_zero;
     bit_int *pi=ba->array;
     while (pi<ba->end) *pi++=value;
+    bit_array_dirty_all(ba);
 }
 
 void bit_array_random(struct bit_array *ba)
 {
     bit_int *pi=ba->array;
     while (pi<ba->end) *pi++=random();
+    bit_array_dirty_all(ba);
 }
 
 /*
@@ -327,6 +358,7 @@ int bit_array_set(struct bit_array *ba, long long int bit_addr)
     bit_int v=BIT_INT_TO_BE(BIT_INT_HIGHEST_BIT>>(bit_addr&BIT_INT_OFF_MASK));
     int res=(*p & v)!=bit_int_zero;
     *p|=v;
+    bit_array_dirty(ba, bit_addr);
     return res;
 }
 
@@ -340,6 +372,7 @@ int bit_array_unset(struct bit_array *ba, long long int bit_addr)
     bit_int v=BIT_INT_TO_BE(~(BIT_INT_HIGHEST_BIT>>(bit_addr&BIT_INT_OFF_MASK)));
     int res=(*p & ~v)!=bit_int_zero;
     *p&=v;
+    bit_array_dirty(ba, bit_addr);
     return res;
 }
 /*
@@ -357,6 +390,7 @@ int bit_array_get(struct bit_array *ba, long long int bit_addr)
 void bit_array_reset_zone(struct bit_array *ba, long long int from, long long int to, int set)
 {
 	// assert(from<=to && to<ba->size);
+    bit_array_dirty_all(ba);
     int foff=from&BIT_INT_OFF_MASK;
     int toff=to&BIT_INT_OFF_MASK;
 
@@ -582,24 +616,28 @@ void bit_array_inverse_into(struct bit_array *src, struct bit_array *dst)
 {
     bit_int *p, *q;
     for (p=src->array, q=dst->array; p<src->end; p++, q++) *q=~*p;
+    bit_array_dirty_all(dst);
 }
 
 void bit_array_bwand(struct bit_array *src, struct bit_array *dst)
 {
     bit_int *p, *q;
     for (p=src->array, q=dst->array; p<src->end; p++, q++) (*q)&=*p;
+    bit_array_dirty_all(dst);
 }
 
 void bit_array_bwor(struct bit_array *src, struct bit_array *dst)
 {
     bit_int *p, *q;
     for (p=src->array, q=dst->array; p<src->end; p++, q++) (*q)|=*p;
+    bit_array_dirty_all(dst);
 }
 
 void bit_array_plus_diff(struct bit_array *a, struct bit_array *b, struct bit_array *c)
 { // a=a+(b-c)
     bit_int *p, *q, *r;
     for (p=a->array, q=b->array, r=c->array; p<a->end; p++, q++, r++) (*p)|=*q & ~*r;
+    bit_array_dirty_all(a);
 }
 
 
@@ -607,6 +645,7 @@ void bit_array_copy(struct bit_array *src, struct bit_array *dst)
 {
     bit_int *p, *q;
     for (p=src->array, q=dst->array; p<src->end; p++, q++) *q=*p;
+    bit_array_dirty_all(dst);
 }
 
 /**
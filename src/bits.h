@@ -22,6 +22,9 @@ typedef uint32_t bit_int;
 #define BIT_INT_SHIFT		5
 #define BIT_INT_OFF_MASK	0x1F
 
+#define BIT_ARRAY_PAGE_SIZE	4096	// size in byte of a page for the dirty tracking
+#define BIT_ARRAY_PAGE_SHIFT	15	// a page hold 2^15 bits
+
 struct bit_array
 {
     long long int size;   // size in bits
@@ -32,11 +35,14 @@ struct bit_array
     bit_int *last;        // the last bit_int (don't forget to apply the mask)
     bit_int *end;         // past the last bit_int
     int allocated;
+    unsigned char *dirty; // when not NULL, one byte per page set when the page is modified
 };
 
 int bit_array_init(struct bit_array *ba, long long int size, int pattern);
 int bit_array_init2(struct bit_array *ba, long long int size, void *buffer);
 void bit_array_release(struct bit_array *ba);
+int bit_array_track_dirty(struct bit_array *ba);
+long long int bit_array_page_count(struct bit_array *ba);
 void bit_array_reset(struct bit_array *ba, int pattern);
 void bit_array_random(struct bit_array *ba);
 int bit_array_set(struct bit_array *ba, long long int bit_addr);
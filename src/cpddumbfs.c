@@ -22,7 +22,8 @@
  *
  */
 
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
 #define _LARGEFILE64_SOURCE
 
 #include <stdio.h>
@@ -36,6 +37,8 @@
 #include <ftw.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 #include "ddfslib.h"
 
@@ -45,6 +48,8 @@ int verbose_flag=0;
 int check_integrity=0;
 int lock_index_flag=0;
 int force_flag=0;
+int sorted_flag=0;
+int recursive_flag=0;
 
 static struct option long_options[] =
 {
@@ -54,6 +59,9 @@ static struct option long_options[] =
        {"check",         no_argument,       0, 'c'},
        {"verbose",       no_argument,       0, 'v'},
        {"force",         no_argument,       0, 'f'},
+       {"sorted",        no_argument,       0, 's'},
+       {"recursive",     no_argument,       0, 'r'},
+       {"jobs",          required_argument, 0, 'j'},
        {0, 0, 0, 0}
 };
 
@@ -66,35 +74,87 @@ void usage()
             "  -l, --lock_index      lock index into memory (increase speed for large file)\n"
             "  -c, --check           check file integrity in exit code (download only)\n"
             "  -f, --force           download a file even with a corrupted MAGIC in the header\n"
+            "  -s, --sorted          read the blocks in address order and hash them in\n"
+            "                        parallel, faster for deduplicated files (download only)\n"
+            "  -r, --recursive       copy a directory tree, with permissions, owner and times\n"
+            "  -j, --jobs N          number of files copied at the same time with -r\n"
+            "                        (default is one per CPU)\n"
             "\n  One and only one of the source or target must be inside the\n"
             "  ddfsroot directory. Use - to redirect from/to stdin/stdout.\n"
             "\nSamples:\n"
             "  cpddumbfs -l /data/ddumbfs/ddfsroot/data /tmp\n"
             "  cpddumbfs /tmp/data /data/ddumbfs/ddfsroot\n"
+            "  cpddumbfs -r /home /data/ddumbfs/ddfsroot/backup\n"
     );
 }
 
-int download(char *source, char *destination)
+/**
+ * read the header of a ddumbfs file
+ *
+ * @param fsrc the file
+ * @param source the filename for the messages
+ * @param file_size return the size of the file or -1 if unknown
+ * @param integrity is reset if the size is unknown
+ * @return 0 for success, 1 for error
+ */
+static int download_header(int fsrc, const char *source, long long int *file_size, int *integrity)
 {
-    char dstfilename[FILENAME_MAX];
-    unsigned char node[NODE_SIZE];
-    uint64_t size;
+    uint64_t size=0;
     int len;
 
-    int integrity=1;
+    // read file size
+    len=file_header_set_conv(fsrc, &size);
 
-    if (verbose_flag) fprintf(stderr, "download %s %s\n", source, destination);
-    int fsrc=open(source, O_RDONLY);
-    if (fsrc==-1)
+    if (len==-1)
+    {
+        perror(source);
+        return 1;
+    }
+    else if (len==0)
+    {
+        fprintf(stderr, "magic header missing, not a valid ddumbfs file: %s\n", source);
+        if (!force_flag) return 1;
+    }
+    else if (len!=ddfs->c_file_header_size)
+    {
+        fprintf(stderr, "cannot read file header size: %s\n", source);
+        if (!force_flag) return 1;
+    }
+
+    *file_size=size;
+    if (len!=ddfs->c_file_header_size)
+    {
+        fprintf(stderr, "unknown file size, continue: %s\n", source);
+        *file_size=-1;
+        *integrity=0;
+    }
+    return 0;
+}
+
+/**
+ * open the source and destination of a download and read the file header
+ *
+ * @param fsrc return the source file
+ * @param fdst return the destination file, 1 for stdout
+ * @param file_size return the size of the file or -1 if unknown
+ * @param integrity is reset if the size is unknown
+ * @return 0 for success, 1 for error, all files are closed
+ */
+static int download_open(char *source, char *destination, int *fsrc, int *fdst, long long int *file_size, int *integrity)
+{
+    char dstfilename[FILENAME_MAX];
+
+    *fsrc=open(source, O_RDONLY);
+    if (*fsrc==-1)
     {
         perror(source);
         return 1;
     }
 
-    int fdst=-1;
+    *fdst=-1;
     if (0==strcmp("-", destination))
     {
-        fdst=1; // stdout
+        *fdst=1; // stdout
     }
     else
     {
@@ -107,41 +167,168 @@ int download(char *source, char *destination)
         }
         else strncpy(dstfilename, destination, FILENAME_MAX);
 
-        fdst=open(dstfilename, O_RDWR | O_CREAT | O_TRUNC, 0600);
-        if (fdst==-1)
+        *fdst=open(dstfilename, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (*fdst==-1)
         {
             perror(dstfilename);
             goto ERROR1;
         }
     }
 
-    // read file size
-    len=file_header_set_conv(fsrc, &size);
+    if (download_header(*fsrc, source, file_size, integrity)) goto ERROR1;
+    return 0;
 
-    if (len==-1)
+    ERROR1:
+    if (*fdst!=1 && *fdst!=-1) close(*fdst);
+    close(*fsrc);
+    return 1;
+}
+
+/**
+ * search the index for another block matching the hash of the node
+ *
+ * @param node the node from the file
+ * @param addr the address of the bad block, updated if a good block is found
+ * @param buf hold the data of the bad block, and the data of the good one if found
+ * @param integrity is reset if a block cannot be read
+ * @return 0 if a good block is found, 1 if not, -1 for error
+ */
+static int download_search_good_block(unsigned char *node, blockaddr *addr, char *buf, int *integrity)
+{
+    unsigned char hash[HASH_SIZE];
+    blockaddr baddr;
+    int len;
+
+    nodeidx node_idx=ddfs_search_hash(node+ddfs->c_addr_size, &baddr);
+    //fprintf(stderr, "err node_idx=%lld baddr=%lld\n", node_idx, baddr);
+    while (0<=node_idx && node_idx<ddfs->c_node_count && 0==memcmp(node+ddfs->c_addr_size, ddfs->nodes+(ddfs->c_node_size*node_idx+ddfs->c_addr_size), ddfs->c_hash_size))
     {
-        perror(source);
-        goto ERROR1;
+        baddr=ddfs_get_node_addr(ddfs->nodes+(ddfs->c_node_size*node_idx));
+        // fprintf(stderr, "test node node_idx=%lld baddr=%lld\n", node_idx, baddr);
+        if (baddr!=*addr && baddr!=1)
+        {
+            len=ddfs_read_full_block(baddr, buf);
+            if (len!=ddfs->c_block_size)
+            {
+                if (len==-1) fprintf(stderr, "error reading block file offset %lld (%s)\n", baddr*ddfs->c_block_size, strerror(errno));
+                else fprintf(stderr, "error reading block file offset %lld short read %d/%d\n", baddr*ddfs->c_block_size, len, ddfs->c_block_size);
+                if (!force_flag) return -1;
+                ddfs_forced_read_full_block(baddr, buf, 1024);
+                *integrity=0;
+            }
+            ddfs_hash(buf, hash);
+            if (0==memcmp(node+ddfs->c_addr_size, hash, ddfs->c_hash_size))
+            {
+                *addr=baddr;
+                return 0;
+            }
+        }
+        node_idx++;
     }
-    else if (len==0)
+    return 1;
+}
+
+/**
+ * check the block read for a node
+ *
+ * @param node the node from the file
+ * @param addr the address of the block, updated if the block has been corrected
+ * @param buf the data of the block, updated if the block has been corrected
+ * @param hash the hash of buf or NULL to calculate it
+ * @param status return the status of the block
+ * @param integrity is reset if a block cannot be read
+ * @return 1 if the block is bad, 0 if it is good, -1 for error
+ */
+static int download_check_block(unsigned char *node, blockaddr *addr, char *buf, unsigned char *hash, char **status, int *integrity)
+{
+    unsigned char buf_hash[HASH_SIZE];
+
+    *status="ok";
+    if (*addr==0)
+    {   // check hash match zero block
+        if (0!=memcmp(ddfs->null_block_hash, node+ddfs->c_addr_size, ddfs->c_hash_size) && 0!=memcmp(ddfs->zero_block_hash, node+ddfs->c_addr_size, ddfs->c_hash_size))
+        {
+            *status="bad"; // bad node
+            return 1;
+        }
+        return 0;
+    }
+
+    if (hash==NULL)
     {
-        fprintf(stderr, "magic header missing, not a valid ddumbfs file: %s\n", source);
-        if (!force_flag) goto ERROR1;
+        ddfs_hash(buf, buf_hash);
+        hash=buf_hash;
     }
-    else if (len!=ddfs->c_file_header_size)
+    if (memcmp(node+ddfs->c_addr_size, hash, ddfs->c_hash_size)==0) return 0;
+
+    *status="err";
+    // fprintf(stderr, "err block %6lld %6lld %016llx<>%016llx\n", i, addr, *(long long int*)(node+ddfs->c_addr_size), *(long long int*)hash);
+    // search the Index, maybe I can found the good hash ?
+    int res=download_search_good_block(node, addr, buf, integrity);
+    if (res==0) *status="corrected";
+    return res;
+}
+
+/**
+ * write a block in the destination of a download
+ *
+ * @param hole if the block is made of zeros and can be skipped, the file
+ * must be truncated at the end
+ * @param write_size the offset in the file, for the error messages
+ * @return 0 for success, 1 for error
+ */
+static int download_write(int fdst, const char *buf, long long int sz, int hole, long long int write_size)
+{
+    if (hole)
+    {   // keep the file sparse
+        if (lseek(fdst, sz, SEEK_CUR)==-1)
+        {
+            fprintf(stderr, "error seeking file offset %lld (%s)\n", write_size, strerror(errno));
+            return 1;
+        }
+        return 0;
+    }
+    int len=write(fdst, buf, sz);
+    if (len!=sz)
     {
-        fprintf(stderr, "cannot read file header size: %s\n", source);
-        if (!force_flag) goto ERROR1;
+        if (len==-1) fprintf(stderr, "error writing file offset %lld (%s)\n", write_size, strerror(errno));
+        else fprintf(stderr, "error writing file, short write offset %lld %d/%lld\n", write_size, len, sz);
+        return 1;
     }
+    return 0;
+}
 
-    long long int file_size=size;
-    if (len!=ddfs->c_file_header_size)
+/**
+ * set the size of the destination of a download, required when the last
+ * blocks have been skipped
+ *
+ * @return 0 for success, 1 for error
+ */
+static int download_truncate(int fdst, int sparse, long long int write_size)
+{
+    if (sparse && ftruncate(fdst, write_size)==-1)
     {
-        fprintf(stderr, "unknown file size, continue: %s\n", source);
-        file_size=-1;
-        integrity=0;
+        fprintf(stderr, "error setting the file size to %lld (%s)\n", write_size, strerror(errno));
+        return 1;
     }
+    return 0;
+}
 
+/**
+ * copy the blocks of a ddumbfs file into fdst
+ *
+ * @param file_size the size of the file or -1 if unknown
+ * @param integrity 0 if the integrity is already lost
+ * @param buf a buffer of c_block_size bytes
+ * @return 1 if the integrity is ok, 0 if not and -1 for error
+ */
+static int download_copy(int fsrc, int fdst, long long int file_size, int integrity, char *buf)
+{
+    unsigned char node[NODE_SIZE];
+    struct stat st;
+    int len;
+
+    int sparse=(fstat(fdst, &st)==0 && S_ISREG(st.st_mode));
     long long int i=0;
     long long int write_size=0;
 
@@ -149,7 +336,6 @@ int download(char *source, char *destination)
     while (1 || (force_flag && file_size==-1)) // || write_size<file_size)
     {
         int fake_node=0;
-        int fake_block=0;
         long long int fileoff=ddfs->c_file_header_size+i*ddfs->c_node_size;
         nlen=pread(fsrc, node, ddfs->c_node_size, fileoff);
         if (nlen==0) break; // EOF
@@ -157,7 +343,7 @@ int download(char *source, char *destination)
         {
             if (nlen==-1) fprintf(stderr, "error reading offset %lld (%s)\n", fileoff, strerror(errno));
             else fprintf(stderr, "error reading offset %lld short read %d/%d\n", fileoff, nlen, ddfs->c_node_size);
-            if (!force_flag) goto ERROR1;
+            if (!force_flag) return -1;
             memset(node, '\0', ddfs->c_node_size);
             ddfs_convert_addr(1, node);
             integrity=0;
@@ -165,16 +351,15 @@ int download(char *source, char *destination)
         }
 
         blockaddr addr=ddfs_get_node_addr(node);
-        len=ddfs_read_full_block(addr, ddfs->aux_buffer);
+        len=ddfs_read_full_block(addr, buf);
         if (len!=ddfs->c_block_size)
         {
             if (len==-1) fprintf(stderr, "error reading block file offset %lld (%s)\n", addr*ddfs->c_block_size, strerror(errno));
             else fprintf(stderr, "error reading block file offset %lld short read %d/%d\n", addr*ddfs->c_block_size, len, ddfs->c_block_size);
             integrity=0;
-            if (!force_flag) goto ERROR1;
-            ddfs_forced_read_full_block(addr, ddfs->aux_buffer, 1024);
+            if (!force_flag) return -1;
+            ddfs_forced_read_full_block(addr, buf, 1024);
             len=ddfs->c_block_size;
-            fake_block=1;
         }
 
         char *status="";
@@ -187,104 +372,545 @@ int download(char *source, char *destination)
 
         if (check_integrity && !fake_node)
         {
-            status="ok";
-            if (addr==0)
-            {   // check hash match zero block
-                if (0!=memcmp(ddfs->null_block_hash, node+ddfs->c_addr_size, ddfs->c_hash_size) && 0!=memcmp(ddfs->zero_block_hash, node+ddfs->c_addr_size, ddfs->c_hash_size))
+            badblock=download_check_block(node, &addr, buf, NULL, &status, &integrity);
+            if (badblock==-1) return -1;
+        }
+
+        if (badblock) integrity=0;
+
+        long long int sz=ddfs->c_block_size;
+        if (file_size!=-1)
+        {
+            sz=file_size-write_size;
+        }
+        if (sz>ddfs->c_block_size) sz=ddfs->c_block_size;
+
+        if (download_write(fdst, buf, sz, sparse && addr==0, write_size)) return -1; // no force_flag here
+        if (verbose_flag || 0!=strcmp(status, "ok"))
+        {
+            fprintf(stderr, "%6lld %6lld %016llx %s\n", i, addr, (long long int)ddfs_hton64(*(uint64_t*)(node+ddfs->c_addr_size)), status);
+        }
+
+        write_size+=sz;
+        i++;
+    }
+
+    if (verbose_flag)
+    {
+        if (file_size>0) fprintf(stderr, "        size: %lld\n", file_size);
+        else fprintf(stderr, "        size: NA\n");
+        fprintf(stderr, "written size: %lld\n", write_size);
+    }
+
+    if (download_truncate(fdst, sparse, write_size)) return -1;
+
+    return integrity;
+}
+
+int download(char *source, char *destination)
+{
+    int fsrc, fdst;
+    long long int file_size;
+    int integrity=1;
+
+    if (verbose_flag) fprintf(stderr, "download %s %s\n", source, destination);
+    if (download_open(source, destination, &fsrc, &fdst, &file_size, &integrity)) return 1;
+
+    integrity=download_copy(fsrc, fdst, file_size, integrity, ddfs->aux_buffer);
+
+    close(fsrc);
+    if (fdst!=1) close(fdst);
+
+    return integrity!=1;
+}
+
+/*
+ * The sorted download read all the nodes of the file, then process them by
+ * windows of DOWNLOAD_WINDOW_SIZE bytes. Inside a window, the blocks are read
+ * in address order, consecutive blocks with one preadv(), blocks used more
+ * than once are read only once. The blocks are hashed by threads and are
+ * written in file order.
+ */
+#define DOWNLOAD_WINDOW_SIZE (32*1024*1024)
+#define DOWNLOAD_MAX_IOV     256
+
+struct download_slot
+{
+    long long int idx;      // position in the window
+    blockaddr addr;
+    int same;               // the same block is in slot[same] or -1
+    int bad_read;
+};
+
+struct download_window
+{
+    char *buffer;           // one block per slot in file order
+    unsigned char *hashes;  // one hash per slot in file order
+    struct download_slot *slots;    // sorted by address
+    int count;
+    int next;               // next slot to hash
+};
+
+static int download_slot_cmp(const void *a, const void *b)
+{
+    const struct download_slot *sa=a, *sb=b;
+    if (sa->addr!=sb->addr) return (sa->addr<sb->addr)?-1:1;
+    return (sa->idx<sb->idx)?-1:(sa->idx>sb->idx);
+}
+
+/**
+ * hash the blocks of the window, used by many threads
+ */
+static void *download_hasher(void *ptr)
+{
+    struct download_window *w=(struct download_window *)ptr;
+    int i;
+
+    while ((i=__sync_fetch_and_add(&w->next, 1))<w->count)
+    {
+        struct download_slot *slot=w->slots+i;
+        // block 1 is read as zeros and checked like the other ones
+        if (slot->same!=-1 || slot->addr==0) continue;
+        ddfs_hash(w->buffer+slot->idx*ddfs->c_block_size, w->hashes+slot->idx*HASH_SIZE);
+    }
+    return NULL;
+}
+
+/**
+ * read the blocks of the window in address order
+ *
+ * @param integrity is reset if a block cannot be read
+ * @return 0 for success, -1 for error
+ */
+static int download_read_window(struct download_window *w, int *integrity)
+{
+    struct iovec iov[DOWNLOAD_MAX_IOV];
+    int i, j, k, len;
+
+    for (i=0; i<w->count; i=j)
+    {
+        struct download_slot *slot=w->slots+i;
+        slot->same=-1;
+        slot->bad_read=0;
+        j=i+1;
+        if (slot->addr==0 || slot->addr==1 || slot->addr>=ddfs->c_block_count)
+        {   // let ddfs_read_full_block() handle them
+            len=ddfs_read_full_block(slot->addr, w->buffer+slot->idx*ddfs->c_block_size);
+            if (len!=ddfs->c_block_size) slot->bad_read=1;
+        }
+        else
+        {   // read a run of consecutive blocks
+            int n=0;
+            iov[n].iov_base=w->buffer+slot->idx*ddfs->c_block_size;
+            iov[n++].iov_len=ddfs->c_block_size;
+            while (j<w->count && n<DOWNLOAD_MAX_IOV && w->slots[j].addr<=slot->addr+n && w->slots[j].addr<ddfs->c_block_count)
+            {
+                if (w->slots[j].addr==w->slots[j-1].addr)
+                {   // already read
+                    w->slots[j].same=(w->slots[j-1].same==-1)?j-1:w->slots[j-1].same;
+                    w->slots[j].bad_read=0;
+                }
+                else
                 {
-                    badblock=1;
-                    status="bad"; // bad node
+                    w->slots[j].same=-1;
+                    w->slots[j].bad_read=0;
+                    iov[n].iov_base=w->buffer+w->slots[j].idx*ddfs->c_block_size;
+                    iov[n++].iov_len=ddfs->c_block_size;
                 }
+                j++;
             }
-            else
+            len=preadv(ddfs->bfile_ro, iov, n, slot->addr<<ddfs->block_size_shift);
+            if (len!=n*ddfs->c_block_size)
+            {   // read the blocks one by one to find the bad ones
+                for (k=i; k<j; k++)
+                {
+                    if (w->slots[k].same!=-1) continue;
+                    len=ddfs_read_full_block(w->slots[k].addr, w->buffer+w->slots[k].idx*ddfs->c_block_size);
+                    if (len!=ddfs->c_block_size) w->slots[k].bad_read=1;
+                }
+            }
+            else if (ddfs->c_compress)
             {
-                unsigned char hash[HASH_SIZE];
-                ddfs_hash(ddfs->aux_buffer, hash);
-                if (memcmp(node+ddfs->c_addr_size, hash, ddfs->c_hash_size)!=0)
+                for (k=i; k<j; k++)
                 {
-                    badblock=1;
-                    status="err";
-                    // fprintf(stderr, "err block %6lld %6lld %016llx<>%016llx\n", i, addr, *(long long int*)(node+ddfs->c_addr_size), *(long long int*)hash);
-                    // search the Index, maybe I can found the good hash ?
-                    blockaddr baddr;
-                    nodeidx node_idx=ddfs_search_hash(node+ddfs->c_addr_size, &baddr);
-                    //fprintf(stderr, "err node_idx=%lld baddr=%lld\n", node_idx, baddr);
-                    while (badblock && 0<=node_idx && node_idx<ddfs->c_node_count && 0==memcmp(node+ddfs->c_addr_size, ddfs->nodes+(ddfs->c_node_size*node_idx+ddfs->c_addr_size), ddfs->c_hash_size))
-                    {
-                        baddr=ddfs_get_node_addr(ddfs->nodes+(ddfs->c_node_size*node_idx));
-                        // fprintf(stderr, "test node node_idx=%lld baddr=%lld\n", node_idx, baddr);
-                        if (baddr!=addr && baddr!=1)
-                        {
-                            len=ddfs_read_full_block(baddr, ddfs->aux_buffer);
-                            if (len!=ddfs->c_block_size)
-                            {
-                                if (len==-1) fprintf(stderr, "error reading block file offset %lld (%s)\n", baddr*ddfs->c_block_size, strerror(errno));
-                                else fprintf(stderr, "error reading block file offset %lld short read %d/%d\n", baddr*ddfs->c_block_size, len, ddfs->c_block_size);
-                                if (!force_flag) goto ERROR1;
-                                ddfs_forced_read_full_block(baddr, ddfs->aux_buffer, 1024);
-                                integrity=0;
-                                len=ddfs->c_block_size;
-                                fake_block=1;
-                            }
-                            ddfs_hash(ddfs->aux_buffer, hash);
-                            if (0==memcmp(node+ddfs->c_addr_size, hash, ddfs->c_hash_size))
-                            {
-                                badblock=0;
-                                status="corrected";
-                                addr=baddr;
-                            }
-                        }
-                        node_idx++;
-                    }
+                    if (w->slots[k].same!=-1) continue;
+                    if (ddfs_decode_block(w->slots[k].addr, w->buffer+w->slots[k].idx*ddfs->c_block_size, w->buffer+w->slots[k].idx*ddfs->c_block_size)) w->slots[k].bad_read=1;
                 }
+            }
+        }
 
+        for (k=i; k<j; k++)
+        {
+            slot=w->slots+k;
+            if (slot->bad_read)
+            {
+                blockaddr addr=slot->addr;
+                fprintf(stderr, "error reading block file offset %lld\n", addr*ddfs->c_block_size);
+                *integrity=0;
+                if (!force_flag) return -1;
+                ddfs_forced_read_full_block(addr, w->buffer+slot->idx*ddfs->c_block_size, 1024);
+            }
+            if (slot->same!=-1)
+            {
+                struct download_slot *orig=w->slots+slot->same;
+                if (orig->bad_read) slot->bad_read=1;
+                memcpy(w->buffer+slot->idx*ddfs->c_block_size, w->buffer+orig->idx*ddfs->c_block_size, ddfs->c_block_size);
             }
         }
+    }
+    return 0;
+}
+
+/**
+ * download a file reading the blocks in address order
+ */
+int download_sorted(char *source, char *destination)
+{
+    struct download_window w;
+    struct stat st;
+    unsigned char *nodes=NULL;
+    int fsrc, fdst;
+    long long int file_size;
+    int integrity=1;
+    int i, len;
+
+    if (verbose_flag) fprintf(stderr, "download %s %s\n", source, destination);
+    if (download_open(source, destination, &fsrc, &fdst, &file_size, &integrity)) return 1;
+
+    memset(&w, '\0', sizeof(w));
+    int window=DOWNLOAD_WINDOW_SIZE/ddfs->c_block_size;
+    if (window<1) window=1;
+    int cpu=ddfs_cpu_count();
+    if (cpu<=0) cpu=2;
+    pthread_t *hashers=malloc(cpu*sizeof(pthread_t));
+    w.slots=malloc(window*sizeof(struct download_slot));
+    w.hashes=malloc(window*HASH_SIZE);
+    if (hashers==NULL || w.slots==NULL || w.hashes==NULL || posix_memalign((void *)&w.buffer, BLOCK_ALIGMENT, (long long int)window*ddfs->c_block_size))
+    {
+        w.buffer=NULL;
+        fprintf(stderr, "cannot allocate memory\n");
+        goto ERROR1;
+    }
+
+    // read all the nodes
+    if (fstat(fdst, &st)==-1)
+    {
+        perror(destination);
+        goto ERROR1;
+    }
+    int sparse=S_ISREG(st.st_mode);
+    if (fstat(fsrc, &st)==-1)
+    {
+        perror(source);
+        goto ERROR1;
+    }
+    long long int nodes_size=st.st_size-ddfs->c_file_header_size;
+    if (nodes_size<0) nodes_size=0;
+    long long int node_count=(nodes_size+ddfs->c_node_size-1)/ddfs->c_node_size;
+    nodes=calloc(node_count+1, ddfs->c_node_size);
+    if (nodes==NULL)
+    {
+        fprintf(stderr, "cannot allocate memory for %lld nodes\n", node_count);
+        goto ERROR1;
+    }
+    long long int done=0;
+    while (done<nodes_size)
+    {
+        len=pread(fsrc, nodes+done, nodes_size-done, ddfs->c_file_header_size+done);
+        if (len==-1)
+        {
+            fprintf(stderr, "error reading offset %lld (%s)\n", ddfs->c_file_header_size+done, strerror(errno));
+            goto ERROR1;
+        }
+        if (len==0) break;
+        done+=len;
+    }
+    if (done%ddfs->c_node_size || done<nodes_size)
+    {
+        long long int fileoff=ddfs->c_file_header_size+done/ddfs->c_node_size*ddfs->c_node_size;
+        fprintf(stderr, "error reading offset %lld short read %lld/%d\n", fileoff, done%ddfs->c_node_size, ddfs->c_node_size);
+        if (!force_flag) goto ERROR1;
+        // like download(), use a fake node for the incomplete one
+        node_count=done/ddfs->c_node_size+1;
+        memset(nodes+(node_count-1)*ddfs->c_node_size, '\0', ddfs->c_node_size);
+        ddfs_convert_addr(1, nodes+(node_count-1)*ddfs->c_node_size);
+        integrity=0;
+    }
+    long long int fake_node=(done%ddfs->c_node_size || done<nodes_size)?node_count-1:-1;
+
+    long long int first;
+    long long int write_size=0;
+    for (first=0; first<node_count; first+=w.count)
+    {
+        w.count=(node_count-first<window)?node_count-first:window;
+        for (i=0; i<w.count; i++)
+        {
+            w.slots[i].idx=i;
+            w.slots[i].addr=ddfs_get_node_addr(nodes+(first+i)*ddfs->c_node_size);
+        }
+        qsort(w.slots, w.count, sizeof(struct download_slot), download_slot_cmp);
+
+        if (download_read_window(&w, &integrity)) goto ERROR1;
+
+        if (check_integrity)
+        {
+            int n=(cpu<w.count)?cpu:w.count;
+            w.next=0;
+            for (i=0; i<n; i++) if (pthread_create(hashers+i, NULL, download_hasher, &w)) break;
+            n=i;
+            download_hasher(&w);    // help the threads, or do all the work if none started
+            for (i=0; i<n; i++) pthread_join(hashers[i], NULL);
+            for (i=0; i<w.count; i++)
+            {   // copy the hash of the blocks read only once
+                struct download_slot *slot=w.slots+i;
+                if (slot->same!=-1) memcpy(w.hashes+slot->idx*HASH_SIZE, w.hashes+w.slots[slot->same].idx*HASH_SIZE, HASH_SIZE);
+            }
+        }
+
+        // write in file order
+        for (i=0; i<w.count; i++)
+        {
+            unsigned char *node=nodes+(first+i)*ddfs->c_node_size;
+            char *buf=w.buffer+(long long int)i*ddfs->c_block_size;
+            blockaddr addr=ddfs_get_node_addr(node);
+            char *status="";
+            int badblock=0;
+            if (addr==1)
+            {
+                badblock=1;
+                status="corrupted";
+            }
+
+            if (check_integrity && first+i!=fake_node)
+            {
+                badblock=download_check_block(node, &addr, buf, w.hashes+i*HASH_SIZE, &status, &integrity);
+                if (badblock==-1) goto ERROR1;
+            }
+
+            if (badblock) integrity=0;
+
+            long long int sz=ddfs->c_block_size;
+            if (file_size!=-1)
+            {
+                sz=file_size-write_size;
+            }
+            if (sz>ddfs->c_block_size) sz=ddfs->c_block_size;
+
+            if (download_write(fdst, buf, sz, sparse && addr==0, write_size)) goto ERROR1; // no force_flag here
+            if (verbose_flag || 0!=strcmp(status, "ok"))
+            {
+                fprintf(stderr, "%6lld %6lld %016llx %s\n", first+i, addr, (long long int)ddfs_hton64(*(uint64_t*)(node+ddfs->c_addr_size)), status);
+            }
+            write_size+=sz;
+        }
+    }
+
+    if (download_truncate(fdst, sparse, write_size)) goto ERROR1;
+
+    if (verbose_flag)
+    {
+        if (file_size>0) fprintf(stderr, "        size: %lld\n", file_size);
+        else fprintf(stderr, "        size: NA\n");
+        fprintf(stderr, "written size: %lld\n", write_size);
+    }
+
+    free(nodes);
+    free(w.buffer);
+    free(w.hashes);
+    free(w.slots);
+    free(hashers);
+    close(fsrc);
+    if (fdst!=1) close(fdst);
+
+    return !integrity;
+
+    ERROR1:
+    free(nodes);
+    free(w.buffer);
+    free(w.hashes);
+    free(w.slots);
+    free(hashers);
+    if (fdst!=1 && fdst!=-1) close(fdst);
+    close(fsrc);
+    return 1;
+}
+
+/*
+ * The upload is a pipeline: one thread read the source into a ring of
+ * buffers, hasher threads calculate the hashes and the main thread update
+ * the index, write the nodes and the new blocks in order. Like the block
+ * re-hashing of fsckddumbfs, each buffer has a sequence number and go
+ * through the states empty -> read -> hashing -> hashed -> empty without any
+ * lock. Blocks of zeros are not hashed, they go through the state zero
+ * instead of read and get the address 0. New blocks that are consecutive in the block file are written
+ * together.
+ */
+#define UPLOAD_BUFFER_SIZE  (8*1024*1024)   // size of the ring
+#define UPLOAD_WRITE_SIZE   (1024*1024)     // max size of one write in the block file
+#define UPLOAD_NODE_BATCH   1024            // nodes written at once in the file
+
+enum ub_state { ub_empty, ub_read, ub_zero, ub_hashing, ub_hashed };
+
+struct upload_buffer
+{
+    volatile int state;
+    volatile long long int seq;
+    int len;
+    char *buffer;
+    unsigned char hash[HASH_SIZE];
+};
+
+struct upload_buffer *upload_buffers;
+int upload_buf_count;
+int upload_fsrc;
+long long int upload_tail=0;                // next sequence to index
+long long int upload_hash_next=0;           // next sequence to hash
+volatile long long int upload_read_end=-1;  // number of buffers read when the reader is done
+volatile int upload_read_errno=0;
+volatile int upload_abort=0;
+
+/**
+ * read the source into the ring
+ */
+static void *upload_reader(void *ptr)
+{
+    long long int seq;
+
+    for (seq=0; ; seq++)
+    {
+        struct upload_buffer *ub=upload_buffers+seq%upload_buf_count;
+        int spin=0;
+        while (seq>=upload_tail+upload_buf_count && !upload_abort) ddfs_spin_pause(&spin);
+        if (upload_abort) break;
+
+        int len=0;
+        while (len<ddfs->c_block_size)
+        {   // a pipe can return less than requested
+            int res=read(upload_fsrc, ub->buffer+len, ddfs->c_block_size-len);
+            if (res==-1)
+            {
+                upload_read_errno=errno;
+                break;
+            }
+            if (res==0) break;
+            len+=res;
+        }
+        if (upload_read_errno || len==0) break;
+
+        if (len<ddfs->c_block_size) memset(ub->buffer+len, '\0', ddfs->c_block_size-len);
+        ub->len=len;
+        ub->seq=seq;
+        int zero=ddfs_is_zero_block(ub->buffer);
+        __sync_synchronize();
+        ub->state=zero?ub_zero:ub_read;
+        if (len<ddfs->c_block_size)
+        {
+            seq++;
+            break;
+        }
+    }
+    __sync_synchronize();
+    upload_read_end=seq;
+    return NULL;
+}
+
+/**
+ * calculate the hashes of the buffers, used by many threads
+ */
+static void *upload_hasher(void *ptr)
+{
+    while (1)
+    {
+        long long int seq=__sync_fetch_and_add(&upload_hash_next, 1);
+        struct upload_buffer *ub=upload_buffers+seq%upload_buf_count;
+        int spin=0;
+        int zero=0;
+        while (1)
+        {
+            if (upload_abort || (upload_read_end!=-1 && seq>=upload_read_end)) return NULL;
+            if (ub->seq==seq)
+            {
+                __sync_synchronize();
+                if (__sync_bool_compare_and_swap(&ub->state, ub_read, ub_hashing)) break;
+                if (__sync_bool_compare_and_swap(&ub->state, ub_zero, ub_hashing))
+                {
+                    zero=1;
+                    break;
+                }
+            }
+            ddfs_spin_pause(&spin);
+        }
+        if (zero) memcpy(ub->hash, ddfs->zero_block_hash, ddfs->c_hash_size);
+        else ddfs_hash(ub->buffer, ub->hash);
+        __sync_synchronize();
+        ub->state=ub_hashed;
+    }
+    return NULL;
+}
 
-        if (badblock) integrity=0;
+/**
+ * consecutive new blocks waiting to be written in the block file
+ */
+struct upload_write
+{
+    char *buffer;
+    blockaddr addr;     // address of the first block
+    int count;
+    int max;
+};
 
-        long long int sz=ddfs->c_block_size;
-        if (file_size!=-1)
-        {
-            sz=file_size-write_size;
-        }
-        if (sz>ddfs->c_block_size) sz=ddfs->c_block_size;
+/**
+ * write the blocks waiting in the block file
+ *
+ * @return 0 for success, -errno for error
+ */
+static int upload_write_flush(struct upload_write *uw)
+{
+    long long int size=(long long int)uw->count*ddfs->c_block_size;
+    long long int done=0;
 
-        len=write(fdst, ddfs->aux_buffer, sz);
-        if (len!=sz)
+    while (done<size)
+    {
+        int len=pwrite(ddfs->bfile, uw->buffer+done, size-done, (uw->addr<<ddfs->block_size_shift)+done);
+        if (len==-1)
         {
-            if (len==-1) fprintf(stderr, "error writing file offset %lld (%s)\n", write_size, strerror(errno));
-            else fprintf(stderr, "error writing file, short write offset %lld %d/%lld\n", write_size, len, sz);
-            goto ERROR1; // no force_flag here
+            fprintf(stderr, "cannot write block file: %s\n", strerror(errno));
+            return -errno;
         }
-        if (verbose_flag || 0!=strcmp(status, "ok"))
+        if (len==0)
         {
-            fprintf(stderr, "%6lld %6lld %016llx %s\n", i, addr, (long long int)ddfs_hton64(*(uint64_t*)(node+ddfs->c_addr_size)), status);
+            fprintf(stderr, "cannot write block file, short write\n");
+            return -EIO;
         }
-
-        write_size+=sz;
-        i++;
+        done+=len;
     }
+    uw->count=0;
+    return 0;
+}
 
-    if (verbose_flag)
+/**
+ * add a new block to the blocks waiting to be written
+ *
+ * @return 0 for success, -errno for error
+ */
+static int upload_write_block(struct upload_write *uw, const char *block, blockaddr addr)
+{
+    if (ddfs->c_compress)
+    {   // every block has its own size
+        blockaddr res=ddfs_store_block(block, addr);
+        return (res<0)?res:0;
+    }
+    if (uw->count>0 && (uw->count==uw->max || uw->addr+uw->count!=addr))
     {
-        if (file_size>0) fprintf(stderr, "        size: %lld\n", file_size);
-        else fprintf(stderr, "        size: NA\n");
-        fprintf(stderr, "written size: %lld\n", write_size);
+        int res=upload_write_flush(uw);
+        if (res) return res;
     }
-
-    close(fsrc);
-    if (fdst!=1) close(fdst);
-
-    return !integrity;
-
-    ERROR1:
-    if (fdst!=1 && fdst!=-1) close(fdst);
-    close(fsrc);
-    return 1;
+    if (uw->count==0) uw->addr=addr;
+    memcpy(uw->buffer+(long long int)uw->count*ddfs->c_block_size, block, ddfs->c_block_size);
+    uw->count++;
+    return 0;
 }
 
-
 int upload(char *source, char *destination)
 {
     char dstfilename[FILENAME_MAX];
@@ -343,38 +969,126 @@ int upload(char *source, char *destination)
         return 1;
     }
 
-    size=0;
-    len=ddfs->c_block_size;
-    long long int i=0;
-    while (len==ddfs->c_block_size)
+    // start the pipeline
+    struct upload_write uw;
+    unsigned char *nodes;
+    pthread_t reader;
+    pthread_t *hashers;
+    int i;
+    int cpu=ddfs_cpu_count();
+    if (cpu<=0) cpu=2;
+
+    upload_buf_count=UPLOAD_BUFFER_SIZE/ddfs->c_block_size;
+    if (upload_buf_count<2+2*cpu) upload_buf_count=2+2*cpu;
+    upload_buffers=calloc(upload_buf_count, sizeof(struct upload_buffer));
+    char *upload_area=malloc((long long int)upload_buf_count*ddfs->c_block_size);
+    uw.max=UPLOAD_WRITE_SIZE/ddfs->c_block_size;
+    if (uw.max<1) uw.max=1;
+    uw.count=0;
+    if (posix_memalign((void *)&uw.buffer, BLOCK_ALIGMENT, (long long int)uw.max*ddfs->c_block_size)) uw.buffer=NULL; // for direct io
+    nodes=malloc(UPLOAD_NODE_BATCH*ddfs->c_node_size);
+    hashers=malloc(cpu*sizeof(pthread_t));
+    if (upload_buffers==NULL || upload_area==NULL || uw.buffer==NULL || nodes==NULL || hashers==NULL)
+    {
+        fprintf(stderr, "cannot allocate memory\n");
+        return 1;
+    }
+    for (i=0; i<upload_buf_count; i++)
     {
-        unsigned char node[NODE_SIZE];
-        long long int addr;
+        upload_buffers[i].buffer=upload_area+(long long int)i*ddfs->c_block_size;
+        upload_buffers[i].state=ub_empty;
+        upload_buffers[i].seq=-1;
+    }
+    upload_fsrc=fsrc;
+    pthread_create(&reader, NULL, upload_reader, NULL);
+    for (i=0; i<cpu; i++) pthread_create(hashers+i, NULL, upload_hasher, NULL);
 
-        len=read(fsrc, ddfs->aux_buffer, ddfs->c_block_size);
-        if (len==-1)
+    size=0;
+    res=0;
+    int node_count=0;
+    long long int seq;
+    for (seq=0; ; seq++)
+    {
+        struct upload_buffer *ub=upload_buffers+seq%upload_buf_count;
+        int spin=0;
+        while (ub->seq!=seq || ub->state!=ub_hashed)
         {
-            perror(source);
-            return 1;
+            if (upload_read_end!=-1)
+            {
+                __sync_synchronize();
+                if (seq>=upload_read_end) break;
+            }
+            ddfs_spin_pause(&spin);
+        }
+        if (ub->seq!=seq || ub->state!=ub_hashed) break; // the end
+        __sync_synchronize();
+
+        unsigned char *node=nodes+node_count*ddfs->c_node_size;
+        blockaddr addr=0;
+        size+=ub->len;
+        memcpy(node+ddfs->c_addr_size, ub->hash, ddfs->c_hash_size);
+        if (0!=memcmp(ub->hash, ddfs->zero_block_hash, ddfs->c_hash_size))
+        {
+            res=ddfs_index_hash(ub->hash, &addr);
+            if (res==1) res=upload_write_block(&uw, ub->buffer, addr);
+            if (res<0)
+            {
+                fprintf(stderr, "cannot store block %lld: %s\n", seq, strerror(-res));
+                break;
+            }
         }
-        size+=len;
-        if (len<ddfs->c_block_size) memset(ddfs->aux_buffer+len, '\0', ddfs->c_block_size-len);
-        addr=ddfs_write_block(ddfs->aux_buffer, node+ddfs->c_addr_size);
         ddfs_convert_addr(addr, node);
 
         if (verbose_flag)
         {
-            fprintf(stderr, "%6lld %6lld %016llx...\n", i, addr, (long long int)ddfs_hton64(*(uint64_t*)(node+ddfs->c_addr_size)));
+            fprintf(stderr, "%6lld %6lld %016llx...\n", seq, addr, (long long int)ddfs_hton64(*(uint64_t*)(node+ddfs->c_addr_size)));
+        }
+
+        ub->state=ub_empty;
+        __sync_synchronize();
+        upload_tail=seq+1;
+
+        node_count++;
+        if (node_count==UPLOAD_NODE_BATCH)
+        {
+            len=write(fdst, nodes, node_count*ddfs->c_node_size);
+            if (len!=node_count*ddfs->c_node_size)
+            {
+                fprintf(stderr, "error writing file\n");
+                res=-EIO;
+                break;
+            }
+            node_count=0;
         }
+    }
 
-        res=write(fdst, node, ddfs->c_node_size);
-        if (res!=ddfs->c_node_size)
+    upload_abort=(res<0);
+    pthread_join(reader, NULL);
+    for (i=0; i<cpu; i++) pthread_join(hashers[i], NULL);
+
+    if (res>=0 && upload_read_errno)
+    {
+        fprintf(stderr, "%s: %s\n", source, strerror(upload_read_errno));
+        res=-upload_read_errno;
+    }
+    // the blocks waiting in uw are already in the index, write them even on error
+    int flush_res=upload_write_flush(&uw);
+    if (res>=0) res=flush_res;
+    if (res>=0 && node_count>0)
+    {
+        len=write(fdst, nodes, node_count*ddfs->c_node_size);
+        if (len!=node_count*ddfs->c_node_size)
         {
             fprintf(stderr, "error writing file\n");
-            return 1;
+            res=-EIO;
         }
-        i++;
     }
+    free(nodes);
+    free(uw.buffer);
+    free(upload_area);
+    free(upload_buffers);
+    free(hashers);
+    if (res<0) return 1;
 
     // write size
     len=file_header_get_conv(fdst, size);
@@ -396,6 +1110,375 @@ int upload(char *source, char *destination)
 
 }
 
+/*
+ * Recursive copy (-r): the source tree is walked by nftw() to list the
+ * directories, the symbolic links and the regular files. The directories
+ * and the links are created first, then the files are copied by jobs_count
+ * threads sharing the index, each one with its own buffers. The index and
+ * the list of used blocks are protected by index_mutex. The permissions,
+ * the owner and the times are copied, the ones of the directories at the
+ * end, after their content.
+ */
+struct tree_entry
+{
+    char *src;
+    char *dst;
+    struct stat st;
+};
+
+struct tree_entry *tree_entries=NULL;
+long long int tree_count=0;
+long long int tree_size=0;
+long long int tree_next=0;          // next entry to copy by the threads
+long long int tree_errors=0;
+const char *tree_src_root;
+const char *tree_dst_root;
+int tree_upload;
+int jobs_count=0;
+pthread_mutex_t index_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+static int tree_add(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
+{
+    if (typeflag==FTW_DNR || typeflag==FTW_NS)
+    {
+        fprintf(stderr, "cannot read: %s\n", fpath);
+        tree_errors++;
+        return 0;
+    }
+    if (!S_ISDIR(sb->st_mode) && !S_ISREG(sb->st_mode) && !S_ISLNK(sb->st_mode))
+    {
+        fprintf(stderr, "skip special file: %s\n", fpath);
+        return 0;
+    }
+
+    if (tree_count==tree_size)
+    {
+        tree_size=tree_size?tree_size*2:1024;
+        struct tree_entry *entries=realloc(tree_entries, tree_size*sizeof(struct tree_entry));
+        if (entries==NULL)
+        {
+            fprintf(stderr, "cannot allocate memory\n");
+            return 1;
+        }
+        tree_entries=entries;
+    }
+
+    struct tree_entry *e=tree_entries+tree_count;
+    e->src=strdup(fpath);
+    e->dst=malloc(strlen(tree_dst_root)+strlen(fpath+strlen(tree_src_root))+1);
+    if (e->src==NULL || e->dst==NULL)
+    {
+        fprintf(stderr, "cannot allocate memory\n");
+        return 1;
+    }
+    strcpy(e->dst, tree_dst_root);
+    strcat(e->dst, fpath+strlen(tree_src_root));
+    e->st=*sb;
+    tree_count++;
+    return 0;
+}
+
+/**
+ * copy the permissions, the owner and the times
+ *
+ * @param fd the file or -1 to use the path
+ * @param path the file
+ * @param st the attributes to copy
+ */
+static void tree_set_attr(int fd, const char *path, const struct stat *st)
+{
+    struct timespec times[2];
+    int res;
+
+    times[0]=st->st_atim;
+    times[1]=st->st_mtim;
+    if (fd!=-1)
+    {
+        if (fchown(fd, st->st_uid, st->st_gid)==-1 && errno!=EPERM) perror(path);
+        res=fchmod(fd, st->st_mode & 07777);
+        if (res==0) res=futimens(fd, times);
+    }
+    else
+    {
+        if (lchown(path, st->st_uid, st->st_gid)==-1 && errno!=EPERM) perror(path);
+        res=S_ISLNK(st->st_mode)?0:chmod(path, st->st_mode & 07777);
+        if (res==0) res=utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW);
+    }
+    if (res==-1)
+    {
+        perror(path);
+        __sync_add_and_fetch(&tree_errors, 1);
+    }
+}
+
+/**
+ * upload one file, used concurrently by the threads of tree_copy()
+ *
+ * @param buf a buffer of c_block_size bytes
+ * @param nodes a buffer for UPLOAD_NODE_BATCH nodes
+ * @return 0 for success, 1 for error
+ */
+static int tree_upload_file(struct tree_entry *e, char *buf, unsigned char *nodes)
+{
+    uint64_t size=0;
+    int node_count=0;
+    int len, res=0;
+
+    int fsrc=open(e->src, O_RDONLY);
+    if (fsrc==-1)
+    {
+        perror(e->src);
+        return 1;
+    }
+    int fdst=open(e->dst, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fdst==-1 || lseek(fdst, ddfs->c_file_header_size, SEEK_SET)==-1)
+    {
+        perror(e->dst);
+        close(fsrc);
+        if (fdst!=-1) close(fdst);
+        return 1;
+    }
+
+    len=ddfs->c_block_size;
+    while (res==0 && len==ddfs->c_block_size)
+    {
+        unsigned char *node=nodes+node_count*ddfs->c_node_size;
+        blockaddr addr=0;
+
+        len=0;
+        while (len<ddfs->c_block_size)
+        {
+            int l=read(fsrc, buf+len, ddfs->c_block_size-len);
+            if (l==-1)
+            {
+                perror(e->src);
+                res=1;
+                break;
+            }
+            if (l==0) break;
+            len+=l;
+        }
+        if (res || len==0) break;
+        size+=len;
+        if (len<ddfs->c_block_size) memset(buf+len, '\0', ddfs->c_block_size-len);
+
+        if (ddfs_is_zero_block(buf))
+        {   // don't hash it
+            memcpy(node+ddfs->c_addr_size, ddfs->zero_block_hash, ddfs->c_hash_size);
+        }
+        else
+        {
+            ddfs_hash(buf, node+ddfs->c_addr_size);
+            pthread_mutex_lock(&index_mutex);
+            int new=ddfs_index_hash(node+ddfs->c_addr_size, &addr);
+            pthread_mutex_unlock(&index_mutex);
+            if (new==1) new=ddfs_store_block(buf, addr);
+            if (new<0)
+            {
+                fprintf(stderr, "cannot store block of %s: %s\n", e->src, strerror(-new));
+                res=1;
+                break;
+            }
+        }
+        ddfs_convert_addr(addr, node);
+
+        node_count++;
+        if (node_count==UPLOAD_NODE_BATCH || len<ddfs->c_block_size)
+        {
+            if (write(fdst, nodes, node_count*ddfs->c_node_size)!=node_count*ddfs->c_node_size)
+            {
+                fprintf(stderr, "error writing file: %s\n", e->dst);
+                res=1;
+            }
+            node_count=0;
+        }
+    }
+
+    if (res==0 && node_count>0 && write(fdst, nodes, node_count*ddfs->c_node_size)!=node_count*ddfs->c_node_size)
+    {
+        fprintf(stderr, "error writing file: %s\n", e->dst);
+        res=1;
+    }
+    if (res==0 && file_header_get_conv(fdst, size)!=ddfs->c_file_header_size)
+    {
+        fprintf(stderr, "cannot write file header: %s\n", e->dst);
+        res=1;
+    }
+    if (res==0) tree_set_attr(fdst, e->dst, &e->st);
+    close(fsrc);
+    close(fdst);
+    return res;
+}
+
+/**
+ * download one file, used concurrently by the threads of tree_copy()
+ *
+ * @param buf a buffer of c_block_size bytes
+ * @return 0 for success, 1 for error or if the integrity check failed
+ */
+static int tree_download_file(struct tree_entry *e, char *buf)
+{
+    long long int file_size;
+    int integrity=1;
+
+    int fsrc=open(e->src, O_RDONLY);
+    if (fsrc==-1)
+    {
+        perror(e->src);
+        return 1;
+    }
+    if (download_header(fsrc, e->src, &file_size, &integrity))
+    {
+        close(fsrc);
+        return 1;
+    }
+    int fdst=open(e->dst, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fdst==-1)
+    {
+        perror(e->dst);
+        close(fsrc);
+        return 1;
+    }
+
+    integrity=download_copy(fsrc, fdst, file_size, integrity, buf);
+    if (integrity!=-1) tree_set_attr(fdst, e->dst, &e->st);
+    if (integrity==0) fprintf(stderr, "integrity check failed: %s\n", e->src);
+    close(fsrc);
+    close(fdst);
+    return integrity!=1;
+}
+
+static void *tree_copy_files(void *ptr)
+{
+    char *buf=NULL;
+    unsigned char *nodes=malloc(UPLOAD_NODE_BATCH*ddfs->c_node_size);
+    if (nodes==NULL || posix_memalign((void *)&buf, BLOCK_ALIGMENT, ddfs->c_block_size))
+    {
+        fprintf(stderr, "cannot allocate memory\n");
+        __sync_add_and_fetch(&tree_errors, 1);
+        free(nodes);
+        return NULL;
+    }
+
+    long long int i;
+    while ((i=__sync_fetch_and_add(&tree_next, 1))<tree_count)
+    {
+        struct tree_entry *e=tree_entries+i;
+        if (!S_ISREG(e->st.st_mode)) continue;
+        if (verbose_flag) fprintf(stderr, "%s %s %s\n", tree_upload?"upload":"download", e->src, e->dst);
+        int res=tree_upload?tree_upload_file(e, buf, nodes):tree_download_file(e, buf);
+        if (res) __sync_add_and_fetch(&tree_errors, 1);
+    }
+    free(buf);
+    free(nodes);
+    return NULL;
+}
+
+/**
+ * copy a directory tree from or to the filesystem
+ *
+ * @param source the top directory to copy
+ * @param destination the directory to create or the directory where to
+ * create a copy of source
+ * @param upload 1 to copy into the filesystem, 0 to copy from it
+ * @return 0 for success, 1 if any error
+ */
+int tree_copy(char *source, char *destination, int upload)
+{
+    char dstroot[FILENAME_MAX];
+    long long int i;
+
+    if (upload && (ddfs->auto_fsck || ddfs->rebuild_fsck))
+    {
+        fprintf(stderr, "The filesystem must be checked.\n");
+        return 1;
+    }
+
+    // remove the trailing '/'
+    int l=strlen(source);
+    while (l>1 && source[l-1]=='/') source[--l]='\0';
+
+    if (isdir(destination))
+    {
+        char *p=strrchr(source, '/');
+        if (p==NULL) p=source;
+        else p=p+1;
+        snprintf(dstroot, FILENAME_MAX, "%s/%s", destination, p);
+    }
+    else snprintf(dstroot, FILENAME_MAX, "%s", destination);
+
+    tree_src_root=source;
+    tree_dst_root=dstroot;
+    tree_upload=upload;
+    if (nftw(source, tree_add, 64, FTW_PHYS | FTW_MOUNT))
+    {
+        if (errno) perror(source);
+        return 1;
+    }
+
+    // create directories and symbolic links, parents come first
+    for (i=0; i<tree_count; i++)
+    {
+        struct tree_entry *e=tree_entries+i;
+        if (S_ISDIR(e->st.st_mode))
+        {
+            if (mkdir(e->dst, 0700)==-1 && errno!=EEXIST)
+            {
+                perror(e->dst);
+                return 1;
+            }
+        }
+        else if (S_ISLNK(e->st.st_mode))
+        {
+            char target[FILENAME_MAX];
+            int len=readlink(e->src, target, sizeof(target)-1);
+            if (len==-1)
+            {
+                perror(e->src);
+                tree_errors++;
+                continue;
+            }
+            target[len]='\0';
+            unlink(e->dst);
+            if (symlink(target, e->dst)==-1)
+            {
+                perror(e->dst);
+                tree_errors++;
+                continue;
+            }
+            tree_set_attr(-1, e->dst, &e->st);
+        }
+    }
+
+    // copy the files
+    int jobs=jobs_count;
+    if (jobs<=0) jobs=ddfs_cpu_count();
+    if (jobs<=0) jobs=2;
+    pthread_t *threads=malloc(jobs*sizeof(pthread_t));
+    if (threads==NULL)
+    {
+        fprintf(stderr, "cannot allocate memory\n");
+        return 1;
+    }
+    tree_next=0;
+    for (i=0; i<jobs; i++) pthread_create(threads+i, NULL, tree_copy_files, NULL);
+    for (i=0; i<jobs; i++) pthread_join(threads[i], NULL);
+    free(threads);
+
+    // set the directories attributes, children first
+    for (i=tree_count-1; i>=0; i--)
+    {
+        struct tree_entry *e=tree_entries+i;
+        if (S_ISDIR(e->st.st_mode)) tree_set_attr(-1, e->dst, &e->st);
+        free(e->src);
+        free(e->dst);
+    }
+    free(tree_entries);
+
+    if (tree_errors) fprintf(stderr, "%lld error(s)\n", tree_errors);
+    return tree_errors!=0;
+}
+
 struct ddfs_ctx ddfsctx;
 
 int main(int argc, char *argv[])
@@ -409,7 +1492,7 @@ int main(int argc, char *argv[])
         // getopt_long stores the option index here.
         int option_index = 0;
 
-        c=getopt_long(argc, argv, "hvlcf", long_options, &option_index);
+        c=getopt_long(argc, argv, "hvlcfsrj:", long_options, &option_index);
 
         // Detect the end of the options.
         if (c==-1) break;
@@ -438,6 +1521,18 @@ int main(int argc, char *argv[])
                 force_flag=1;
                 break;
 
+            case 's':
+                sorted_flag=1;
+                break;
+
+            case 'r':
+                recursive_flag=1;
+                break;
+
+            case 'j':
+                jobs_count=atoi(optarg);
+                break;
+
             case '?':
                 // getopt_long already printed an error message.
                 break;
@@ -482,9 +1577,26 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    if (down)
+    if (up && ddfs_refcount_invalidate()==-1)
+    {
+        fprintf(stderr, "cannot remove %s (%s)\n", REFCOUNT_FILENAME, strerror(errno));
+        ddfs_close();
+        return 1;
+    }
+
+    if (recursive_flag && (up || down))
+    {
+        res=tree_copy(argv[optind], argv[optind+1], up);
+        if (down && check_integrity)
+        {
+            if (res) fprintf(stderr, "ERR\n");
+            else fprintf(stderr, "OK\n");
+        }
+    }
+    else if (down)
     {
-        res=download(argv[optind], argv[optind+1]);
+        if (sorted_flag) res=download_sorted(argv[optind], argv[optind+1]);
+        else res=download(argv[optind], argv[optind+1]);
         if (check_integrity)
         {
             if (res) fprintf(stderr, "ERR\n");
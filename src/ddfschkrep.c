@@ -47,7 +47,6 @@ FILE *te_corrupted_stream=NULL;
 
 struct bit_array *te_block_found_in_files=NULL;
 struct bit_array *te_update_index=NULL;
-struct bit_array *te_usedblocks=NULL;
 
 
 /**
@@ -639,55 +638,52 @@ int ddfs_fsck_tree_explore_old(const char *fpath, const struct stat *sb, int typ
     return 0;
 }
 
+// per thread data of ddfs_fsck_tree_find_usedblocks()
+struct fsck_walk
+{
+    struct bit_array usedblocks;    // merged into the final list at the end of the walk
+    unsigned char *nodes;           // DDFS_WALK_NODES nodes read at once
+};
+
 /**
- * function called by nftw to build the usedblocks list
+ * function called by ddfs_walk_tree() to build the usedblocks list,
+ * concurrently by multiple threads
  *
  */
-int ddfs_fsck_tree_find_usedblocks(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
+int ddfs_fsck_tree_find_usedblocks(const char *fpath, const struct stat *sb, int thread, void *ctx)
 {
-    int len, res;
+    struct fsck_walk *fw=(struct fsck_walk *)ctx+thread;
+    int i, len, count;
     blockaddr addr;
     uint64_t size;
+    unsigned char *node;
 
-    // Reset the global variable
-    te_block_counter=0;
-
-    // We need a place to store one node at a time
-    unsigned char node[NODE_SIZE];
-
-    if(!te_usedblocks) {
-        DDFS_LOG(LOG_ERR, "ddfs_fsck_tree_find_usedblocks() called without te_usedblocks being set\n");
-	return 1;
-    }
-
-    if (typeflag!=FTW_F || ! S_ISREG(sb->st_mode)) return 0;
     if (0==strncmp(fpath+ddfs->rdir_len, SPECIAL_DIR, ddfs->special_dir_len))
     {   // skip SPECIAL_DIR
         return 0;
     }
 
-    te_file_count++;
-    if (te_progress && now()-te_progress>NOW_PER_SEC)
+    long long int file_count=__sync_add_and_fetch(&te_file_count, 1);
+    if (thread==0 && te_progress && now()-te_progress>NOW_PER_SEC)
     {
 	te_progress=now();
-	printf("Read file: %lld in %llds\r", te_file_count, (te_progress-te_start)/NOW_PER_SEC);
+	printf("Read file: %lld in %llds\r", file_count, (te_progress-te_start)/NOW_PER_SEC);
 	fflush(stdout);
     }
 
-    FILE *file;
-    file=fopen(fpath, "r");
-    if (file==NULL)
+    int fd=open(fpath, O_RDONLY);
+    if (fd==-1)
     {
         DDFS_LOG(LOG_ERR, "cannot open: %s (%s)\n", fpath, strerror(errno));
         return 1;
     }
 
     // be careful, file_header_set_conv return c_file_header_size for empty file
-    len=file_header_set_conv(fileno(file), &size);
+    len=file_header_set_conv(fd, &size);
     if (len==-1)
     {
         DDFS_LOG(LOG_ERR, "cannot read header: %s (%s)\n", fpath, strerror(errno));
-        fclose(file);
+        close(fd);
         return 1;
     }
     else if (len!=ddfs->c_file_header_size)
@@ -698,43 +694,70 @@ int ddfs_fsck_tree_find_usedblocks(const char *fpath, const struct stat *sb, int
             fprintf(te_corrupted_stream, " H   %s\n", fpath);
             DDFS_LOG(LOG_WARNING,  " H   %s\n", fpath);
         }
-        te_corrupted_count++;
-        fclose(file);
+        __sync_add_and_fetch(&te_corrupted_count, 1);
+        close(fd);
         return 0;
     }
 
-    res=fseek(file, ddfs->c_file_header_size, SEEK_SET);
-    if (res==-1)
+    long long int node_pos=0;
+    while ((len=ddfs_read_nodes(fd, node_pos, fw->nodes, DDFS_WALK_NODES))>0)
     {
-        DDFS_LOG(LOG_ERR, "cannot seek at first block: %s (%s)\n", fpath, strerror(errno));
-        fclose(file);
-        return 1;
-    }
-
-    len=fread(node, 1, ddfs->c_node_size, file);
-    while(len == ddfs->c_node_size) {
-	addr=ddfs_get_node_addr(node);
-
-	// Mark the block as used if it's in the right range
-	if (addr>=0 && addr <ddfs->c_block_count) {
-	    bit_array_set(te_usedblocks, addr);
-	}
+        count=len/ddfs->c_node_size;
+        for (i=0, node=fw->nodes; i<count; i++, node+=ddfs->c_node_size)
+        {
+            addr=ddfs_get_node_addr(node);
 
-	// Read the next block from the file
-	len=fread(node, 1, ddfs->c_node_size, file);
+            // Mark the block as used if it's in the right range
+            if (addr>=0 && addr <ddfs->c_block_count) {
+                bit_array_set(&fw->usedblocks, addr);
+            }
+        }
+        node_pos+=count;
+        if (count<DDFS_WALK_NODES) break; // end of file
     }
 
     if (len==-1)
     {
         DDFS_LOG(LOG_ERR, "cannot read file: %s (%s)\n", fpath, strerror(errno));
-        fclose(file);
+        close(fd);
         return 1;
     }
 
-    fclose(file);
+    close(fd);
     return 0;
 }
 
+/**
+ * read all files in parallel to build the usedblocks list
+ *
+ * @param usedblocks the blocks found in the files are added here
+ * @return 0 if all files have been read
+ */
+int ddfs_fsck_find_usedblocks(struct bit_array *usedblocks)
+{
+    int i, res=0;
+    int threads=ddfs_walk_threads((ddfs->c_block_count+7)/8+DDFS_WALK_NODES*ddfs->c_node_size);
+    struct fsck_walk *fw=calloc(threads, sizeof(struct fsck_walk));
+    if (fw==NULL) res=-1;
+    for (i=0; res==0 && i<threads; i++)
+    {
+        fw[i].nodes=malloc(DDFS_WALK_NODES*ddfs->c_node_size);
+        if (fw[i].nodes==NULL || bit_array_init(&fw[i].usedblocks, ddfs->c_block_count, 0)) res=-1;
+    }
+
+    if (res==0) res=ddfs_walk_tree(ddfs->rdir, threads, ddfs_fsck_tree_find_usedblocks, fw);
+    else DDFS_LOG(LOG_ERR, "cannot allocate memory for %d threads\n", threads);
+
+    for (i=0; fw && i<threads; i++)
+    {
+        if (res==0) bit_array_bwor(&fw[i].usedblocks, usedblocks);
+        bit_array_release(&fw[i].usedblocks);
+        free(fw[i].nodes);
+    }
+    free(fw);
+    return res;
+}
+
 /**
  * function called by nftw to walk through the directory tree
  *
@@ -1088,6 +1111,78 @@ long long int ddfs_fsck_cleanup_index_from_extra_blocks(struct bit_array *ba_lis
  - Fix the files to match the index
 */
 
+/**
+ * remove the node of a block from the index
+ *
+ * @param addr the block
+ * @param hash the hash of the block
+ */
+static void ddfs_fsck_node_remove(blockaddr addr, const unsigned char *hash)
+{
+    nodeidx idx;
+    for (idx=ddfs_hash2idx(hash); idx<ddfs->c_node_count; idx++)
+    {
+        unsigned char *node=ddfs->nodes+(idx*ddfs->c_node_size);
+        blockaddr naddr=ddfs_get_node_addr(node);
+        if (naddr==0) return;
+        int res=memcmp(node+ddfs->c_addr_size, hash, ddfs->c_hash_size);
+        if (res>0) return;
+        if (res==0 && naddr==addr)
+        {
+            node_delete(idx);
+            return;
+        }
+    }
+}
+
+/**
+ * replay the journal left by ddumbfs after a crash. The nodes of the
+ * committed allocations are added to the index, and their blocks are
+ * known to hold the right data. The nodes of the freed blocks are removed.
+ *
+ * @param trusted the blocks that don't need to be re-hashed
+ * @return the number of records replayed
+ */
+long long int ddfs_fsck_journal_replay(struct bit_array *trusted)
+{
+    struct ddfs_journal_header header[2];
+    struct ddfs_journal_rec rec;
+    unsigned char node[NODE_SIZE];
+    long long int count=0;
+    int fd[2], i;
+
+    fd[0]=ddfs_journal_open(0, header);
+    fd[1]=ddfs_journal_open(1, header+1);
+    // the oldest segment first
+    int first=(fd[0]!=-1 && fd[1]!=-1 && header[1].seq<header[0].seq) ? 1 : 0;
+
+    for (i=0; i<2; i++)
+    {
+        int segment=first^i;
+        if (fd[segment]==-1) continue;
+        while (read(fd[segment], &rec, sizeof(rec))==sizeof(rec))
+        {   // stop at the first incomplete record
+            if (rec.check!=ddfs_journal_checksum(&rec) || rec.addr<=DDFS_LAST_RESERVED_BLOCK || rec.addr>=ddfs->c_block_count) break;
+            if (rec.type==DDFS_JOURNAL_ALLOC)
+            {
+                ddfs_convert_addr(rec.addr, node);
+                memcpy(node+ddfs->c_addr_size, rec.hash, ddfs->c_hash_size);
+                if (node_add(node, na_duplicate_hash_allowed)!=0) break;
+                bit_array_set(trusted, rec.addr);
+            }
+            else if (rec.type==DDFS_JOURNAL_FREE)
+            {
+                ddfs_fsck_node_remove(rec.addr, rec.hash);
+                bit_array_unset(trusted, rec.addr);
+            }
+            else break;
+            count++;
+        }
+        close(fd[segment]);
+    }
+    return count;
+}
+
 int ddfs_fsck(int relaxed, int verbose, int progress)
 {
     int res;
@@ -1098,12 +1193,14 @@ int ddfs_fsck(int relaxed, int verbose, int progress)
     struct bit_array ba_found_in_nodes;
     struct bit_array ba_suspect_need_rehash;
     struct bit_array ba_backup;
+    struct bit_array ba_journal;
 
     // Create some bit arrays to keep track of things during the check
     bit_array_init(&ba_found_in_files, ddfs->c_block_count, 0x0);
     bit_array_init(&ba_found_in_nodes, ddfs->c_block_count, 0x0);
     bit_array_init(&ba_suspect_need_rehash, ddfs->c_block_count, 0x0);
     bit_array_init(&ba_backup, ddfs->c_block_count, 0x0);
+    bit_array_init(&ba_journal, ddfs->c_block_count, 0x0);
 
     // Reset the suspect need rehash array
     bit_array_reset(&ba_suspect_need_rehash, 0);
@@ -1116,6 +1213,12 @@ int ddfs_fsck(int relaxed, int verbose, int progress)
     errors=ddfs_fsck_repair_node_order(&ba_suspect_need_rehash, verbose);
     DDFS_LOG(LOG_INFO, "Check and repair node order in index: fixed %lld errors.\n", errors);
 
+    //
+    // replay the journal of the blocks allocated and freed by ddumbfs, if any
+    //
+    errors=ddfs_fsck_journal_replay(&ba_journal);
+    if (errors) DDFS_LOG(LOG_INFO, "Replay %lld records from the journal.\n", errors);
+
     //
     // read files to retrieve block numbers in use
     //
@@ -1128,15 +1231,14 @@ int ddfs_fsck(int relaxed, int verbose, int progress)
     bit_array_reset(&ba_found_in_files, 0);
     bit_array_set(&ba_found_in_files, 0);  // block ZERO is always used
     bit_array_set(&ba_found_in_files, 1);  // block    1 is always used
-    te_usedblocks=&ba_found_in_files;
 
     DDFS_LOG(LOG_INFO, "Search files to find all used blocks.\n");
     start=now();
-    res=nftw(ddfs->rdir, ddfs_fsck_tree_find_usedblocks, 10, FTW_MOUNT | FTW_PHYS);
+    res=ddfs_fsck_find_usedblocks(&ba_found_in_files);
     end=now();
     if (res)
     {
-        DDFS_LOG(LOG_ERR, "nftw is unable to read all files, correct and check filesystem again !\n");
+        DDFS_LOG(LOG_ERR, "unable to read all files, correct and check filesystem again !\n");
         res=1;
         goto END;
     }
@@ -1167,6 +1269,9 @@ int ddfs_fsck(int relaxed, int verbose, int progress)
 	    // Save the current count of bits set
             bit_array_count(&ba_suspect_need_rehash, &suspect_count1, &u);
 
+	    // Blocks allocated since the save but committed in the journal hold the right data
+            bit_array_bwor(&ba_journal, &ba_backup);
+
 	    // Merge the difference between the current used block list and saved list with the suspect list
             bit_array_plus_diff(&ba_suspect_need_rehash, &ba_found_in_files, &ba_backup);
             bit_array_count(&ba_suspect_need_rehash, &suspect_count2, &u);
@@ -1207,9 +1312,9 @@ int ddfs_fsck(int relaxed, int verbose, int progress)
 //    ddfs_fsck_cleanup_index_from_extra_blocks(&ddfs->ba_usedblocks);
 
     //
-    // Update used_block list backup
+    // Update used_block list backup, the journal is not needed anymore
     //
-    ddfs_save_usedblocks();
+    if (ddfs_save_usedblocks()==0) ddfs_journal_remove();
 
 
     // blocks in ba_suspect_need_rehash are referenced twice or more and need to be verified
@@ -1231,6 +1336,7 @@ END:
     bit_array_release(&ba_found_in_nodes);
     bit_array_release(&ba_suspect_need_rehash);
     bit_array_release(&ba_backup);
+    bit_array_release(&ba_journal);
 
     return res;
 }
@@ -0,0 +1,372 @@
+/*
+ * ddfsclient.c
+ *
+ * client of the socket interface of ddumbfs
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ddfsclient.h"
+
+static int client_send(int sock, const void *buf, size_t len)
+{
+    size_t sz=0;
+    while (sz<len)
+    {
+        ssize_t n=send(sock, (const char *)buf+sz, len-sz, MSG_NOSIGNAL);
+        if (n==-1 && errno==EINTR) continue;
+        if (n==-1) return -errno;
+        if (n==0) return -EPIPE;
+        sz+=n;
+    }
+    return 0;
+}
+
+static int client_recv(int sock, void *buf, size_t len)
+{
+    size_t sz=0;
+    while (sz<len)
+    {
+        ssize_t n=recv(sock, (char *)buf+sz, len-sz, 0);
+        if (n==-1 && errno==EINTR) continue;
+        if (n==-1) return -errno;
+        if (n==0) return -EPIPE;
+        sz+=n;
+    }
+    return 0;
+}
+
+static int client_request(struct ddfs_client *cli, int command, long long int offset, long long int size, long long int aux)
+{
+    struct socket_operation sop;
+
+    memset(&sop, 0, sizeof(sop));
+    sop.command=command;
+    sop.offset=offset;
+    sop.size=size;
+    sop.aux=aux;
+    return client_send(cli->sock, &sop, sizeof(sop));
+}
+
+/**
+ * read the reply of the oldest pending write and release its buffer
+ *
+ * @return 0 or -errno if the connection is broken
+ */
+static int client_wait(struct ddfs_client *cli)
+{
+    int res;
+    int err=client_recv(cli->sock, &res, sizeof(res));
+    if (err) return err;
+
+    cli->tail=cli->pending[cli->pending_first].end;
+    cli->pending_first=(cli->pending_first+1)%DDFS_CLIENT_MAX_PENDING;
+    cli->pending_n--;
+    if (res<0 && cli->error==0) cli->error=res;
+    return 0;
+}
+
+/**
+ * send a request and wait for its reply, after the pending writes
+ *
+ * @return the reply or -errno
+ */
+static int client_call(struct ddfs_client *cli, int command, long long int offset, long long int size, long long int aux, const void *data)
+{
+    int reply;
+    int res=ddfs_client_sync(cli);
+    if (res) return res;
+
+    res=client_request(cli, command, offset, size, aux);
+    if (res==0 && data) res=client_send(cli->sock, data, size);
+    if (res==0) res=client_recv(cli->sock, &reply, sizeof(reply));
+    return res?res:reply;
+}
+
+/**
+ * create a shared memory that can be passed to another process
+ *
+ * @return the file descriptor or -errno
+ */
+static int client_shm_create(long long int size)
+{
+    char filename[]="/dev/shm/ddfsclient-XXXXXX";
+    char tmpname[]="/tmp/ddfsclient-XXXXXX";
+
+    char *name=filename;
+    int fd;
+
+#ifdef MFD_ALLOW_SEALING
+    fd=memfd_create("ddfsclient", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd!=-1)
+    {   // ddumbfs maps the memory only if it cannot shrink
+        if (ftruncate(fd, size)==-1 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL)==-1)
+        {
+            int err=-errno;
+            close(fd);
+            return err;
+        }
+        return fd;
+    }
+#endif
+    fd=mkstemp(filename);
+    if (fd==-1)
+    {   // no /dev/shm
+        name=tmpname;
+        fd=mkstemp(tmpname);
+    }
+    if (fd==-1) return -errno;
+    unlink(name);
+    if (ftruncate(fd, size)==-1)
+    {
+        int err=-errno;
+        close(fd);
+        return err;
+    }
+    return fd;
+}
+
+/**
+ * connect to ddumbfs and share a memory of shm_size bytes with it
+ *
+ * @param cli the client to initialize
+ * @param path the socket of ddumbfs
+ * @param shm_size the size of the ring, must be enough for the pending writes
+ * @return 0 or -errno
+ */
+int ddfs_client_connect(struct ddfs_client *cli, const char *path, long long int shm_size)
+{
+    struct sockaddr_un remote;
+    int res;
+
+    memset(cli, 0, sizeof(*cli));
+    cli->sock=-1;
+    if (strlen(path)>=sizeof(remote.sun_path)) return -ENAMETOOLONG;
+
+    cli->sock=socket(AF_UNIX, SOCK_STREAM, 0);
+    if (cli->sock==-1) return -errno;
+    remote.sun_family=AF_UNIX;
+    strcpy(remote.sun_path, path);
+    if (connect(cli->sock, (struct sockaddr *)&remote, strlen(remote.sun_path)+sizeof(remote.sun_family))==-1)
+    {
+        res=-errno;
+        ddfs_client_disconnect(cli);
+        return res;
+    }
+
+    int fd=client_shm_create(shm_size);
+    if (fd<0)
+    {
+        ddfs_client_disconnect(cli);
+        return fd;
+    }
+    cli->shm=mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (cli->shm==MAP_FAILED)
+    {
+        res=-errno;
+        cli->shm=NULL;
+        close(fd);
+        ddfs_client_disconnect(cli);
+        return res;
+    }
+    cli->shm_size=shm_size;
+
+    // the file descriptor goes with one byte, after the request
+    char byte=0;
+    struct iovec iov={ &byte, 1 };
+    union { struct cmsghdr cm; char control[CMSG_SPACE(sizeof(int))]; } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov=&iov;
+    msg.msg_iovlen=1;
+    msg.msg_control=control.control;
+    msg.msg_controllen=sizeof(control.control);
+    struct cmsghdr *cmsg=CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level=SOL_SOCKET;
+    cmsg->cmsg_type=SCM_RIGHTS;
+    cmsg->cmsg_len=CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    int reply=0;
+    res=client_request(cli, sop_shm, 0, shm_size, 0);
+    if (res==0 && sendmsg(cli->sock, &msg, MSG_NOSIGNAL)!=1) res=-errno;
+    close(fd);
+    if (res==0) res=client_recv(cli->sock, &reply, sizeof(reply));
+    if (res==0) res=reply;
+    if (res)
+    {
+        ddfs_client_disconnect(cli);
+        return res;
+    }
+    return 0;
+}
+
+/**
+ * close the connection, the file still open is closed by ddumbfs
+ */
+void ddfs_client_disconnect(struct ddfs_client *cli)
+{
+    if (cli->sock!=-1) close(cli->sock);
+    if (cli->shm) munmap(cli->shm, cli->shm_size);
+    cli->sock=-1;
+    cli->shm=NULL;
+}
+
+/**
+ * open or create a file, only one file can be open by connection
+ *
+ * @param filename the path of the file, starting with '/'
+ * @return 0 or -errno
+ */
+int ddfs_client_open(struct ddfs_client *cli, const char *filename, int flags, int mode)
+{
+    return client_call(cli, sop_open, flags, strlen(filename), mode, filename);
+}
+
+/**
+ * return the next free area of the ring, wait for pending writes if needed
+ *
+ * @param size the size of the area, up to the size of the ring
+ * @return the area or NULL if size is too big or the connection is broken
+ */
+char *ddfs_client_buffer(struct ddfs_client *cli, long long int size)
+{
+    if (size>cli->shm_size) return NULL;
+    while (1)
+    {
+        long long int pos=cli->head%cli->shm_size;
+        long long int skip=(pos+size>cli->shm_size)?cli->shm_size-pos:0;  // don't split the area
+        if (cli->shm_size-(cli->head-cli->tail)>=skip+size)
+        {
+            cli->head+=skip+size;
+            return cli->shm+(pos+skip)%cli->shm_size;
+        }
+        if (cli->pending_n==0)
+        {   // the previous areas were not used, restart at the beginning of the ring
+            cli->head+=(cli->shm_size-pos)%cli->shm_size;
+            cli->tail=cli->head;
+        }
+        else if (client_wait(cli)) return NULL;
+    }
+}
+
+/**
+ * queue a write of a buffer returned by ddfs_client_buffer()
+ *
+ * @return 0 or the first error of the previous writes
+ */
+int ddfs_client_write(struct ddfs_client *cli, char *buf, long long int size, long long int offset)
+{
+    int res;
+
+    if (cli->pending_n==DDFS_CLIENT_MAX_PENDING && (res=client_wait(cli))) return res;
+
+    res=client_request(cli, sop_shm_write, offset, size, buf-cli->shm);
+    if (res) return res;
+    cli->pending[(cli->pending_first+cli->pending_n)%DDFS_CLIENT_MAX_PENDING].end=cli->head;
+    cli->pending_n++;
+    res=cli->error;
+    cli->error=0;
+    return res;
+}
+
+/**
+ * read into a buffer returned by ddfs_client_buffer(), after the pending writes
+ *
+ * @return the number of bytes read or -errno
+ */
+int ddfs_client_read(struct ddfs_client *cli, char *buf, long long int size, long long int offset)
+{
+    return client_call(cli, sop_shm_read, offset, size, buf-cli->shm, NULL);
+}
+
+/**
+ * write the blocks that ddumbfs already has, knowing only their hashes
+ *
+ * buf is returned by ddfs_client_buffer() and holds the hash of each block,
+ * followed by one byte per block, set to 1 for the blocks that must be
+ * written with ddfs_client_write()
+ *
+ * @param size the size of the range, a multiple of the block size
+ * @param offset the offset of the range, aligned on a block
+ * @return the number of blocks to write or -errno
+ */
+int ddfs_client_hashes(struct ddfs_client *cli, char *buf, long long int size, long long int offset)
+{
+    return client_call(cli, sop_shm_hashes, offset, size, buf-cli->shm, NULL);
+}
+
+/**
+ * get the block size and the hash used by the filesystem
+ *
+ * @return 0 or -errno
+ */
+int ddfs_client_info(struct ddfs_client *cli, struct socket_info *info)
+{
+    char *buf=ddfs_client_buffer(cli, sizeof(*info));
+    if (buf==NULL) return -EPIPE;
+    int res=client_call(cli, sop_shm_info, 0, 0, buf-cli->shm, NULL);
+    if (res==0) memcpy(info, buf, sizeof(*info));
+    return res;
+}
+
+/**
+ * clone a range of another file into the open file, by copying the nodes
+ * of the blocks, see ddfssocket.h
+ *
+ * @param src the path of the source, starting with '/'
+ * @return 0 or -errno
+ */
+int ddfs_client_clone(struct ddfs_client *cli, const char *src, long long int src_offset, long long int dst_offset, long long int size)
+{
+    struct ddfs_clone_range range;
+
+    if (strlen(src)>=sizeof(range.src)) return -ENAMETOOLONG;
+    memset(&range, 0, sizeof(range));
+    range.src_offset=src_offset;
+    range.dst_offset=dst_offset;
+    range.size=size;
+    strcpy(range.src, src);
+    return client_call(cli, sop_clone, 0, sizeof(range), 0, &range);
+}
+
+/**
+ * wait for all the pending writes
+ *
+ * @return 0 or the first error of the writes
+ */
+int ddfs_client_sync(struct ddfs_client *cli)
+{
+    int res;
+
+    while (cli->pending_n>0) if ((res=client_wait(cli))) return res;
+    cli->tail=cli->head;
+    res=cli->error;
+    cli->error=0;
+    return res;
+}
+
+int ddfs_client_fsync(struct ddfs_client *cli, int datasync)
+{
+    return client_call(cli, sop_fsync, datasync, 0, 0, NULL);
+}
+
+int ddfs_client_close(struct ddfs_client *cli)
+{
+    return client_call(cli, sop_close, 0, 0, 0, NULL);
+}
+
+int ddfs_client_dump(struct ddfs_client *cli)
+{
+    return client_call(cli, sop_dump, 0, 0, 0, NULL);
+}
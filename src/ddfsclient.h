@@ -0,0 +1,65 @@
+/*
+ * ddfsclient.h
+ *
+ * client of the socket interface of ddumbfs, see ddfssocket.h
+ *
+ * the data are exchanged through a memory shared with ddumbfs and used as
+ * a ring. ddfs_client_buffer() returns the next free area of the ring, to
+ * be filled and passed to ddfs_client_write() or ddfs_client_read() before
+ * to ask for another one. The writes are sent without waiting for the
+ * reply, their first error is returned by a later call. The reads wait for
+ * their data, but can cover multiple blocks. The requests are processed in
+ * order by ddumbfs, one connection is one stream, use multiple connections
+ * for parallel streams.
+ *
+ * a client that knows the hashes of its blocks can first send them with
+ * ddfs_client_hashes(), and then write only the blocks that ddumbfs
+ * doesn't have.
+ *
+ * ddfs_client_clone() copies a range of another file without moving the
+ * data, only the nodes of the blocks are copied by ddumbfs.
+ */
+
+#ifndef DDFSCLIENT_H_
+#define DDFSCLIENT_H_
+
+#include <sys/types.h>
+
+#include "ddfssocket.h"
+
+#define DDFS_CLIENT_MAX_PENDING 64
+
+struct ddfs_client_request
+{
+    long long int end;          // value of ddfs_client->head after the allocation of the buffer
+};
+
+struct ddfs_client
+{
+    int sock;
+    char *shm;                  // the ring shared with ddumbfs
+    long long int shm_size;
+    long long int head;         // bytes allocated in the ring since the connection
+    long long int tail;         // bytes released
+    int error;                  // first error returned by a write
+    struct ddfs_client_request pending[DDFS_CLIENT_MAX_PENDING];
+    int pending_first;
+    int pending_n;
+};
+
+int ddfs_client_connect(struct ddfs_client *cli, const char *path, long long int shm_size);
+void ddfs_client_disconnect(struct ddfs_client *cli);
+
+int ddfs_client_open(struct ddfs_client *cli, const char *filename, int flags, int mode);
+char *ddfs_client_buffer(struct ddfs_client *cli, long long int size);
+int ddfs_client_write(struct ddfs_client *cli, char *buf, long long int size, long long int offset);
+int ddfs_client_read(struct ddfs_client *cli, char *buf, long long int size, long long int offset);
+int ddfs_client_hashes(struct ddfs_client *cli, char *buf, long long int size, long long int offset);
+int ddfs_client_info(struct ddfs_client *cli, struct socket_info *info);
+int ddfs_client_clone(struct ddfs_client *cli, const char *src, long long int src_offset, long long int dst_offset, long long int size);
+int ddfs_client_sync(struct ddfs_client *cli);
+int ddfs_client_fsync(struct ddfs_client *cli, int datasync);
+int ddfs_client_close(struct ddfs_client *cli);
+int ddfs_client_dump(struct ddfs_client *cli);
+
+#endif /* DDFSCLIENT_H_ */
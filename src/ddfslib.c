@@ -34,6 +34,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <errno.h>
 #include <time.h>
 #include <stddef.h>
@@ -43,8 +45,16 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DDFS_HAVE_AVX2 // compiled for AVX2 and used if the cpu supports it
+#include <immintrin.h>
+#endif
 
 #include <mhash.h>
+#include <zlib.h>
 
 #include "ddfslib.h"
 
@@ -77,6 +87,7 @@ struct cfgfile cfg[]={
                     { "reuse_asap", 'I', offsetof(struct_ddfs_ctx, c_reuse_asap) },
                     { "auto_buffer_flush", 'I', offsetof(struct_ddfs_ctx, c_auto_buffer_flush) },
                     { "auto_sync", 'I', offsetof(struct_ddfs_ctx, c_auto_sync) },
+                    { "compress", 'i', offsetof(struct_ddfs_ctx, c_compress) },  // lower case for optional
 
                     { "partition_size", 'L', offsetof(struct_ddfs_ctx, c_partition_size) },
                     { "block_count", 'L', offsetof(struct_ddfs_ctx, c_block_count) },
@@ -179,6 +190,18 @@ long long int micronow()
     return tv.tv_sec*1000*1000+tv.tv_usec;
 }
 
+/**
+ * return a monotonic time in nano sec, to measure short delays
+ *
+ * @return time in nano seconds
+ */
+long long int nanonow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
+
 /**
  * return current time in micro sec
  *
@@ -420,6 +443,19 @@ int ddfs_unlock(const char *name)
     return 0;
 }
 
+/**
+ * remove the block reference counters of ddumbfs
+ *
+ * must be called by the offline tools that modify the filesystem, ddumbfs
+ * will rebuild the counters at next mount
+ *
+ * @return -1 for error
+ */
+int ddfs_refcount_invalidate()
+{
+    return ddfs_unlock(REFCOUNT_FILENAME);
+}
+
 /**
  * test if "lock" file exist (like the ".autofsck")
  *
@@ -450,6 +486,51 @@ void ddfs_hash(const char *block, unsigned char *hash)
     mhash_deinit(td, hash);
 }
 
+#ifdef DDFS_HAVE_AVX2
+/*
+ * AVX2 version of ddfs_is_zero_block(), 128 bytes per loop
+ */
+__attribute__((target("avx2")))
+static int ddfs_is_zero_block_avx2(const char *block)
+{
+    int i=0;
+    for (; i+128<=ddfs->c_block_size; i+=128)
+    {
+        const __m256i *p=(const __m256i *)(block+i);
+        __m256i acc=_mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256(p), _mm256_loadu_si256(p+1)),
+                                    _mm256_or_si256(_mm256_loadu_si256(p+2), _mm256_loadu_si256(p+3)));
+        if (!_mm256_testz_si256(acc, acc)) return 0;
+    }
+    for (; i<ddfs->c_block_size; i++) if (block[i]) return 0;
+    return 1;
+}
+#endif
+
+/**
+ * check if a block is made only of zeros, its hash is zero_block_hash
+ *
+ * @param block the block of data
+ * @return 1 if all the bytes are zero, 0 if not
+ */
+int ddfs_is_zero_block(const char *block)
+{
+    int i=0;
+#ifdef DDFS_HAVE_AVX2
+    static int avx2=-1;
+    if (avx2==-1) avx2=(__builtin_cpu_supports("avx2")!=0);
+    if (avx2) return ddfs_is_zero_block_avx2(block);
+#endif
+    // 64 bytes per loop, the compiler can vectorize it
+    for (; i+64<=ddfs->c_block_size; i+=64)
+    {
+        uint64_t w[8];
+        memcpy(w, block+i, 64);
+        if (w[0]|w[1]|w[2]|w[3]|w[4]|w[5]|w[6]|w[7]) return 0;
+    }
+    for (; i<ddfs->c_block_size; i++) if (block[i]) return 0;
+    return 1;
+}
+
 /**
  * convert integer address into node address of c_addr_size byte
  *
@@ -710,6 +791,268 @@ blockaddr ddfs_alloc_block()
     if (addr>0) ddfs->usedblock++;
     return addr;
 }
+/*
+ * per thread buffers used to compress and decompress the blocks
+ */
+struct zblock_buffer
+{
+    char *slot;         // the slot of a block, as in the block file
+    char *block;        // the last block decompressed by ddfs_read_block()
+    blockaddr addr;     // the address of block or 0
+    long generation;    // the value of zblock_generation when block was read
+};
+
+static pthread_key_t zblock_key;
+static pthread_once_t zblock_key_once=PTHREAD_ONCE_INIT;
+static volatile long zblock_generation=0; // incremented at every block write
+
+static void zblock_buffer_free(void *p)
+{
+    struct zblock_buffer *zb=(struct zblock_buffer *)p;
+    free(zb->slot);
+    free(zb);
+}
+
+static void zblock_key_create()
+{
+    pthread_key_create(&zblock_key, zblock_buffer_free);
+}
+
+/**
+ * return the compression buffers of the calling thread
+ *
+ * @return the buffers or NULL if out of memory
+ */
+static struct zblock_buffer *zblock_buffer()
+{
+    pthread_once(&zblock_key_once, zblock_key_create);
+    struct zblock_buffer *zb=pthread_getspecific(zblock_key);
+    if (zb) return zb;
+
+    zb=malloc(sizeof(struct zblock_buffer));
+    if (zb==NULL) return NULL;
+    // the slot is written using direct io
+    if (posix_memalign((void **)&zb->slot, DDFS_ZBLOCK_ALIGMENT, 2*ddfs->c_block_size))
+    {
+        free(zb);
+        return NULL;
+    }
+    zb->block=zb->slot+ddfs->c_block_size;
+    zb->addr=0;
+    zb->generation=0;
+    pthread_setspecific(zblock_key, zb);
+    return zb;
+}
+
+static void zblock_put32(char *p, uint32_t v)
+{
+    p[0]=v>>24; p[1]=v>>16; p[2]=v>>8; p[3]=v;
+}
+
+static uint32_t zblock_get32(const char *p)
+{
+    const unsigned char *u=(const unsigned char *)p;
+    return (uint32_t)u[0]<<24 | (uint32_t)u[1]<<16 | (uint32_t)u[2]<<8 | u[3];
+}
+
+/**
+ * return the size of a slot according to its header only
+ *
+ * @param slot the slot, only the header is needed
+ * @return the size of the slot if it looks compressed or c_block_size
+ */
+static int zblock_header_size(const char *slot)
+{
+    if (memcmp(slot, DDFS_ZBLOCK_MAGIC, DDFS_ZBLOCK_MAGIC_LEN)) return ddfs->c_block_size;
+    uint32_t len=zblock_get32(slot+DDFS_ZBLOCK_MAGIC_LEN);
+    if (len>ddfs->c_block_size-DDFS_ZBLOCK_ALIGMENT-DDFS_ZBLOCK_HEADER_SIZE) return ddfs->c_block_size;
+    return (DDFS_ZBLOCK_HEADER_SIZE+len+DDFS_ZBLOCK_ALIGMENT-1) & ~(DDFS_ZBLOCK_ALIGMENT-1);
+}
+
+/**
+ * compress a block into the format of its slot in the block file
+ *
+ * the header is followed by the compressed data and zeros up
+ * to the next DDFS_ZBLOCK_ALIGMENT boundary
+ *
+ * @param block the block to compress
+ * @param slot where to write the slot, c_block_size bytes
+ * @return the size of the slot to write or 0 if the block must be stored as is
+ */
+int ddfs_encode_block(const char *block, char *slot)
+{
+    // the compressed block must save at least one page
+    if (ddfs->c_block_size<=DDFS_ZBLOCK_ALIGMENT+DDFS_ZBLOCK_HEADER_SIZE) return 0;
+    uLongf len=ddfs->c_block_size-DDFS_ZBLOCK_ALIGMENT-DDFS_ZBLOCK_HEADER_SIZE;
+
+    if (Z_OK!=compress2((Bytef *)slot+DDFS_ZBLOCK_HEADER_SIZE, &len, (const Bytef *)block, ddfs->c_block_size, ddfs->c_compress)) return 0;
+
+    memcpy(slot, DDFS_ZBLOCK_MAGIC, DDFS_ZBLOCK_MAGIC_LEN);
+    zblock_put32(slot+DDFS_ZBLOCK_MAGIC_LEN, len);
+    zblock_put32(slot+DDFS_ZBLOCK_MAGIC_LEN+4, crc32(0L, (const Bytef *)slot+DDFS_ZBLOCK_HEADER_SIZE, len));
+
+    int size=zblock_header_size(slot);
+    memset(slot+DDFS_ZBLOCK_HEADER_SIZE+len, '\0', size-DDFS_ZBLOCK_HEADER_SIZE-len);
+    return size;
+}
+
+/**
+ * return the size of a slot that holds a valid compressed block
+ *
+ * @param slot the slot
+ * @return the size of the slot if it is compressed or c_block_size
+ */
+static int zblock_framed_size(const char *slot)
+{
+    int size=zblock_header_size(slot);
+    if (size==ddfs->c_block_size) return size;
+    uLong len=zblock_get32(slot+DDFS_ZBLOCK_MAGIC_LEN);
+    if (zblock_get32(slot+DDFS_ZBLOCK_MAGIC_LEN+4)!=crc32(0L, (const Bytef *)slot+DDFS_ZBLOCK_HEADER_SIZE, len)) return ddfs->c_block_size;
+    return size;
+}
+
+static pthread_mutex_t rawzblocks_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * tell if a block is stored as is but looks like a compressed one
+ *
+ * @param addr the address of the block
+ * @return 1 if the block must not be decompressed
+ */
+int ddfs_rawzblock_get(blockaddr addr)
+{
+    if (ddfs->rawzblocks_fd==-1) return 0;
+    return bit_array_get(&ddfs->ba_rawzblocks, addr);
+}
+
+/**
+ * record if a block is stored as is but looks like a compressed one
+ *
+ * the list is synced before returning, call it before writing the slot
+ *
+ * @param addr the address of the block
+ * @param raw 1 if the block is stored as is and looks compressed
+ * @return 0 for success or -errno
+ */
+int ddfs_rawzblock_set(blockaddr addr, int raw)
+{
+    if (ddfs->rawzblocks_fd==-1) return raw?-EIO:0;
+    pthread_mutex_lock(&rawzblocks_mutex);
+    if (raw) bit_array_set(&ddfs->ba_rawzblocks, addr);
+    else bit_array_unset(&ddfs->ba_rawzblocks, addr);
+    long long int i=addr>>BIT_INT_SHIFT;
+    int res=0;
+    if (BIT_INT_BYTE!=pwrite(ddfs->rawzblocks_fd, ddfs->ba_rawzblocks.array+i, BIT_INT_BYTE, i*BIT_INT_BYTE) || fdatasync(ddfs->rawzblocks_fd)) res=errno?-errno:-EIO;
+    pthread_mutex_unlock(&rawzblocks_mutex);
+    return res;
+}
+
+/**
+ * return how many bytes of a slot are used
+ *
+ * a block stored as is can start like a compressed one, such blocks are
+ * listed in ddfs->ba_rawzblocks
+ *
+ * @param addr the address of the block
+ * @param slot the slot
+ * @return the size of a compressed slot or c_block_size
+ */
+int ddfs_slot_size(blockaddr addr, const char *slot)
+{
+    if (ddfs_rawzblock_get(addr)) return ddfs->c_block_size;
+    return zblock_framed_size(slot);
+}
+
+/**
+ * decompress a slot read from the block file
+ *
+ * a slot that don't hold a valid compressed block is a block stored as is,
+ * it is copied unchanged
+ *
+ * @param addr the address of the block
+ * @param slot the slot read from the block file
+ * @param block where to write the block, can be the same buffer as slot
+ * @return 0 for success or -1 if the compressed data are corrupted
+ */
+int ddfs_decode_block(blockaddr addr, const char *slot, char *block)
+{
+    if (ddfs_slot_size(addr, slot)==ddfs->c_block_size)
+    {
+        if (slot!=block) memcpy(block, slot, ddfs->c_block_size);
+        return 0;
+    }
+
+    char *dst=block;
+    if (slot==block)
+    {
+        struct zblock_buffer *zb=zblock_buffer();
+        if (zb==NULL) return -1;
+        dst=zb->block;
+        zb->addr=0;
+    }
+    uLong len=zblock_get32(slot+DDFS_ZBLOCK_MAGIC_LEN);
+    uLongf dst_len=ddfs->c_block_size;
+    if (Z_OK!=uncompress((Bytef *)dst, &dst_len, (const Bytef *)slot+DDFS_ZBLOCK_HEADER_SIZE, len) || dst_len!=ddfs->c_block_size) return -1;
+    if (dst!=block) memcpy(block, dst, ddfs->c_block_size);
+    return 0;
+}
+
+/**
+ * free the unused end of a slot in the block file
+ *
+ * nothing is done for a block device or a filesystem that don't support it
+ *
+ * @param addr the address of the block
+ * @param size the used part of the slot
+ */
+void ddfs_punch_block(blockaddr addr, int size)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (ddfs->bfile_isblk) return;
+    fallocate(ddfs->bfile, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (addr<<ddfs->block_size_shift)+size, ddfs->c_block_size-size);
+#endif
+}
+
+/**
+ * read the slot of a block, skip the unused end of compressed slot
+ *
+ * @param addr the address of the block
+ * @param slot where to read the slot, c_block_size bytes
+ * @return c_block_size, 0 at end of file or -1 for error
+ */
+static int ddfs_read_slot(blockaddr addr, char *slot)
+{
+    long long int offset=addr<<ddfs->block_size_shift;
+    int len=pread(ddfs->bfile_ro, slot, DDFS_ZBLOCK_ALIGMENT, offset);
+    if (len<=0) return len;
+    if (len!=DDFS_ZBLOCK_ALIGMENT)
+    {
+        errno=EIO;
+        return -1;
+    }
+
+    int done=DDFS_ZBLOCK_ALIGMENT;
+    int size=ddfs_rawzblock_get(addr)?ddfs->c_block_size:zblock_header_size(slot);
+    while (1)
+    {
+        if (size>done)
+        {
+            len=pread(ddfs->bfile_ro, slot+done, size-done, offset+done);
+            if (len==-1) return -1;
+            if (len!=size-done)
+            {
+                errno=EIO;
+                return -1;
+            }
+            done=size;
+        }
+        if (size==ddfs->c_block_size || ddfs_slot_size(addr, slot)==size) break;
+        // not a compressed block, read the remaining
+        size=ddfs->c_block_size;
+    }
+    return ddfs->c_block_size;
+}
+
 /**
  * read part of a block from block file
  *
@@ -728,6 +1071,33 @@ int ddfs_read_block(blockaddr addr, char *buf, int size, int gap)
         return size;
     }
 
+    if (ddfs->c_compress)
+    {
+        struct zblock_buffer *zb=zblock_buffer();
+        if (zb==NULL)
+        {
+            errno=ENOMEM;
+            return -1;
+        }
+        if (zb->addr!=addr || zb->generation!=zblock_generation)
+        {
+            zb->addr=0;
+            long generation=zblock_generation;
+            int len=ddfs_read_slot(addr, zb->slot);
+            if (len!=ddfs->c_block_size) return len;
+            if (ddfs_decode_block(addr, zb->slot, zb->block))
+            {
+                DDFS_LOG(LOG_ERR, "ddfs_read_block corrupted compressed block %lld\n", addr);
+                errno=EIO;
+                return -1;
+            }
+            zb->addr=addr;
+            zb->generation=generation;
+        }
+        memcpy(buf, zb->block+gap, size);
+        return size;
+    }
+
     long long int offset=(addr<<ddfs->block_size_shift)+gap;
     return pread(ddfs->bfile_ro, buf, size, offset);
 }
@@ -755,6 +1125,7 @@ void ddfs_forced_read_full_block(blockaddr addr, char *buf, int hw_block_size)
         { // I don't care, I'm trying to read most of the data from a failing block
         }
     }
+    if (ddfs->c_compress) ddfs_decode_block(addr, buf, buf);
     return;
 }
 
@@ -769,67 +1140,352 @@ blockaddr ddfs_store_block(const char *block, blockaddr force_addr)
             return -ENOSPC;
         }
     }
-    int len=pwrite(ddfs->bfile, block, ddfs->c_block_size, force_addr<<ddfs->block_size_shift);
+
+    const char *data=block;
+    int size=ddfs->c_block_size;
+    int compressed=0;
+    if (ddfs->c_compress || (ddfs->align && ((uintptr_t)block%BLOCK_ALIGMENT)!=0))
+    {
+        struct zblock_buffer *zb=zblock_buffer();
+        if (zb==NULL)
+        {
+            DDFS_LOG(LOG_ERR, "ddfs_store_block cannot allocate slot buffer\n");
+            return -ENOMEM;
+        }
+        int zsize=0;
+        if (ddfs->c_compress)
+        {
+            zsize=ddfs_encode_block(block, zb->slot);
+            // a block stored as is must not be decompressed when read back
+            int raw=(zsize==0 && zblock_framed_size(block)!=ddfs->c_block_size);
+            if (raw!=ddfs_rawzblock_get(force_addr))
+            {
+                int res=ddfs_rawzblock_set(force_addr, raw);
+                if (res)
+                {
+                    DDFS_LOG(LOG_ERR, "ddfs_store_block cannot update %s: %s\n", DDFS_RAWZBLOCKS_FILENAME, strerror(-res));
+                    return res;
+                }
+            }
+        }
+        if (zsize>0)
+        {
+            data=zb->slot;
+            size=zsize;
+            compressed=1;
+            long long int end=(force_addr+1)<<ddfs->block_size_shift;
+            if (!ddfs->bfile_isblk && end>ddfs->bfile_size)
+            {   // the block file must hold the full slot, write it and punch it later
+                memset(zb->slot+size, '\0', ddfs->c_block_size-size);
+                size=ddfs->c_block_size;
+            }
+        }
+        else if (ddfs->align && ((uintptr_t)block%BLOCK_ALIGMENT)!=0)
+        {   // direct io requires an aligned buffer
+            memcpy(zb->slot, block, ddfs->c_block_size);
+            data=zb->slot;
+        }
+    }
+
+    int len=pwrite(ddfs->bfile, data, size, force_addr<<ddfs->block_size_shift);
+    // the blocks decompressed by the readers can be out of date now, a
+    // reader that read the slot before the write must not keep it
+    if (ddfs->c_compress) __sync_add_and_fetch(&zblock_generation, 1);
     if (len==-1)
     {
         DDFS_LOG(LOG_ERR, "ddfs_store_block cannot write block: %s\n", strerror(errno));
         return -errno;
     }
-    else if (len!=ddfs->c_block_size)
+    else if (len!=size)
     {
-        DDFS_LOG(LOG_ERR, "ddfs_store_block short write, only %d/%d bytes\n", len, ddfs->c_block_size);
+        DDFS_LOG(LOG_ERR, "ddfs_store_block short write, only %d/%d bytes\n", len, size);
         return -EIO;
     }
+    if (compressed)
+    {
+        long long int end=(force_addr+1)<<ddfs->block_size_shift;
+        long long int bfile_size=ddfs->bfile_size;
+        while (end>bfile_size && !__sync_bool_compare_and_swap(&ddfs->bfile_size, bfile_size, end)) bfile_size=ddfs->bfile_size;
+        ddfs_punch_block(force_addr, ddfs_slot_size(force_addr, data));
+    }
     return force_addr;
 }
 
 /**
- * write a block in the filesystem
+ * search a hash in the index and add it if missing
  *
- * if the block is new, write it in the BlockFile and add it to the IndexFile
- * note: ddfs_write_block2 in ddumbfs.c handle stats and multi-threading
+ * if the hash is new, a block is allocated and the node is inserted in
+ * the index, the caller must store the block at the returned address
  *
- * @param block the block
- * @param bhash return the hash of the block
- * @return the address of the block or <0 for error
+ * @param bhash the hash of the block
+ * @param baddr return the address of the block
+ * @return 0 if the hash was already in the index, 1 if a new block has been
+ * allocated, <0 for error
  */
-blockaddr ddfs_write_block(const char *block, unsigned char *bhash)
+int ddfs_index_hash(unsigned char *bhash, blockaddr *baddr)
 {
     blockaddr addr;
     nodeidx node_idx;
 
-    ddfs_hash(block, bhash);
-    if (0==memcmp(bhash, ddfs->zero_block_hash, ddfs->c_hash_size)) return 0;
-
     int res=ddfs_locate_hash(bhash, &addr, &node_idx);
 
     if (res<0) return res;
 
     if (res==0)
     {
-        return addr;
+        *baddr=addr;
+        return 0;
     }
     // the hash is not found
-    // store the block in the BlockFile
-    blockaddr baddr=ddfs_alloc_block();
-    if (baddr<0) return baddr;
+    // allocate a block in the BlockFile
+    *baddr=ddfs_alloc_block();
+    if (*baddr<0) return *baddr;
 
     if (addr!=0)
     {   // we must insert the node; search for a free node
         nodeidx free_node_idx=ddfs_search_free_node(node_idx+1, ddfs->c_node_count);
         if (free_node_idx<0)
         {   // this should NEVER NERVER NEVER append
-            DDFS_LOG(LOG_ERR, "ddfs_write_block CRITICAL ERROR no more free nodes !\n");
+            DDFS_LOG(LOG_ERR, "ddfs_index_hash CRITICAL ERROR no more free nodes !\n");
             return -ENOSPC;
         }
         memmove(ddfs->nodes+((node_idx+1)*ddfs->c_node_size), ddfs->nodes+(node_idx*ddfs->c_node_size), (free_node_idx-node_idx)*ddfs->c_node_size);
     }
     // now node_idx is ready to receive new node
-    ddfs_set_node(node_idx, baddr, bhash);
+    ddfs_set_node(node_idx, *baddr, bhash);
+    return 1;
+}
 
-    baddr=ddfs_store_block(block, baddr);
+/**
+ * write a block in the filesystem
+ *
+ * if the block is new, write it in the BlockFile and add it to the IndexFile
+ * note: ddfs_write_block2 in ddumbfs.c handle stats and multi-threading
+ *
+ * @param block the block
+ * @param bhash return the hash of the block
+ * @return the address of the block or <0 for error
+ */
+blockaddr ddfs_write_block(const char *block, unsigned char *bhash)
+{
+    blockaddr addr;
 
-    return baddr;
+    ddfs_hash(block, bhash);
+    if (0==memcmp(bhash, ddfs->zero_block_hash, ddfs->c_hash_size)) return 0;
+
+    int res=ddfs_index_hash(bhash, &addr);
+
+    if (res<0) return res;
+
+    if (res==0)
+    {
+        return addr;
+    }
+    // the hash is new, store the block in the BlockFile
+    return ddfs_store_block(block, addr);
+}
+
+/**
+ * wait a little in active loops, sleep more when waiting for long
+ *
+ * @param spin the number of times the caller has already waited, incremented
+ */
+void ddfs_spin_pause(int *spin)
+{
+    (*spin)++;
+    if (*spin<64) sched_yield();
+    else if (*spin<1024) usleep(50);
+    else usleep(1000);
+}
+
+/**
+ * make the new used block list saved in filename0 the reference
+ *
+ * @return 0 for success, -errno for error
+ */
+static int ddfs_usedblocks_rotate(const char *filename, const char *filename0, const char *filename1)
+{
+    int res;
+
+    if (pathexists(filename))
+    {
+        // Now I must SYNC blockfile and indexfile,
+    	// this is the smart place to sync them without lock
+    	// because I must have bfile and ifile newer than usedblock
+    	fsync(ddfs->bfile);
+    	fsync(ddfs->ifile);
+
+    	// Now both are synced, the old usedblock is still valid but now,
+    	// the new one too, I can rename it and make it the reference
+    
+        res=rename(filename, filename1);
+        if (res==-1)
+        {
+            DDFS_LOG(LOG_ERR, "cannot delete %s (%s)\n", filename, strerror(errno));
+            return -errno;
+        }
+    }
+    
+    res=rename(filename0, filename);
+    if (res==-1)
+    {
+        DDFS_LOG(LOG_ERR, "cannot rename %s in %s (%s)\n", filename0, filename, strerror(errno));
+        return -errno;
+    }
+
+    if (pathexists(filename1)) {
+	res=rename(filename1, filename0);
+	if (res==-1)
+	{
+	    DDFS_LOG(LOG_ERR, "cannot rename %s in %s (%s)\n", filename1, filename0, strerror(errno));
+	    return -errno;
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * Incremental save of the used block list when ddfs->ba_usedblocks tracks
+ * its dirty pages. A copy of the modified pages is made while the list is
+ * locked, then the pages are written without the lock. The file updated
+ * (.0) is the one saved two times ago, the pages modified since the two
+ * last saves must be written.
+ */
+static pthread_mutex_t usedblocks_save_mutex=PTHREAD_MUTEX_INITIALIZER;
+static int usedblocks_save_state=0;                 // 0 idle, 1 prepared, 2 writing
+static char *usedblocks_shadow=NULL;                // the list at the last prepare
+static unsigned char *usedblocks_since_save=NULL;   // pages modified since the last save
+static unsigned char *usedblocks_before_save=NULL;  // pages modified between the two last saves
+
+/**
+ * copy the pages modified since the last call, must be called when the
+ * used block list is locked
+ *
+ * @return 0 for success, 1 if a save is already waiting or running
+ */
+int ddfs_save_usedblocks_prepare()
+{
+    struct bit_array *ba=&ddfs->ba_usedblocks;
+    long long int i, pages=bit_array_page_count(ba);
+    long long int size=ba->isize*BIT_INT_BYTE;
+
+    pthread_mutex_lock(&usedblocks_save_mutex);
+    if (usedblocks_save_state!=0)
+    {
+        pthread_mutex_unlock(&usedblocks_save_mutex);
+        return 1;
+    }
+    if (usedblocks_shadow==NULL)
+    {
+        usedblocks_shadow=malloc(size);
+        usedblocks_since_save=malloc(pages);
+        usedblocks_before_save=malloc(pages);
+        if (usedblocks_shadow==NULL || usedblocks_since_save==NULL || usedblocks_before_save==NULL)
+        {
+            free(usedblocks_shadow);
+            free(usedblocks_since_save);
+            free(usedblocks_before_save);
+            usedblocks_shadow=NULL;
+            pthread_mutex_unlock(&usedblocks_save_mutex);
+            DDFS_LOG(LOG_ERR, "cannot allocate memory to save usedblock\n");
+            return -ENOMEM;
+        }
+        // the content of the files is unknown
+        memset(usedblocks_since_save, 1, pages);
+        memset(usedblocks_before_save, 1, pages);
+        memset(ba->dirty, 1, pages);
+    }
+
+    for (i=0; i<pages; i++)
+    {
+        if (!ba->dirty[i]) continue;
+        long long int off=i*BIT_ARRAY_PAGE_SIZE;
+        memcpy(usedblocks_shadow+off, (char *)ba->array+off, (off+BIT_ARRAY_PAGE_SIZE<=size)?BIT_ARRAY_PAGE_SIZE:size-off);
+        ba->dirty[i]=0;
+        usedblocks_since_save[i]=1;
+    }
+    usedblocks_save_state=1;
+    pthread_mutex_unlock(&usedblocks_save_mutex);
+    return 0;
+}
+
+/**
+ * write the list copied by ddfs_save_usedblocks_prepare(), the used block
+ * list don't need to be locked
+ *
+ * @return 0 for success, 1 if nothing was prepared, -errno for error
+ */
+int ddfs_save_usedblocks_finish()
+{
+    char filename[FILENAME_MAX];
+    char filename0[FILENAME_MAX];
+    char filename1[FILENAME_MAX];
+    struct stat st;
+    long long int i, pages=bit_array_page_count(&ddfs->ba_usedblocks);
+    long long int size=ddfs->ba_usedblocks.isize*BIT_INT_BYTE;
+    long long int changed_data=0;
+    int res=0;
+
+    pthread_mutex_lock(&usedblocks_save_mutex);
+    if (usedblocks_save_state!=1)
+    {
+        pthread_mutex_unlock(&usedblocks_save_mutex);
+        return 1;
+    }
+    usedblocks_save_state=2;
+    pthread_mutex_unlock(&usedblocks_save_mutex);
+
+    snprintf(filename, sizeof(filename), "%s/%s", ddfs->pdir, DDFS_BACKUP_USEDBLOCK);
+    snprintf(filename0, sizeof(filename0), "%s/%s.0", ddfs->pdir, DDFS_BACKUP_USEDBLOCK);
+    snprintf(filename1, sizeof(filename1), "%s/%s.1", ddfs->pdir, DDFS_BACKUP_USEDBLOCK);
+
+    int fd=open(filename0, O_RDWR|O_CREAT, 0600);
+    if (fd==-1)
+    {
+        res=-errno;
+        DDFS_LOG(LOG_ERR, "cannot open %s (%s)\n", filename0, strerror(errno));
+    }
+    else
+    {
+        int full=fstat(fd, &st)==-1 || st.st_size!=size;
+        if (full && ftruncate(fd, size)==-1) res=-errno;
+        for (i=0; res==0 && i<pages; i++)
+        {
+            if (!full && !usedblocks_since_save[i] && !usedblocks_before_save[i]) continue;
+            long long int off=i*BIT_ARRAY_PAGE_SIZE;
+            int len=(off+BIT_ARRAY_PAGE_SIZE<=size)?BIT_ARRAY_PAGE_SIZE:size-off;
+            if (pwrite(fd, usedblocks_shadow+off, len, off)!=len) res=(errno?-errno:-EIO);
+            changed_data+=len;
+        }
+        if (res==0 && fdatasync(fd)==-1) res=-errno;
+        close(fd);
+        if (res)
+        {
+            DDFS_LOG(LOG_ERR, "cannot save usedblock in %s (%s)\n", filename0, strerror(-res));
+        }
+        else
+        {
+            DDFS_LOG(LOG_INFO, "%lld bytes updated in used block list\n", changed_data);
+        }
+    }
+
+    if (res==0) res=ddfs_usedblocks_rotate(filename, filename0, filename1);
+
+    pthread_mutex_lock(&usedblocks_save_mutex);
+    if (res==0)
+    {   // the old reference will be updated the next time
+        memcpy(usedblocks_before_save, usedblocks_since_save, pages);
+        memset(usedblocks_since_save, 0, pages);
+    }
+    else
+    {   // don't trust the files anymore
+        memset(usedblocks_since_save, 1, pages);
+        memset(usedblocks_before_save, 1, pages);
+    }
+    usedblocks_save_state=0;
+    pthread_mutex_unlock(&usedblocks_save_mutex);
+    return res;
 }
 
 /**
@@ -840,6 +1496,14 @@ blockaddr ddfs_write_block(const char *block, unsigned char *bhash)
  */
 int ddfs_save_usedblocks()
 {
+    if (ddfs->ba_usedblocks.dirty)
+    {   // only write the modified pages
+        ddfs_save_usedblocks_finish(); // a save could be waiting
+        int res=ddfs_save_usedblocks_prepare();
+        if (res==0) res=ddfs_save_usedblocks_finish();
+        return res;
+    }
+
     char filename[FILENAME_MAX];
     char filename0[FILENAME_MAX];
     char filename1[FILENAME_MAX];
@@ -903,42 +1567,7 @@ int ddfs_save_usedblocks()
 	}
     }
     
-    if (pathexists(filename))
-    {
-        // Now I must SYNC blockfile and indexfile,
-    	// this is the smart place to sync them without lock
-    	// because I must have bfile and ifile newer than usedblock
-    	fsync(ddfs->bfile);
-    	fsync(ddfs->ifile);
-
-    	// Now both are synced, the old usedblock is still valid but now,
-    	// the new one too, I can rename it and make it the reference
-    
-        res=rename(filename, filename1);
-        if (res==-1)
-        {
-            DDFS_LOG(LOG_ERR, "cannot delete %s (%s)\n", filename, strerror(errno));
-            return -errno;
-        }
-    }
-    
-    res=rename(filename0, filename);
-    if (res==-1)
-    {
-        DDFS_LOG(LOG_ERR, "cannot rename %s in %s (%s)\n", filename0, filename, strerror(errno));
-        return -errno;
-    }
-
-    if (pathexists(filename1)) {
-	res=rename(filename1, filename0);
-	if (res==-1)
-	{
-	    DDFS_LOG(LOG_ERR, "cannot rename %s in %s (%s)\n", filename1, filename0, strerror(errno));
-	    return -errno;
-	}
-    }
-
-    return 0;
+    return ddfs_usedblocks_rotate(filename, filename0, filename1);
 }
 
 /**
@@ -1060,6 +1689,7 @@ int ddfs_loadcfg(char *ddfs_parent, FILE *output)
                 switch (c->type)
                 {
                     case 'I':
+                    case 'i':
                         *(int*)p=strtol(value, NULL, 10);
                         if (output) fprintf(output,"\t%s %d\n", c->name, *(int*)p);
                         break;
@@ -1095,7 +1725,7 @@ int ddfs_loadcfg(char *ddfs_parent, FILE *output)
 
     for (c=cfg; c->name!=NULL; c++)
     {
-        if (c->misc==0) fprintf(stderr,"missing: %s\n", c->name);
+        if (c->misc==0 && c->type!='i') fprintf(stderr,"missing: %s\n", c->name);
     }
 
     if (0==strcmp(ddfs->c_hash, "SHA1")) ddfs->c_hash_id=MHASH_SHA1;
@@ -1515,6 +2145,38 @@ int ddfs_init(int force, int rebuild, int direct_io, int lock_index, FILE *outpu
 
     ddfs->nodes=mmap(NULL, ddfs->c_node_block_count*ddfs->c_index_block_size, PROT_READ|PROT_WRITE, MAP_SHARED, ddfs->ifile, ddfs->c_node_offset);
 
+    // the blocks stored as is that look compressed, see ddfs_store_block()
+    ddfs->rawzblocks_fd=-1;
+    if (ddfs->c_compress)
+    {
+        char filename[FILENAME_MAX];
+        snprintf(filename, sizeof(filename), "%s/%s", ddfs->pdir, DDFS_RAWZBLOCKS_FILENAME);
+        if (bit_array_init(&ddfs->ba_rawzblocks, ddfs->c_block_count, 0))
+        {
+            fprintf(stderr,"ERROR: cannot allocate %s\n", filename);
+            return 4;
+        }
+        ddfs->rawzblocks_fd=open(filename, O_RDWR|O_CREAT, 0600);
+        if (ddfs->rawzblocks_fd==-1)
+        {
+            perror(filename);
+            return 6;
+        }
+        long long int size=ddfs->ba_rawzblocks.isize*BIT_INT_BYTE;
+        len=pread(ddfs->rawzblocks_fd, ddfs->ba_rawzblocks.array, size, 0);
+        if (len==-1)
+        {
+            perror(filename);
+            return 6;
+        }
+        // a missing or short file comes from an older version, the end is zeroed
+        if (len<size && ftruncate(ddfs->rawzblocks_fd, size)==-1)
+        {
+            perror(filename);
+            return 6;
+        }
+    }
+
     if (ddfs->lock_index)
     {  // lock index component into memory
         int res1=mlock(ddfs->usedblocks_map, ddfs->c_node_offset-ddfs->c_freeblock_offset);
@@ -1591,6 +2253,12 @@ int ddfs_close()
     int res4=0;
     if (!ddfs->direct_io) res4=close(ddfs->bfile_ro);
     int res5=close(ddfs->ifile);
+    if (ddfs->rawzblocks_fd!=-1)
+    {
+        close(ddfs->rawzblocks_fd);
+        ddfs->rawzblocks_fd=-1;
+        bit_array_release(&ddfs->ba_rawzblocks);
+    }
 
     return res1 || res2 || res3 || res4 || res5;
 }
@@ -1620,3 +2288,356 @@ int ddfs_cpu_count()
 	fclose(cpufile);
 	return count;
 }
+
+/**
+ * compute the checksum of a journal record
+ *
+ * @param rec the record, the field check is ignored
+ * @return the checksum
+ */
+uint32_t ddfs_journal_checksum(struct ddfs_journal_rec *rec)
+{
+    uint32_t check=2166136261U;    // FNV-1a
+    unsigned char *p;
+    unsigned char *end=rec->hash+ddfs->c_hash_size;
+
+    for (p=(unsigned char *)&rec->type; p<(unsigned char *)&rec->type+sizeof(rec->type); p++) check=(check^*p)*16777619U;
+    for (p=(unsigned char *)&rec->addr; p<end; p++) check=(check^*p)*16777619U;
+    return check;
+}
+
+/**
+ * create an empty journal segment, replacing the old one
+ *
+ * @param segment 0 or 1
+ * @param seq the sequence number of the segment
+ * @return the file descriptor or -1 on error
+ */
+int ddfs_journal_create(int segment, uint64_t seq)
+{
+    char filename[FILENAME_MAX];
+    struct ddfs_journal_header header;
+
+    snprintf(filename, sizeof(filename), "%s/%s.%d", ddfs->pdir, JOURNAL_FILENAME, segment);
+    int fd=open(filename, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0600);
+    if (fd==-1)
+    {
+        DDFS_LOG(LOG_ERR, "cannot create journal %s (%s)\n", filename, strerror(errno));
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DDFS_MAGIC_JOURNAL, DDFS_MAGIC_FILE_LEN);
+    header.seq=seq;
+    header.block_count=ddfs->c_block_count;
+    if (write(fd, &header, sizeof(header))!=sizeof(header) || fdatasync(fd)==-1)
+    {
+        DDFS_LOG(LOG_ERR, "cannot write journal %s (%s)\n", filename, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * open a journal segment for reading
+ *
+ * @param segment 0 or 1
+ * @param header filled with the header of the segment
+ * @return the file descriptor positioned on the first record, or -1 if
+ * the segment doesn't exist or is not valid
+ */
+int ddfs_journal_open(int segment, struct ddfs_journal_header *header)
+{
+    char filename[FILENAME_MAX];
+
+    snprintf(filename, sizeof(filename), "%s/%s.%d", ddfs->pdir, JOURNAL_FILENAME, segment);
+    int fd=open(filename, O_RDONLY);
+    if (fd==-1) return -1;
+
+    if (read(fd, header, sizeof(*header))!=sizeof(*header)
+        || 0!=memcmp(header->magic, DDFS_MAGIC_JOURNAL, DDFS_MAGIC_FILE_LEN)
+        || header->block_count!=ddfs->c_block_count)
+    {
+        DDFS_LOG(LOG_WARNING, "ignore invalid journal %s\n", filename);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * remove the journal, when the index and the used block list are in sync
+ * with the files
+ */
+void ddfs_journal_remove()
+{
+    char filename[FILENAME_MAX];
+    int segment;
+
+    for (segment=0; segment<2; segment++)
+    {
+        snprintf(filename, sizeof(filename), "%s/%s.%d", ddfs->pdir, JOURNAL_FILENAME, segment);
+        if (unlink(filename)==-1 && errno!=ENOENT) DDFS_LOG(LOG_ERR, "cannot remove journal %s (%s)\n", filename, strerror(errno));
+    }
+}
+
+/*
+ * parallel directory walker used by reclaim and fsck
+ */
+struct ddfs_walk_dir
+{
+    struct ddfs_walk_dir *next;
+    char path[];
+};
+
+struct ddfs_walk
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct ddfs_walk_dir *dirs;   // directories waiting to be read
+    int busy;                     // threads reading a directory
+    int res;                      // first error, stop the walk
+    dev_t dev;                    // don't cross mount points
+    ddfs_walk_fn fn;
+    void *ctx;
+};
+
+struct ddfs_walk_thread
+{
+    struct ddfs_walk *walk;
+    int thread;
+    pthread_t pthread;
+};
+
+static struct ddfs_walk_dir *ddfs_walk_dir_new(const char *parent, const char *name)
+{
+    int len=strlen(parent);
+    struct ddfs_walk_dir *dir=malloc(sizeof(struct ddfs_walk_dir)+len+1+strlen(name)+1);
+    if (dir==NULL) return NULL;
+    strcpy(dir->path, parent);
+    if (name[0])
+    {
+        if (len==0 || parent[len-1]!='/') dir->path[len++]='/';
+        strcpy(dir->path+len, name);
+    }
+    dir->next=NULL;
+    return dir;
+}
+
+/**
+ * read one directory, call fn for the regular files and return
+ * the sub-directories in a list
+ *
+ * @return 0 or the first non zero value returned by fn, -1 on error
+ */
+static int ddfs_walk_read_dir(struct ddfs_walk_thread *wt, struct ddfs_walk_dir *dir, struct ddfs_walk_dir **subdirs)
+{
+    struct ddfs_walk *walk=wt->walk;
+    struct dirent *entry;
+    struct stat st;
+    int res=0;
+
+    DIR *dp=opendir(dir->path);
+    if (dp==NULL)
+    {
+        if (errno==ENOENT || errno==ENOTDIR) return 0; // removed or replaced in between
+        DDFS_LOG(LOG_ERR, "cannot open directory: %s (%s)\n", dir->path, strerror(errno));
+        return -1;
+    }
+
+    while (res==0 && (entry=readdir(dp))!=NULL)
+    {
+        if (entry->d_name[0]=='.' && (entry->d_name[1]=='\0' || (entry->d_name[1]=='.' && entry->d_name[2]=='\0'))) continue;
+
+        if (fstatat(dirfd(dp), entry->d_name, &st, AT_SYMLINK_NOFOLLOW)==-1)
+        {
+            if (errno==ENOENT || errno==ENOTDIR) continue; // removed in between
+            DDFS_LOG(LOG_ERR, "cannot stat: %s/%s (%s)\n", dir->path, entry->d_name, strerror(errno));
+            res=-1;
+            break;
+        }
+
+        if (S_ISDIR(st.st_mode))
+        {
+            if (st.st_dev!=walk->dev) continue;
+            struct ddfs_walk_dir *sub=ddfs_walk_dir_new(dir->path, entry->d_name);
+            if (sub==NULL)
+            {
+                DDFS_LOG(LOG_ERR, "cannot allocate memory: %s/%s\n", dir->path, entry->d_name);
+                res=-1;
+                break;
+            }
+            sub->next=*subdirs;
+            *subdirs=sub;
+        }
+        else if (S_ISREG(st.st_mode))
+        {
+            struct ddfs_walk_dir *file=ddfs_walk_dir_new(dir->path, entry->d_name);
+            if (file==NULL)
+            {
+                DDFS_LOG(LOG_ERR, "cannot allocate memory: %s/%s\n", dir->path, entry->d_name);
+                res=-1;
+                break;
+            }
+            res=walk->fn(file->path, &st, wt->thread, walk->ctx);
+            free(file);
+        }
+    }
+    closedir(dp);
+    return res;
+}
+
+static void *ddfs_walk_worker(void *arg)
+{
+    struct ddfs_walk_thread *wt=(struct ddfs_walk_thread *)arg;
+    struct ddfs_walk *walk=wt->walk;
+
+    pthread_mutex_lock(&walk->mutex);
+    while (1)
+    {
+        while (walk->dirs==NULL && walk->busy>0 && walk->res==0) pthread_cond_wait(&walk->cond, &walk->mutex);
+        if (walk->dirs==NULL || walk->res!=0) break; // nothing left to do or error
+
+        struct ddfs_walk_dir *dir=walk->dirs;
+        walk->dirs=dir->next;
+        walk->busy++;
+        pthread_mutex_unlock(&walk->mutex);
+
+        struct ddfs_walk_dir *subdirs=NULL;
+        int res=ddfs_walk_read_dir(wt, dir, &subdirs);
+        free(dir);
+
+        pthread_mutex_lock(&walk->mutex);
+        while (subdirs)
+        {   // share the sub-directories with the other threads
+            struct ddfs_walk_dir *sub=subdirs;
+            subdirs=sub->next;
+            sub->next=walk->dirs;
+            walk->dirs=sub;
+        }
+        if (res!=0 && walk->res==0) walk->res=res;
+        walk->busy--;
+        pthread_cond_broadcast(&walk->cond);
+    }
+    pthread_mutex_unlock(&walk->mutex);
+    return NULL;
+}
+
+/**
+ * choose the number of threads for ddfs_walk_tree() when each thread
+ * need its own copy of some data, like a bit_array of the blocks
+ *
+ * @param thread_mem the memory required by each thread
+ * @return the number of CPU, reduced to stay below DDFS_WALK_MAX_MEM
+ */
+int ddfs_walk_threads(long long int thread_mem)
+{
+    int threads=ddfs_cpu_count();
+    if (thread_mem>0 && threads*thread_mem>DDFS_WALK_MAX_MEM) threads=DDFS_WALK_MAX_MEM/thread_mem;
+    if (threads<1) threads=1;
+    return threads;
+}
+
+/**
+ * walk through the directory tree using multiple threads, like nftw()
+ * with FTW_MOUNT | FTW_PHYS, but fn is only called for regular files,
+ * in no particular order and concurrently.
+ *
+ * @param root the top directory
+ * @param threads the number of threads, 0 for one per CPU
+ * @param fn called for each regular file with the index of the calling thread
+ * (0 to threads-1) to let it use per thread data without locking
+ * @param ctx passed to fn
+ * @return 0 if all files have been walked, the first non zero value
+ * returned by fn, or -1 on error
+ */
+int ddfs_walk_tree(const char *root, int threads, ddfs_walk_fn fn, void *ctx)
+{
+    struct ddfs_walk walk;
+    struct stat st;
+    int i, started;
+
+    if (threads<=0) threads=ddfs_cpu_count();
+    if (threads<=0) threads=1;
+
+    if (lstat(root, &st)==-1)
+    {
+        DDFS_LOG(LOG_ERR, "cannot stat: %s (%s)\n", root, strerror(errno));
+        return -1;
+    }
+
+    pthread_mutex_init(&walk.mutex, NULL);
+    pthread_cond_init(&walk.cond, NULL);
+    walk.busy=0;
+    walk.res=0;
+    walk.dev=st.st_dev;
+    walk.fn=fn;
+    walk.ctx=ctx;
+    walk.dirs=ddfs_walk_dir_new(root, "");
+
+    struct ddfs_walk_thread *wts=malloc(threads*sizeof(struct ddfs_walk_thread));
+    if (walk.dirs==NULL || wts==NULL)
+    {
+        DDFS_LOG(LOG_ERR, "cannot allocate memory to walk: %s\n", root);
+        free(walk.dirs);
+        free(wts);
+        return -1;
+    }
+
+    for (started=0; started<threads; started++)
+    {
+        wts[started].walk=&walk;
+        wts[started].thread=started;
+        if (pthread_create(&wts[started].pthread, NULL, ddfs_walk_worker, wts+started)!=0) break;
+    }
+
+    if (started==0)
+    {   // walk alone
+        wts[0].walk=&walk;
+        wts[0].thread=0;
+        ddfs_walk_worker(wts);
+    }
+    for (i=0; i<started; i++) pthread_join(wts[i].pthread, NULL);
+
+    while (walk.dirs)
+    {   // left after an error
+        struct ddfs_walk_dir *dir=walk.dirs;
+        walk.dirs=dir->next;
+        free(dir);
+    }
+    free(wts);
+    pthread_cond_destroy(&walk.cond);
+    pthread_mutex_destroy(&walk.mutex);
+    return walk.res;
+}
+
+/**
+ * read consecutive nodes from a ddumbfs file
+ *
+ * @param fd the file
+ * @param node_pos the position of the first node to read
+ * @param buf the destination, at least count*c_node_size long
+ * @param count the maximum number of nodes to read
+ * @return the number of bytes read, that can include an incomplete last node,
+ * 0 at the end of the file, -1 on error
+ */
+int ddfs_read_nodes(int fd, long long int node_pos, unsigned char *buf, int count)
+{
+    off_t offset=ddfs->c_file_header_size+node_pos*ddfs->c_node_size;
+    int size=count*ddfs->c_node_size;
+    int done=0;
+
+    while (done<size)
+    {
+        int len=pread(fd, buf+done, size-done, offset+done);
+        if (len==-1)
+        {
+            if (errno==EINTR) continue;
+            return -1;
+        }
+        if (len==0) break;
+        done+=len;
+    }
+    return done;
+}
@@ -28,6 +28,7 @@
 #include <stdio.h>
 #include <endian.h>
 #include <stdint.h>
+#include <sys/stat.h>
 
 #include "bits.h"
 #include "xlog.h"
@@ -79,6 +80,9 @@ extern struct xlogger ddfs_logger[];
 #define DDFS_MAGIC_BLOCK     "DDUMBFSB"
 #define DDFS_MAGIC_INDEX     "DDUMBFSI"
 #define DDFS_MAGIC_FILE      "DDUMBFSF"
+#define DDFS_MAGIC_REFCOUNT  "DDUMBFSR"
+#define DDFS_MAGIC_RECLAIM   "DDUMBFSS"
+#define DDFS_MAGIC_JOURNAL   "DDUMBFSJ"
 #define DDFS_MAGIC_BLOCK_LEN  8
 #define DDFS_MAGIC_INDEX_LEN  8
 #define DDFS_MAGIC_FILE_LEN   8
@@ -123,11 +127,26 @@ extern struct xlogger ddfs_logger[];
 
 #define BLOCK_ALIGMENT   1024
 
+/*
+ * in a compressed filesystem, a block that compress well is written in its
+ * slot of the block file behind a small header, the end of the slot is
+ * punched out of the block file, a block stored as is that looks like a
+ * compressed one is listed in DDFS_RAWZBLOCKS_FILENAME
+ */
+#define DDFS_ZBLOCK_MAGIC       "DDZ1"
+#define DDFS_ZBLOCK_MAGIC_LEN        4
+#define DDFS_ZBLOCK_HEADER_SIZE     12  // magic, size and crc32 of the compressed data
+#define DDFS_ZBLOCK_ALIGMENT      4096  // the slot is written and punched by pages
+
 #define DDFS_BACKUP_USEDBLOCK   "ddfsusedblocks"
 #define BLOCK_FILENAME          "ddfsblocks"
 #define INDEX_FILENAME          "ddfsidx"
 #define ROOT_DIR                "ddfsroot"
 #define CFG_FILENAME            "ddfs.cfg"
+#define REFCOUNT_FILENAME       "ddfsrefcount"
+#define RECLAIM_SUMMARY_FILENAME "ddfsreclaim"
+#define DDFS_RAWZBLOCKS_FILENAME "ddfsrawzblocks"
+#define JOURNAL_FILENAME        "ddfsjournal"   // two segments .0 and .1
 #define SPECIAL_DIR             "/.ddumbfs/"
 #define RECLAIM_FILE            "/.ddumbfs/reclaim"
 #define STATS_FILE              "/.ddumbfs/stats"
@@ -141,6 +160,8 @@ extern struct xlogger ddfs_logger[];
 #define FSCK_INDEX_PRELOAD	10000
 #define NODE_FSCK_PREFETCH	1000
 #define RECLAIM_INDEX_PRELOAD	20000
+#define DDFS_WALK_NODES         4096    // nodes read at once by the tree walkers
+#define DDFS_WALK_MAX_MEM       (256LL*1024*1024) // memory for the per thread data of a tree walk
 
 typedef long long int blockaddr;
 typedef long long int nodeidx;
@@ -173,13 +194,15 @@ struct ddfs_ctx
     int bfile_ro; // if direct_io, this is a read-only fd  else equal bfile
     int ifile;
     int bfile_isblk; // if bfile is a block device
-    long long int bfile_size;  // size of the blockfile in byte; this variable is initialized but not kept up2date
+    long long int bfile_size;  // size of the blockfile in byte; this variable is initialized but only kept up2date when compressing
     long long int bfile_last;  // last block in blockfile; this variable is initialized but not kept up2date
 
     unsigned char *nodes;
     void *usedblocks_map;
     struct bit_array ba_usedblocks; // block in use, live
     long long int usedblock;        // "maintained" number of block in use
+    struct bit_array ba_rawzblocks; // blocks stored as is that look compressed
+    int rawzblocks_fd;              // DDFS_RAWZBLOCKS_FILENAME or -1
 
     char *bfile_read_buffer; // aligned buffer, usage protected by bfile_mutex
     char *aux_buffer;        // aligned block buffer
@@ -220,6 +243,7 @@ struct ddfs_ctx
     int c_reuse_asap;
     int c_auto_buffer_flush;
     int c_auto_sync;
+    int c_compress;     // zlib compression level of the blocks, 0 for none
 
     long long int block_boundary_mask;
     long long int block_gap_mask;
@@ -250,6 +274,7 @@ long long int unitvalue(char *u);
 char *trim(char *s);
 long long int now();
 long long int micronow();
+long long int nanonow();
 void dsleep(double delay);
 
 int pathexists(const char *path);
@@ -265,10 +290,12 @@ int node_add(const unsigned char* new_node, int unique);
 int node_fix(nodeidx node_idx);
 
 int ddfs_lock(const char *filename);
+int ddfs_refcount_invalidate();
 int ddfs_unlock(const char *filename);
 int ddfs_testlock(const char *filename);
 
 void ddfs_hash(const char *block, unsigned char *hash);
+int ddfs_is_zero_block(const char *block);
 void ddfs_convert_addr(blockaddr addr, unsigned char *node_addr);
 void ddfs_set_node(nodeidx node_idx, blockaddr addr, const unsigned char *hash);
 blockaddr ddfs_get_node_addr(const unsigned char *node);
@@ -288,9 +315,19 @@ int ddfs_read_full_block(blockaddr addr, char *buf);
 void ddfs_forced_read_full_block(blockaddr addr, char *buf, int block_size);
 int ddfs_read_block(blockaddr addr, char *buf, int size, int gap);
 blockaddr ddfs_store_block(const char *block, blockaddr force_addr);
+int ddfs_encode_block(const char *block, char *slot);
+int ddfs_decode_block(blockaddr addr, const char *slot, char *block);
+int ddfs_slot_size(blockaddr addr, const char *slot);
+int ddfs_rawzblock_get(blockaddr addr);
+int ddfs_rawzblock_set(blockaddr addr, int raw);
+void ddfs_punch_block(blockaddr addr, int size);
+int ddfs_index_hash(unsigned char *bhash, blockaddr *baddr);
 blockaddr ddfs_write_block(const char *block, unsigned char *bhash);
+void ddfs_spin_pause(int *spin);
 
 int ddfs_save_usedblocks();
+int ddfs_save_usedblocks_prepare();
+int ddfs_save_usedblocks_finish();
 int ddfs_load_usedblocks(struct bit_array *ba);
 int ddfs_find_parent(char *path, char *parent);
 int ddfs_loadcfg(char *ddfs_parent, FILE *output);
@@ -300,4 +337,36 @@ int ddfs_need_fsck();
 
 int ddfs_cpu_count();
 
+/*
+ * journal of the blocks allocated and freed by ddumbfs, a record is
+ * committed only after the blockfile has been synced
+ */
+#define DDFS_JOURNAL_ALLOC  1
+#define DDFS_JOURNAL_FREE   2
+
+struct ddfs_journal_header
+{
+    char magic[DDFS_MAGIC_FILE_LEN];
+    uint64_t seq;               // the segment with the highest seq is the most recent
+    uint64_t block_count;
+};
+
+struct ddfs_journal_rec
+{
+    uint32_t type;              // DDFS_JOURNAL_ALLOC or DDFS_JOURNAL_FREE
+    uint32_t check;             // checksum to detect a partial write
+    uint64_t addr;
+    unsigned char hash[HASH_SIZE];
+};
+
+uint32_t ddfs_journal_checksum(struct ddfs_journal_rec *rec);
+int ddfs_journal_create(int segment, uint64_t seq);
+int ddfs_journal_open(int segment, struct ddfs_journal_header *header);
+void ddfs_journal_remove();
+
+typedef int (*ddfs_walk_fn)(const char *fpath, const struct stat *sb, int thread, void *ctx);
+int ddfs_walk_threads(long long int thread_mem);
+int ddfs_walk_tree(const char *root, int threads, ddfs_walk_fn fn, void *ctx);
+int ddfs_read_nodes(int fd, long long int node_pos, unsigned char *buf, int count);
+
 #endif
@@ -0,0 +1,69 @@
+/*
+ * ddfssocket.h
+ *
+ * protocol of the socket interface of ddumbfs
+ *
+ * each request is a struct socket_operation, followed by the filename for
+ * sop_open or by the data for sop_write. The server reply with an int,
+ * followed by the data for sop_read. The requests of a connection are
+ * processed in order, a client can send multiple requests before to read
+ * the replies.
+ *
+ * sop_shm attaches a shared memory to the connection, its file descriptor
+ * is passed with SCM_RIGHTS and size is its length. The file must be at
+ * least size bytes long and, when the system supports it, be a memfd sealed
+ * against shrinking, else ddumbfs could be killed by SIGBUS when the client
+ * truncates it. Then sop_shm_read and
+ * sop_shm_write transfer the data at offset aux in this memory instead of
+ * in the socket, and their size is not limited to one block.
+ *
+ * sop_shm_hashes writes the blocks of a range knowing only their hashes.
+ * The range starts at offset and its size is a multiple of the block size.
+ * At aux are the hashes of the blocks followed by one byte per block, set
+ * to 1 by ddumbfs for the blocks it doesn't have. The reply is the number
+ * of these blocks, that must be sent with sop_shm_write. sop_shm_info
+ * copies a struct socket_info at aux.
+ *
+ * sop_clone is followed by a struct ddfs_clone_range and clones a range of
+ * another file into the open one, by copying the nodes of the blocks. The
+ * same struct is used by the DDFS_IOC_CLONE ioctl on a file open for writing
+ * in the mounted filesystem. The offsets must be aligned on a block, a size
+ * of 0 clones up to the end of the source. The caller must be able to read
+ * the source, whose path cannot hold a '..' nor go through a symlink. The
+ * reply is 0 or -errno, the ioctl returns the size cloned in size.
+ */
+
+#ifndef DDFSSOCKET_H_
+#define DDFSSOCKET_H_
+
+#include <sys/ioctl.h>
+
+enum socket_operation_command { sop_noop, sop_open, sop_read, sop_write, sop_fsync, sop_flush, sop_close, sop_dump,
+                                sop_shm, sop_shm_read, sop_shm_write, sop_shm_hashes, sop_shm_info, sop_clone };
+
+struct socket_operation
+{
+    int command;
+    long long int offset;
+    long long int size;
+    long long int aux;
+};
+
+struct socket_info
+{
+    int block_size;
+    int hash_size;
+    char hash[32];              // the name of the hash algorithm
+};
+
+struct ddfs_clone_range
+{
+    long long int src_offset;
+    long long int dst_offset;
+    long long int size;
+    char src[4072];             // the path of the source, from the root of the filesystem
+};
+
+#define DDFS_IOC_CLONE _IOWR('D', 1, struct ddfs_clone_range)
+
+#endif /* DDFSSOCKET_H_ */
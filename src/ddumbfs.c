@@ -59,6 +59,7 @@
 #endif
 
 #include <stddef.h>
+#include <limits.h>
 #include <inttypes.h>
 
 #include <ctype.h>
@@ -85,6 +86,7 @@
 #include "bits.h"
 #include "ddfslib.h"
 #include "ddfschkrep.h"
+#include "ddfssocket.h"
 
 //#define pthread_mutex_lock_d(x)   { DDFS_LOG(LOG_NOTICE, "[%lu]++ pthread_mutex_lock   %p %s %d l=%d c=%d u=%d\n", thread_id(), (void*) (x), __func__, __LINE__, (x)->__data.__lock, (x)->__data.__count, (x)->__data.__nusers); pthread_mutex_lock(x); }
 //#define pthread_mutex_unlock_d(x) { DDFS_LOG(LOG_NOTICE, "[%lu]-- pthread_mutex_unlock %p %s %d l=%d c=%d u=%d\n", thread_id(), (void*) (x), __func__, __LINE__, (x)->__data.__lock, (x)->__data.__count, (x)->__data.__nusers); pthread_mutex_unlock(x); }
@@ -95,12 +97,15 @@
 #define pthread_cond_wait_d(c, x) { pthread_cond_wait(c, x); }
 
 #define XSTAT_FH_SZ     8  // (is dynamic now) at least 12 to backup VMware ESX via NFS, because vmkfstools open 8 simultaneous connection to the same file
+#define XSTAT_BUF_MAP_SZ  64 // number of buckets in xstat->buf_map, must be a power of 2
+#define FUSE_MAX_BACKGROUND 64 // pending background requests (readahead) when not set by the max_background option
 pthread_mutex_t ifile_mutex=PTHREAD_MUTEX_INITIALIZER;
 
 long long int r_file_count;
 long long int r_addr_count;
 long long int r_frag_count;
 long long int r_not_found;
+long long int r_file_reused;
 
 // cannot start reclaim() when in ddumb_buf_write() or reclaim() itself, this require a pthread_cond_t and its mutex
 pthread_mutex_t reclaim_mutex=PTHREAD_MUTEX_INITIALIZER;
@@ -114,6 +119,7 @@ int low_free_block_warning=0;
 pthread_spinlock_t reclaim_spinlock;
 struct bit_array ba_found_in_files;
 int reclaim_enable=0;
+#define RECLAIM_SWEEP_SIZE      65536   // bytes of index swept by reclaim() for each lock of ifile_mutex
 
 // handle save of block list at regulare interval
 long long int used_block_saved=-1;
@@ -123,6 +129,61 @@ pthread_mutex_t ddumb_background_mutex=PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t ddumb_background_cond=PTHREAD_COND_INITIALIZER;
 pthread_t ddumbfs_lockindex_pthread;
 
+// optional persistent reference counter of each block (-o refcount)
+struct refcount_header
+{
+    char magic[DDFS_MAGIC_FILE_LEN];
+    uint64_t block_count;
+    uint64_t ifile_mtime;   // mtime of the index file when the counters were saved
+    uint32_t clean;         // counters were saved at umount
+};
+#define REFCOUNT_HEADER_SIZE    4096
+#define REFCOUNT_RELEASE_DELAY  5     // in second, delay between two refcount_release_blocks()
+
+int refcount_fd=-1;
+void *refcount_map=NULL;
+long long int refcount_map_size;
+volatile uint32_t *refcount=NULL;             // NULL when refcount is disabled
+volatile long long int refcount_zero=0;       // number of counters that reached zero since last release
+int refcount_rebuild=0;                       // tree_explore() is rebuilding the counters
+void *refcount_links=NULL;                    // ino of the files with multiple links already counted
+pthread_t ddumbfs_refcount_pthread;
+pthread_mutex_t refcount_mutex=PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t refcount_cond=PTHREAD_COND_INITIALIZER;
+
+// optional journal of the blocks allocated and freed (-o journal)
+#define JOURNAL_COMMIT_DELAY    1     // in second, delay between two commits
+
+int journal_fd=-1;                              // current segment, -1 when the journal is disabled
+int journal_segment=0;
+uint64_t journal_seq=0;
+struct ddfs_journal_rec *journal_recs=NULL;     // records waiting for the next commit
+long long int journal_rec_count=0;
+long long int journal_rec_size=0;
+blockaddr *journal_freed=NULL;                  // blocks to free once their record is committed
+long long int journal_freed_count=0;
+long long int journal_freed_size=0;
+pthread_t ddumbfs_journal_pthread;
+pthread_mutex_t journal_mutex=PTHREAD_MUTEX_INITIALIZER;        // protect the records waiting for commit
+pthread_mutex_t journal_commit_mutex=PTHREAD_MUTEX_INITIALIZER; // one commit at a time
+pthread_cond_t journal_cond=PTHREAD_COND_INITIALIZER;
+
+// group commit of concurrent fsync()
+struct fsync_request
+{
+    int fd;
+    int isdatasync;
+    int res;
+    struct fsync_request *next;
+};
+
+struct fsync_request *fsync_pending=NULL;   // requests waiting for the next commit
+long long int fsync_ticket=0;               // last ticket given
+long long int fsync_done=0;                 // all tickets up to this one are committed
+int fsync_running=0;                        // a commit is in progress
+pthread_mutex_t fsync_mutex=PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t fsync_cond=PTHREAD_COND_INITIALIZER;
+
 typedef struct ddumb_param
 {
     char  *parent;
@@ -135,21 +196,32 @@ typedef struct ddumb_param
     char  *command_args;
     char  *ext_command_args;
     double attr_timeout;
+    int   refcount;
+    int   reclaim_summary;
+    int   journal;
+    char  *socket;
 } struct_ddumb_param;
 
-struct_ddumb_param ddumb_param = { NULL, -100, 0, 1, 2, 1, 95, NULL, NULL, 1.0L };
+struct_ddumb_param ddumb_param = { NULL, -100, 0, 1, 2, 1, 95, NULL, NULL, 1.0L, 0, 0, 0, NULL };
+
+struct fuse_conn_info ddumb_conn;           // the parameters negotiated with the kernel in ddumb_init()
 
 int next_reclaim=100;
 
 struct ddumb_fh;
 
 // simultaneous access to a file are protected by zones
+// each request lock its own zone, the zone live on the stack of the request
+// and is linked into xstat->zones (sorted by start) while it is locked
 struct xzone
 {
     long long int start;
-    long long int end;
+    long long int end;      // -1 means up to the end of the file
     char op;
-    char right;
+    char right;             // 'r' shared, 'w' exclusive, 'n' released
+    struct xzone *next;     // next locked zone in xstat->zones
+    int waiters;            // number of requests waiting for this zone
+    pthread_cond_t cond;    // signaled when the zone is released or its last waiter leave
 };
 
 // xstat is for extra stat (currently only file size)
@@ -165,8 +237,10 @@ struct xstat
     struct ddumb_fh **fhs;               // ddumb_fh pointing to this xstat, used to search for ddumb_fh->buf
     int fhs_max;                         // size of fhs[]
     int fhs_n;
+    struct ddumb_fh *buf_map[XSTAT_BUF_MAP_SZ]; // loaded buffers hashed by buf_off, chained by ddumb_fh->buf_map_next
+    struct xzone *zones;                 // zones currently locked, sorted by start
+    int refcount_unlinked;               // unlinked while open, the last release drops its blocks
     pthread_mutex_t xstat_lock;
-    pthread_cond_t  zone_cond;
     pthread_cond_t  buf_cond;
 };
 
@@ -194,6 +268,7 @@ struct ddumb_fh
     int buf_firstwrite;     // when this "loaded" buffer has been written for the first time
 //    long long int buf_off;  // the offset of this buffer inside the file
     off_t buf_off;  // the offset of this buffer inside the file
+    struct ddumb_fh *buf_map_next; // next fh in the same xstat->buf_map[] bucket
 #ifdef DO_SEQ_READAHEAD
     off_t next_seq_off;
     int nbytes;
@@ -207,7 +282,8 @@ struct ddumb_fh
     int special;
     int delayed_write_error_code;
     struct ddumb_fh *fh_src;
-    struct xzone zone;
+    long long int pool_submit;  // nanonow() when loaded in the writer pool
+    int shared_buf;             // the data to write are in memory the client can still modify
 
 };
 
@@ -219,15 +295,42 @@ struct xstat_root
     struct xstat* xstat;
 } xstat_root;
 
+// size of the files that are not open, to answer getattr without reading
+// the header. An entry is valid while the underlying file is unchanged
+#define XSTAT_CACHE_SZ 4096
+struct xstat_cache_entry
+{
+    long long int ino;
+    off_t st_size;              // stat of the underlying file
+    struct timespec st_mtim;
+    struct timespec st_ctim;
+    uint64_t size;              // the size in the header
+};
+
+struct xstat_cache
+{
+    pthread_mutex_t mutex;
+    unsigned int generation;    // incremented each time a header is saved
+    struct xstat_cache_entry entries[XSTAT_CACHE_SZ];
+} xstat_cache;
+
 
-struct ddumb_statistic
-{   // contains some usefull stat about the running ddumbfs
+struct ddumb_counters
+{   // contains some usefull stat about the running ddumbfs, only long long int
     long long int header_load;
     long long int header_save;
 
     long long int hash;
 
     long long int block_write;
+    long long int block_write_zero;  // block of zeros, not hashed and not written
+    long long int write_splice;      // block read from the fuse pipe into the buffer
+    long long int write_multi_block; // request of multiple blocks without any loaded buffer
+    long long int write_hash;        // block written from its hash only, by the socket interface
+    long long int write_hash_unknown; // hash not found, the block must be sent
+    long long int clone;             // range cloned by DDFS_IOC_CLONE or the socket
+    long long int clone_node;        // block cloned by copying its node
+    long long int clone_data;        // block cloned by copying its data, because a buffer was loaded
     long long int read_before_write; // write not on a block boundary, requiring a read
     long long int eof_write;         // write after eof
     long long int ghost_write;       // block already exist, just reuse the block address
@@ -235,9 +338,11 @@ struct ddumb_statistic
     long long int block_write_slide;  // slide inside node block
     long long int block_read;
     long long int block_read_zero;    // read zero block, not from disk
+    long long int block_read_splice;  // block returned as a file descriptor to fuse
     long long int write_save;         // the write is not sequential, save an "uncompleted" buffer
-    long long int block_locked_max;   // max in block_locked[]
+    long long int block_locked_max;   // max number of block simultaneously locked
     long long int getattr;
+    long long int getattr_cached;    // size found in xstat_cache, header not read
     long long int fgetattr;
     long long int do_truncate;
     long long int ftruncate;
@@ -249,6 +354,7 @@ struct ddumb_statistic
     long long int flush;
     long long int release;
     long long int fsync;
+    long long int fsync_commit;      // number of group commits for all the fsync
     long long int inode_counter;     // number of inode simultaneously open (<=fh_counter)
     long long int fh_counter;        // number of ddumb_fh simultaneously open
 
@@ -266,13 +372,192 @@ struct ddumb_statistic
     long long int calc_hash;         // in mirco_sec
     long long int xstat_resize;
     long long int reclaim;
+    long long int refcount_release;   // blocks freed because their counter reached zero
+    long long int refcount_not_found; // blocks with counter at zero but not found in the index
+    long long int refcount_underflow; // counter already at zero when decremented
+    long long int journal_record;
+    long long int journal_commit;
 
     long long int counter1;
     long long int counter2;
     long long int counter3;
     long long int counter4;
 
-} ddumb_statistic;
+};
+
+/*
+ * latency histograms, log-linear like HdrHistogram. The values are in ns,
+ * each power of 2 is split in HIST_SUB buckets, the error is below 1/HIST_SUB
+ */
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1<<HIST_SUB_BITS)
+#define HIST_MAX_BITS 40        // up to 2^40 ns, about 18 min
+#define HIST_BUCKETS ((HIST_MAX_BITS-HIST_SUB_BITS+1)<<HIST_SUB_BITS)
+
+enum hist_id { hist_read, hist_write, hist_locate_hash, hist_hash, hist_bfile_read, hist_bfile_write, hist_pool_wait, HIST_COUNT };
+const char *hist_names[HIST_COUNT]={ "read", "write", "locate_hash", "hash", "bfile_read", "bfile_write", "pool_wait" };
+
+struct ddumb_histogram
+{
+    long long int count[HIST_BUCKETS];
+};
+
+/*
+ * each thread updates its own block of counters, without atomic and without
+ * sharing a cache line with another thread. The blocks are summed when the
+ * stats are read. The block of a thread that exits is reused by the next new
+ * thread and keeps its counts.
+ */
+struct ddumb_statistic_block
+{
+    struct ddumb_counters stat;
+    struct ddumb_histogram hist[HIST_COUNT];
+    struct ddumb_statistic_block *next;       // all the blocks
+    struct ddumb_statistic_block *next_free;  // blocks of the threads that have exited
+};
+
+struct ddumb_statistic_block statistic_shared; // used when a block cannot be allocated
+struct ddumb_statistic_block *statistic_blocks=&statistic_shared;
+struct ddumb_statistic_block *statistic_free=NULL;
+pthread_mutex_t statistic_mutex=PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t statistic_key;
+pthread_once_t statistic_once=PTHREAD_ONCE_INIT;
+static __thread struct ddumb_statistic_block *statistic_local=NULL;
+
+static void statistic_release(void *ptr)
+{   // called at the exit of a thread
+    struct ddumb_statistic_block *block=ptr;
+    pthread_mutex_lock(&statistic_mutex);
+    block->next_free=statistic_free;
+    statistic_free=block;
+    pthread_mutex_unlock(&statistic_mutex);
+}
+
+static void statistic_key_create()
+{
+    pthread_key_create(&statistic_key, statistic_release);
+}
+
+static struct ddumb_statistic_block *statistic_block_get()
+{   // attach a block to the current thread
+    struct ddumb_statistic_block *block=NULL;
+
+    pthread_once(&statistic_once, statistic_key_create);
+    pthread_mutex_lock(&statistic_mutex);
+    if (statistic_free)
+    {
+        block=statistic_free;
+        statistic_free=block->next_free;
+    }
+    else if (posix_memalign((void *)&block, 64, sizeof(struct ddumb_statistic_block))==0)
+    {
+        memset(block, 0, sizeof(struct ddumb_statistic_block));
+        block->next=statistic_blocks;
+        statistic_blocks=block;
+    }
+    else block=NULL;
+    pthread_mutex_unlock(&statistic_mutex);
+
+    if (block) pthread_setspecific(statistic_key, block);
+    else block=&statistic_shared;
+    statistic_local=block;
+    return block;
+}
+
+static inline struct ddumb_statistic_block *statistic_block()
+{
+    return statistic_local?statistic_local:statistic_block_get();
+}
+
+// the counters of the current thread
+#define ddumb_statistic (statistic_block()->stat)
+
+static inline int hist_bucket(long long int ns)
+{
+    if (ns<2*HIST_SUB) return (ns<0)?0:ns;
+    if (ns>=(1LL<<HIST_MAX_BITS)) ns=(1LL<<HIST_MAX_BITS)-1;
+    int e=63-__builtin_clzll(ns);   // the highest bit set
+    return ((e-HIST_SUB_BITS+1)<<HIST_SUB_BITS)+((ns>>(e-HIST_SUB_BITS)) & (HIST_SUB-1));
+}
+
+static long long int hist_value(int bucket)
+{   // the highest value in a bucket
+    if (bucket<2*HIST_SUB) return bucket;
+    int shift=(bucket>>HIST_SUB_BITS)-1;
+    return ((long long int)(HIST_SUB+(bucket & (HIST_SUB-1)))<<shift)+(1LL<<shift)-1;
+}
+
+/**
+ * record the time elapsed since start
+ *
+ * @param id the histogram
+ * @param start the value of nanonow() at the start of the operation
+ */
+static inline void hist_add(int id, long long int start)
+{
+    statistic_block()->hist[id].count[hist_bucket(nanonow()-start)]++;
+}
+
+/**
+ * return the value under which are a fraction of the values
+ *
+ * @param total the number of values in the histogram
+ * @param p the fraction, 0.99 for p99
+ */
+static long long int hist_percentile(struct ddumb_histogram *hist, long long int total, double p)
+{
+    long long int rank=(long long int)(total*p+0.999999);
+    long long int n=0;
+    int i;
+
+    if (rank<1) rank=1;
+    for (i=0; i<HIST_BUCKETS; i++)
+    {
+        n+=hist->count[i];
+        if (n>=rank) return hist_value(i);
+    }
+    return hist_value(HIST_BUCKETS-1);
+}
+
+/**
+ * sum the blocks of all the threads
+ *
+ * @param stat return the counters
+ * @param hist return the histograms, can be NULL
+ */
+static void statistic_sum(struct ddumb_counters *stat, struct ddumb_histogram *hist)
+{
+    struct ddumb_statistic_block *block;
+    long long int locked_max=0;
+    int i, j;
+
+    memset(stat, 0, sizeof(struct ddumb_counters));
+    if (hist) memset(hist, 0, HIST_COUNT*sizeof(struct ddumb_histogram));
+    pthread_mutex_lock(&statistic_mutex);
+    for (block=statistic_blocks; block!=NULL; block=block->next)
+    {
+        long long int *dst=(long long int *)stat;
+        long long int *src=(long long int *)&block->stat;
+        for (i=0; i<sizeof(struct ddumb_counters)/sizeof(long long int); i++) dst[i]+=src[i];
+        if (block->stat.block_locked_max>locked_max) locked_max=block->stat.block_locked_max;
+        if (hist) for (i=0; i<HIST_COUNT; i++) for (j=0; j<HIST_BUCKETS; j++) hist[i].count[j]+=block->hist[i].count[j];
+    }
+    pthread_mutex_unlock(&statistic_mutex);
+    stat->block_locked_max=locked_max; // a maximum, not a sum
+}
+
+static void statistic_reset()
+{
+    struct ddumb_statistic_block *block;
+
+    pthread_mutex_lock(&statistic_mutex);
+    for (block=statistic_blocks; block!=NULL; block=block->next)
+    {
+        memset(&block->stat, 0, sizeof(struct ddumb_counters));
+        memset(block->hist, 0, sizeof(block->hist));
+    }
+    pthread_mutex_unlock(&statistic_mutex);
+}
 
 
 struct ddumb_fh **writers_fh;
@@ -289,19 +574,33 @@ pthread_t *writer_pool_threads=NULL;
 // early declaration
 static int ddumb_buffer_flush(struct ddumb_fh *fh);
 static int _ddumb_write(const char *path, const char *buf, size_t size, off_t offset, struct ddumb_fh *fh);
+static int refcount_dec_file(int fd, long long int from_node, long long int to_node);
 void ddumb_test(FILE *file);
 
 
-#define WRITE_FIELD(file, field, unit) { if (ddumb_statistic.field>0) fprintf(file, "%-30s %9lld%s\n", #field, ddumb_statistic.field, unit); }
+#define WRITE_FIELD(file, field, unit) { if (stat.field>0) fprintf(file, "%-30s %9lld%s\n", #field, stat.field, unit); }
 
 static void ddumb_write_statistic(FILE *file)
 {   // write ddumbfs statistics to FILE *file
+    struct ddumb_counters stat;
+    struct ddumb_histogram *hist=malloc(HIST_COUNT*sizeof(struct ddumb_histogram));
+    int i, j;
+
+    statistic_sum(&stat, hist);
     WRITE_FIELD(file, header_load,"");
     WRITE_FIELD(file, header_save,"");
 
     WRITE_FIELD(file, hash,"");
 
     WRITE_FIELD(file, block_write,"");
+    WRITE_FIELD(file, block_write_zero,"");
+    WRITE_FIELD(file, write_splice,"");
+    WRITE_FIELD(file, write_multi_block,"");
+    WRITE_FIELD(file, write_hash,"");
+    WRITE_FIELD(file, write_hash_unknown,"");
+    WRITE_FIELD(file, clone,"");
+    WRITE_FIELD(file, clone_node,"");
+    WRITE_FIELD(file, clone_data,"");
     WRITE_FIELD(file, read_before_write,"");
     WRITE_FIELD(file, ghost_write,"");
     WRITE_FIELD(file, write_save,"");
@@ -312,10 +611,12 @@ static void ddumb_write_statistic(FILE *file)
 
     WRITE_FIELD(file, block_read,"");
     WRITE_FIELD(file, block_read_zero,"");
+    WRITE_FIELD(file, block_read_splice,"");
 
     WRITE_FIELD(file, block_locked_max,"");
 
     WRITE_FIELD(file, getattr,"");
+    WRITE_FIELD(file, getattr_cached,"");
     WRITE_FIELD(file, fgetattr,"");
     WRITE_FIELD(file, do_truncate,"");
     WRITE_FIELD(file, ftruncate,"");
@@ -327,6 +628,7 @@ static void ddumb_write_statistic(FILE *file)
     WRITE_FIELD(file, flush,"");
     WRITE_FIELD(file, release,"");
     WRITE_FIELD(file, fsync,"");
+    WRITE_FIELD(file, fsync_commit,"");
     WRITE_FIELD(file, inode_counter,"");
     WRITE_FIELD(file, fh_counter,"");
 
@@ -342,11 +644,27 @@ static void ddumb_write_statistic(FILE *file)
     WRITE_FIELD(file, wait_on_submit,"mms");
     WRITE_FIELD(file, calc_hash,"mms");
     WRITE_FIELD(file, xstat_resize,"");
+    WRITE_FIELD(file, reclaim,"");
+    WRITE_FIELD(file, refcount_release,"");
+    WRITE_FIELD(file, refcount_not_found,"");
+    WRITE_FIELD(file, refcount_underflow,"");
+    WRITE_FIELD(file, journal_record,"");
+    WRITE_FIELD(file, journal_commit,"");
     WRITE_FIELD(file, counter1,"");
     WRITE_FIELD(file, counter2,"");
     WRITE_FIELD(file, counter3,"");
     WRITE_FIELD(file, counter4,"");
 
+    for (i=0; hist && i<HIST_COUNT; i++)
+    {   // latencies in ns
+        long long int total=0;
+        for (j=0; j<HIST_BUCKETS; j++) total+=hist[i].count[j];
+        if (total==0) continue;
+        fprintf(file, "latency_%-22s %9lld p50=%lld p99=%lld p999=%lld ns\n", hist_names[i], total,
+                hist_percentile(hist+i, total, 0.50), hist_percentile(hist+i, total, 0.99), hist_percentile(hist+i, total, 0.999));
+    }
+    free(hist);
+
     long long int s, u;
     pthread_mutex_lock(&ifile_mutex);
     bit_array_count(&ddfs->ba_usedblocks, &s, &u); // no need to lock ddfs->ba_usedblocks here
@@ -358,9 +676,18 @@ static void ddumb_write_statistic(FILE *file)
     fprintf(file, "%-30s %9d\n", "align", ddfs->align);
     fprintf(file, "%-30s %9d\n", "lock_index", ddfs->lock_index);
     fprintf(file, "%-30s %9s\n", "hash", ddfs->c_hash);
+    fprintf(file, "%-30s %9d\n", "compress", ddfs->c_compress);
     fprintf(file, "%-30s %9d\n", "writer_pool", ddumb_param.pool);
+    fprintf(file, "%-30s %9u\n", "max_write", ddumb_conn.max_write);
+    fprintf(file, "%-30s %9u\n", "max_readahead", ddumb_conn.max_readahead);
+    fprintf(file, "%-30s %9u\n", "async_read", ddumb_conn.async_read);
+#if FUSE_VERSION >= 29
+    fprintf(file, "%-30s %9u\n", "max_background", ddumb_conn.max_background);
+#endif
     fprintf(file, "%-30s %9d\n", "reclaim", ddumb_param.reclaim);
     fprintf(file, "%-30s %9d\n", "next_reclaim", next_reclaim);
+    fprintf(file, "%-30s %9d\n", "refcount", refcount!=NULL);
+    fprintf(file, "%-30s %9d\n", "journal", journal_fd!=-1);
     fprintf(file, "%-30s %9s\n", "command_args", ddumb_param.command_args);
     fprintf(file, "%-30s %9s\n", "ext_command_args", ddumb_param.ext_command_args);
 }
@@ -390,6 +717,73 @@ void preload_node(long long int node_idx)
 /*
  * xstat_*
  */
+
+/**
+ * forget the size of a file in xstat_cache, a reader that loaded the header
+ * before this call will not be allowed to update the cache
+ *
+ * @param ino the inode of the file
+ */
+static void xstat_cache_invalidate(long long int ino)
+{
+    struct xstat_cache_entry *entry=xstat_cache.entries+(ino%XSTAT_CACHE_SZ);
+
+    pthread_mutex_lock(&xstat_cache.mutex);
+    xstat_cache.generation++;
+    if (entry->ino==ino) entry->ino=0;
+    pthread_mutex_unlock(&xstat_cache.mutex);
+}
+
+/**
+ * search the size of a closed file in xstat_cache
+ *
+ * @param st the stat of the underlying file
+ * @param size where to store the size found
+ * @param generation where to store the generation to pass to xstat_cache_put()
+ * @return 1 if found, 0 else
+ */
+static int xstat_cache_get(struct stat *st, uint64_t *size, unsigned int *generation)
+{
+    struct xstat_cache_entry *entry=xstat_cache.entries+(st->st_ino%XSTAT_CACHE_SZ);
+    int found=0;
+
+    pthread_mutex_lock(&xstat_cache.mutex);
+    if (entry->ino==(long long int)st->st_ino && entry->st_size==st->st_size
+        && entry->st_mtim.tv_sec==st->st_mtim.tv_sec && entry->st_mtim.tv_nsec==st->st_mtim.tv_nsec
+        && entry->st_ctim.tv_sec==st->st_ctim.tv_sec && entry->st_ctim.tv_nsec==st->st_ctim.tv_nsec)
+    {
+        *size=entry->size;
+        found=1;
+    }
+    *generation=xstat_cache.generation;
+    pthread_mutex_unlock(&xstat_cache.mutex);
+    return found;
+}
+
+/**
+ * store the size of a closed file in xstat_cache, unless a header was saved
+ * since the matching xstat_cache_get()
+ *
+ * @param st the stat of the underlying file
+ * @param size the size read in the header
+ * @param generation as returned by xstat_cache_get()
+ */
+static void xstat_cache_put(struct stat *st, uint64_t size, unsigned int generation)
+{
+    struct xstat_cache_entry *entry=xstat_cache.entries+(st->st_ino%XSTAT_CACHE_SZ);
+
+    pthread_mutex_lock(&xstat_cache.mutex);
+    if (generation==xstat_cache.generation)
+    {
+        entry->ino=st->st_ino;
+        entry->st_size=st->st_size;
+        entry->st_mtim=st->st_mtim;
+        entry->st_ctim=st->st_ctim;
+        entry->size=size;
+    }
+    pthread_mutex_unlock(&xstat_cache.mutex);
+}
+
 static int xstat_load(int fd, struct xstat *xstat, const char* filename)
 {   // load extra stat data from file header
     ddumb_statistic.header_load++;
@@ -421,7 +815,11 @@ static int xstat_save(int fd, struct xstat *xstat, const char* filename)
     ddumb_statistic.header_save++;
     DDFS_LOG_DEBUG("[%lu]++  xstat_save fd=%d size=%lld %s\n", thread_id(), fd, (long long int)xstat->h.size, filename);
 
+    xstat_cache_invalidate(xstat->ino);
+
     int len=file_header_get(fd, &xstat->h);
+    // a reader that got the new generation before the write could have read the old header
+    xstat_cache_invalidate(xstat->ino);
     if (len==-1)
     {
         DDFS_LOG(LOG_ERR, "xstat_save pwrite: %s (%s)\n", filename, strerror(errno));
@@ -644,12 +1042,17 @@ int _xstat_register(struct xstat_root *root, struct ddumb_fh *fh)
 //        DDFS_LOG_DEBUG("[%lu]** xstat_register xstat=%p memeset size=%d\n\n", thread_id(), fh->xstat, sizeof(xstat->fhs));
         xstat->fhs[0]=fh;
         xstat->fhs_n=1;
+        memset(xstat->buf_map, 0, sizeof(xstat->buf_map));
+        xstat->zones=NULL;
+        xstat->refcount_unlinked=0;
         DDFS_LOG_DEBUG("[%lu]pthread_mutex_init xstat %p %s\n", thread_id(), (void*)&xstat->xstat_lock, fh->filename);
         pthread_mutex_init(&xstat->xstat_lock, 0);
-        pthread_cond_init(&xstat->zone_cond, NULL);
         pthread_cond_init(&xstat->buf_cond, NULL);
 
-        res=xstat_load(fh->fd, fh->xstat, fh->filename);
+        // the file was opened before an unlink, but refcount_remove() has
+        // dropped its blocks, this open happens after the unlink
+        if (refcount && stbuf.st_nlink==0) res=-ENOENT;
+        else res=xstat_load(fh->fd, fh->xstat, fh->filename);
         if (res<0)
         {
             tdelete(&(fh->xstat), &(root->root), xstat_compare);
@@ -693,6 +1096,61 @@ int xstat_register(struct xstat_root *root, struct ddumb_fh *fh)
     return res;
 }
 
+/*
+ * xstat->buf_map[] give in O(1) the fh holding the loaded buffer at a given
+ * offset. There is at most one loaded buffer per offset. All xstat_buf_*()
+ * functions must be called with xstat->xstat_lock locked.
+ */
+#define xstat_buf_bucket(xstat, off) (&(xstat)->buf_map[((off)>>ddfs->block_size_shift) & (XSTAT_BUF_MAP_SZ-1)])
+
+static struct ddumb_fh *xstat_buf_find(struct xstat *xstat, off_t off)
+{   // return the fh holding a loaded buffer at offset off or NULL
+    struct ddumb_fh *xfh=*xstat_buf_bucket(xstat, off);
+    while (xfh && xfh->buf_off!=off) xfh=xfh->buf_map_next;
+    return xfh;
+}
+
+static void xstat_buf_load(struct xstat *xstat, struct ddumb_fh *fh, int buf_loaded)
+{   // register the buffer of fh at offset fh->buf_off
+    struct ddumb_fh **bucket=xstat_buf_bucket(xstat, fh->buf_off);
+    assert(xstat_buf_find(xstat, fh->buf_off)==NULL);
+    fh->buf_map_next=*bucket;
+    *bucket=fh;
+    fh->buf_loaded=buf_loaded;
+}
+
+static void xstat_buf_unload(struct xstat *xstat, struct ddumb_fh *fh)
+{   // unregister the buffer of fh, if any
+    if (fh->buf_loaded==DDFS_BUF_EMPTY) return;
+    struct ddumb_fh **pfh=xstat_buf_bucket(xstat, fh->buf_off);
+    while (*pfh!=fh) pfh=&(*pfh)->buf_map_next;
+    *pfh=fh->buf_map_next;
+    fh->buf_map_next=NULL;
+    fh->buf_loaded=DDFS_BUF_EMPTY;
+}
+
+/**
+ * check if a buffer is loaded over the full blocks of a request
+ *
+ * the caller must hold a zone lock over the request, then no buffer can
+ * be loaded by another thread in these blocks until the zone is unlocked
+ *
+ * @return 1 if none of the full blocks has a buffer loaded
+ */
+static int xstat_buf_none(struct xstat *xstat, off_t offset, size_t size)
+{
+    off_t start=(offset+ddfs->c_block_size-1) & ddfs->block_boundary_mask;
+    off_t end=(offset+size) & ddfs->block_boundary_mask;
+    off_t off;
+    int none=1;
+
+    if (end-start<2*ddfs->c_block_size) return 0; // not worth it
+    pthread_mutex_lock_d(&xstat->xstat_lock);
+    for (off=start; none && off<end; off+=ddfs->c_block_size) none=(xstat_buf_find(xstat, off)==NULL);
+    pthread_mutex_unlock_d(&xstat->xstat_lock);
+    return none;
+}
+
 int xstat_subscribe(struct ddumb_fh *fh_src, struct ddumb_fh *fh_dst)
 {
     struct xstat *xstat=fh_dst->xstat=fh_src->xstat;
@@ -720,8 +1178,9 @@ int xstat_subscribe(struct ddumb_fh *fh_src, struct ddumb_fh *fh_dst)
     }
     xstat->fhs[xstat->fhs_n++]=fh_dst;
 
-    fh_dst->buf_loaded=DDFS_BUF_RDONLY;
-    fh_src->buf_loaded=DDFS_BUF_EMPTY;
+    // fh_dst take the ownership of the buffer at buf_off
+    xstat_buf_unload(xstat, fh_src);
+    xstat_buf_load(xstat, fh_dst, DDFS_BUF_RDONLY);
 
     pthread_mutex_unlock_d(&xstat->xstat_lock);
     DDFS_LOG_DEBUG("[%lu]++  xstat_subscribe fd=%d fh=%p fh_src=%p xstat=%p ino=%lld fhs_n=%d %s %s\n", thread_id(), fh_dst->fd, fh_dst, fh_src, fh_dst->xstat, fh_dst->xstat->ino, fh_dst->xstat->fhs_n, fh_dst->filename, fh_src->filename);
@@ -751,34 +1210,43 @@ static void xstat_unsubscribe(struct ddumb_fh *fh)
     assert(found);
 }
 
-static int xstat_get(struct xstat_root *root, struct xstat *xstat, const char *path)
+static int xstat_get(struct xstat_root *root, struct xstat *xstat, const char *path, struct stat *st)
 {
     // get xstat from tsearch tree or from header file if not found
     // idem xstat_load but don't need xstat_release, use tfind instead of tsearch, this is read only
+    // the header of a closed file is read without holding root->mutex
     int res=0;
+    unsigned int generation;
     pthread_mutex_lock_d(&(root->mutex));
 
     void *val=tfind((const void *)xstat, &(root->root), xstat_compare);
 //  DDFS_LOG_DEBUG("[%lu]++  xstat_get tsearch root=%p xtstat=%p  -> xstat=%p\n", thread_id(), (void *)root->root, (void *)root->xstat, (void*)*(struct xstat**)val);
-    if (val==NULL)
+    if (val!=NULL)
     {
-        int fd=open(path, O_RDONLY);
-        if (fd==-1)
-        {
-            DDFS_LOG(LOG_ERR, "xstat_get: cannot open %s to read header: %s\n", path, strerror(errno));
-            res=-errno;
-        }
-        else
-        {
-            res=xstat_load(fd, xstat, path);
-            close(fd);
-        }
+        file_header_copy(&xstat->h, &(*(struct xstat**)val)->h);
+        pthread_mutex_unlock_d(&(root->mutex));
+        return 0;
+    }
+    pthread_mutex_unlock_d(&(root->mutex));
+
+    if (xstat_cache_get(st, &xstat->h.size, &generation))
+    {
+        ddumb_statistic.getattr_cached++;
+        return 0;
+    }
+
+    int fd=open(path, O_RDONLY);
+    if (fd==-1)
+    {
+        DDFS_LOG(LOG_ERR, "xstat_get: cannot open %s to read header: %s\n", path, strerror(errno));
+        res=-errno;
     }
     else
     {
-        file_header_copy(&xstat->h, &(*(struct xstat**)val)->h);
+        res=xstat_load(fd, xstat, path);
+        close(fd);
+        if (res==0) xstat_cache_put(st, xstat->h.size, generation);
     }
-    pthread_mutex_unlock_d(&(root->mutex));
     return res;
 }
 
@@ -788,6 +1256,7 @@ int xstat_release(struct xstat_root *root, struct ddumb_fh *fh)
     void *p;
 
     struct xstat *xstat=fh->xstat;
+    int drop=0;
     DDFS_LOG_DEBUG("[%lu]++  xstat_release fd=%d fh=%p xstat=%p ino=%lld root->xstat=%p %s\n", thread_id(), fh->fd, fh, fh->xstat, xstat->ino, root->xstat, fh->filename);
 //DDFS_LOG(LOG_NOTICE, "[%lu]++  xstat_release fd=%d fh=%p xstat=%p ino=%lld root->xstat=%p %s\n", thread_id(), fh->fd, fh, fh->xstat, xstat->ino, root->xstat, fh->filename);
 
@@ -797,6 +1266,7 @@ int xstat_release(struct xstat_root *root, struct ddumb_fh *fh)
     {
         // cannot update header if file was open readonly
         if (!fh->rdonly && !xstat->saved) res=xstat_save(fh->fd, fh->xstat, fh->filename);
+        drop=xstat->refcount_unlinked;
         p=tdelete(fh->xstat, &(root->root), xstat_compare);
         ddumb_statistic.inode_counter--;
         if (p==NULL)
@@ -809,7 +1279,6 @@ int xstat_release(struct xstat_root *root, struct ddumb_fh *fh)
         assert(xstat->fhs[0]==fh);
 
         pthread_mutex_destroy(&xstat->xstat_lock);
-        pthread_cond_destroy(&xstat->zone_cond);
         pthread_cond_destroy(&xstat->buf_cond);
 
         // reuse this xstat pointer if possible, else free it
@@ -842,6 +1311,9 @@ int xstat_release(struct xstat_root *root, struct ddumb_fh *fh)
 
 //xstat_dump(root);
     pthread_mutex_unlock_d(&(root->mutex));
+
+    // the file is gone, nobody can register it again, see _xstat_register()
+    if (drop) refcount_dec_file(fh->fd, 0, -1);
     return res;
 }
 
@@ -853,131 +1325,181 @@ static int zone_overlap(long long int offset1, long long int size1, long long in
 }
 */
 
-static void xzone_lock(struct ddumb_fh *fh, long long int offset, long long int size, char op)
-{   // lock a zone
+static void xzone_lock(struct ddumb_fh *fh, struct xzone *zone, long long int offset, long long int size, char op)
+{   // lock a zone, zone is the token to give back to xzone_unlock()
     struct xstat *xstat=fh->xstat;
     char right='n';
 
     ddumb_statistic.lock_zone++;
 
     pthread_mutex_lock_d(&xstat->xstat_lock);
-    fh->zone.op=op;
+    zone->op=op;
+    zone->right='n';
+    zone->waiters=0;
 
-    int busy=1; // zone is already in use
-    while (busy)
-    {
+    struct xzone *xzone;
+    do
+    {   // the zone depends on the file size that can change while waiting
         if (op=='W')
         {   // write
-            if (offset<xstat->h.size) fh->zone.start=(offset & ddfs->block_boundary_mask);
-            else fh->zone.start=(xstat->h.size & ddfs->block_boundary_mask);
-            if (offset+size>xstat->h.size) fh->zone.end=-1;
-            else fh->zone.end=((offset+size+ddfs->c_block_size-1) & ddfs->block_boundary_mask);
+            if (offset<xstat->h.size) zone->start=(offset & ddfs->block_boundary_mask);
+            else zone->start=(xstat->h.size & ddfs->block_boundary_mask);
+            if (offset+size>xstat->h.size) zone->end=-1;
+            else zone->end=((offset+size+ddfs->c_block_size-1) & ddfs->block_boundary_mask);
             right='w';
         }
         else if (op=='R')
         {   // read
-            fh->zone.start=(offset & ddfs->block_boundary_mask);
-            fh->zone.end=((offset+size+ddfs->c_block_size-1) & ddfs->block_boundary_mask);
+            zone->start=(offset & ddfs->block_boundary_mask);
+            zone->end=((offset+size+ddfs->c_block_size-1) & ddfs->block_boundary_mask);
             right='r';
         }
         else if (op=='T')
         {   // truncate
-            if (offset<xstat->h.size) fh->zone.start=(offset & ddfs->block_boundary_mask);
-            else fh->zone.start=(xstat->h.size & ddfs->block_boundary_mask);
-            fh->zone.end=-1;
+            if (offset<xstat->h.size) zone->start=(offset & ddfs->block_boundary_mask);
+            else zone->start=(xstat->h.size & ddfs->block_boundary_mask);
+            zone->end=-1;
             right='w';
         }
         else // unknown operation
         {
-            DDFS_LOG(LOG_ERR, "[%lu]ZONE LOCK unknow operation '%c' : fh=%p fd=%d ino=%lld start=0x%llx(%lld) end=0x%llx(%lld) %s\n", thread_id(), fh->zone.op, fh, fh->fd, (long long int)xstat->ino, fh->zone.start, fh->zone.start, fh->zone.end, fh->zone.end, fh->filename);
+            DDFS_LOG(LOG_ERR, "[%lu]ZONE LOCK unknow operation '%c' : fh=%p fd=%d ino=%lld offset=0x%llx(%lld) size=%lld %s\n", thread_id(), op, fh, fh->fd, (long long int)xstat->ino, offset, offset, size, fh->filename);
             assert(0);
         }
-        int i;
-        struct ddumb_fh *xfh;
-        for(i=0, busy=0; !busy && i<xstat->fhs_n; i++)
-        {
-            xfh=xstat->fhs[i];
-            if (xfh->zone.right=='n') continue;
 
-            busy=((xfh->zone.start<=fh->zone.start && (fh->zone.start<xfh->zone.end || xfh->zone.end==-1)) ||
-                  (fh->zone.start<=xfh->zone.start && (xfh->zone.start<xfh->zone.end || fh->zone.end==-1))) &&
-                  (right!='r' || xfh->zone.right!='r');
-        }
-        if (busy)
+        // search for a locked zone that overlap, zones are sorted by start
+        // then stop at the first one that start after the end of this one
+        for (xzone=xstat->zones; xzone!=NULL; xzone=xzone->next)
         {
-            ddumb_statistic.wait_for_zone++;
-            DDFS_LOG_DEBUG("[%lu]ZONE WAIT op=%c fd=%d ino=%lld start=0x%llx(%lld) end=0x%llx(%lld) fh=%p xfh=%p xop=%c xstart=0x%llx xend=0x%llx %s\n",
-                    thread_id(), fh->zone.op, fh->fd, (long long int)xstat->ino, fh->zone.start, fh->zone.start, fh->zone.end, fh->zone.end, fh, xfh, xfh->zone.op, xfh->zone.start, xfh->zone.end, fh->filename);
-            pthread_cond_wait_d(&xstat->zone_cond, &xstat->xstat_lock);
+            if (zone->end!=-1 && xzone->start>=zone->end) { xzone=NULL; break; }
+            if ((xzone->end==-1 || zone->start<xzone->end) && (right!='r' || xzone->right!='r')) break;
         }
 
-    }
-    fh->zone.right=right;
+        if (xzone)
+        {   // wait for the release of this zone, then retry
+            ddumb_statistic.wait_for_zone++;
+            DDFS_LOG_DEBUG("[%lu]ZONE WAIT op=%c fd=%d ino=%lld start=0x%llx(%lld) end=0x%llx(%lld) fh=%p xop=%c xstart=0x%llx xend=0x%llx %s\n",
+                    thread_id(), zone->op, fh->fd, (long long int)xstat->ino, zone->start, zone->start, zone->end, zone->end, fh, xzone->op, xzone->start, xzone->end, fh->filename);
+            xzone->waiters++;
+            while (xzone->right!='n') pthread_cond_wait_d(&xzone->cond, &xstat->xstat_lock);
+            xzone->waiters--;
+            if (xzone->waiters==0) pthread_cond_signal(&xzone->cond);
+        }
+    } while (xzone);
+
+    // insert the zone in the sorted list, after the zones starting before or at the same offset
+    struct xzone **pnext=&xstat->zones;
+    while (*pnext && (*pnext)->start<=zone->start) pnext=&(*pnext)->next;
+    pthread_cond_init(&zone->cond, NULL);
+    zone->right=right;
+    zone->next=*pnext;
+    *pnext=zone;
     pthread_mutex_unlock_d(&xstat->xstat_lock);
-    DDFS_LOG_DEBUG("[%lu]ZONE LOCK fh=%p op=%c fd=%d ino=%lld start=0x%llx(%lld) end=0x%llx(%lld) %s\n", thread_id(), fh, fh->zone.op, fh->fd, (long long int)xstat->ino, fh->zone.start, fh->zone.start, fh->zone.end, fh->zone.end, fh->filename);
+    DDFS_LOG_DEBUG("[%lu]ZONE LOCK fh=%p op=%c fd=%d ino=%lld start=0x%llx(%lld) end=0x%llx(%lld) %s\n", thread_id(), fh, zone->op, fh->fd, (long long int)xstat->ino, zone->start, zone->start, zone->end, zone->end, fh->filename);
 }
 
-static void xzone_unlock(struct ddumb_fh *fh)
-{   // unlock a zone
-    pthread_mutex_lock_d(&fh->xstat->xstat_lock);
-    DDFS_LOG_DEBUG("[%lu]ZONE UNLOCK fh=%p op=%c ino=%lld start=0x%llx(%lld) end=0x%llx(%lld) %s\n", thread_id(), fh, fh->zone.op, (long long int)fh->xstat->ino, fh->zone.start, fh->zone.start, fh->zone.end, fh->zone.end, fh->filename);
-    fh->zone.op='N';
-    fh->zone.right='n';
-    pthread_cond_broadcast(&fh->xstat->zone_cond);
-    pthread_mutex_unlock_d(&fh->xstat->xstat_lock);
+static void xzone_unlock(struct ddumb_fh *fh, struct xzone *zone)
+{   // unlock a zone, and wait for the waiters to leave it before to return
+    struct xstat *xstat=fh->xstat;
+    pthread_mutex_lock_d(&xstat->xstat_lock);
+    DDFS_LOG_DEBUG("[%lu]ZONE UNLOCK fh=%p op=%c ino=%lld start=0x%llx(%lld) end=0x%llx(%lld) %s\n", thread_id(), fh, zone->op, (long long int)xstat->ino, zone->start, zone->start, zone->end, zone->end, fh->filename);
+    struct xzone **pnext=&xstat->zones;
+    while (*pnext!=zone) pnext=&(*pnext)->next;
+    *pnext=zone->next;
+    zone->op='N';
+    zone->right='n';
+    if (zone->waiters)
+    {   // the zone is on my stack, it must stay valid until all waiters have seen the release
+        pthread_cond_broadcast(&zone->cond);
+        while (zone->waiters) pthread_cond_wait_d(&zone->cond, &xstat->xstat_lock);
+    }
+    pthread_mutex_unlock_d(&xstat->xstat_lock);
+    pthread_cond_destroy(&zone->cond);
 }
 
-#define BLOCK_MAX 128
-long long int block_locked[BLOCK_MAX];
-long long int block_locked_n=0;
-pthread_mutex_t block_mutex=PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t block_cond=PTHREAD_COND_INITIALIZER;
+/*
+ * blocks being written in the blockfile are registered in a hash table, and
+ * readers must wait for the end of the write. The entry live on the stack of
+ * the writer. block_locked_n allows readers to skip the table when nothing is
+ * being written
+ */
+#define BLOCK_LOCK_BUCKETS 64 // must be a power of 2
+struct block_locked
+{
+    long long int baddr;
+    struct block_locked *next;
+};
 
-static void block_lock(long long int baddr)
+struct block_bucket
 {
-    pthread_mutex_lock_d(&block_mutex);
-    while (block_locked_n>=BLOCK_MAX) pthread_cond_wait_d(&block_cond, &block_mutex);
-    block_locked[block_locked_n++]=baddr;
-    if (block_locked_n>ddumb_statistic.block_locked_max) ddumb_statistic.block_locked_max=block_locked_n;
-    DDFS_LOG_DEBUG("block_lock %lld\n", baddr);
-    pthread_mutex_unlock_d(&block_mutex);
-}
+    struct block_locked *head;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} block_buckets[BLOCK_LOCK_BUCKETS];
+
+volatile long long int block_locked_n=0; // number of block currently locked
+
+#define block_bucket(baddr) (&block_buckets[(baddr) & (BLOCK_LOCK_BUCKETS-1)])
 
-static void block_unlock(long long int baddr)
+static void block_lock_init()
 {
-    pthread_mutex_lock_d(&block_mutex);
-    int found=0;
     int i;
-    for (i=0; i<block_locked_n; i++)
+    for (i=0; i<BLOCK_LOCK_BUCKETS; i++)
     {
-        if (block_locked[i]==baddr)
-        {
-            found=1;
-            block_locked_n--;
-            if (i!=block_locked_n) block_locked[i]=block_locked[block_locked_n];
-            pthread_cond_broadcast(&block_cond);
-            break;
-        }
+        block_buckets[i].head=NULL;
+        pthread_mutex_init(&block_buckets[i].mutex, NULL);
+        pthread_cond_init(&block_buckets[i].cond, NULL);
     }
-    assert(found!=0);
-    DDFS_LOG_DEBUG("block_unlock %lld\n", baddr);
-    pthread_mutex_unlock_d(&block_mutex);
+}
+
+static void block_lock(struct block_locked *bl, long long int baddr)
+{
+    struct block_bucket *bucket=block_bucket(baddr);
+    bl->baddr=baddr;
+    pthread_mutex_lock_d(&bucket->mutex);
+    bl->next=bucket->head;
+    bucket->head=bl;
+    pthread_mutex_unlock_d(&bucket->mutex);
+    long long int n=__sync_add_and_fetch(&block_locked_n, 1);
+    if (n>ddumb_statistic.block_locked_max) ddumb_statistic.block_locked_max=n; // not accurate, but good enough
+    DDFS_LOG_DEBUG("block_lock %lld\n", baddr);
+}
+
+static void block_unlock(struct block_locked *bl)
+{
+    struct block_bucket *bucket=block_bucket(bl->baddr);
+    pthread_mutex_lock_d(&bucket->mutex);
+    struct block_locked **pbl=&bucket->head;
+    while (*pbl && *pbl!=bl) pbl=&(*pbl)->next;
+    assert(*pbl==bl);
+    *pbl=bl->next;
+    __sync_sub_and_fetch(&block_locked_n, 1);
+    pthread_cond_broadcast(&bucket->cond);
+    pthread_mutex_unlock_d(&bucket->mutex);
+    DDFS_LOG_DEBUG("block_unlock %lld\n", bl->baddr);
 }
 
 static void block_wait(long long int baddr)
 {
-    pthread_mutex_lock_d(&block_mutex);
-    int i;
-    for (i=0; i<block_locked_n; i++)
+    // the node pointing to baddr was set before block_lock(), both under
+    // ifile_mutex, be sure to read block_locked_n after the address
+    __sync_synchronize();
+    if (block_locked_n==0) return;
+
+    struct block_bucket *bucket=block_bucket(baddr);
+    pthread_mutex_lock_d(&bucket->mutex);
+    struct block_locked *bl=bucket->head;
+    while (bl)
     {
-        if (block_locked[i]==baddr)
+        if (bl->baddr==baddr)
         {
             DDFS_LOG(LOG_WARNING, "block_wait: I WAS RIGHT TO CHECK FOR THIS VERY UNLIKELY RACE CONDITION! block=%lld\n", baddr);
-            pthread_cond_wait_d(&block_cond, &block_mutex);
-            i=-1;
+            pthread_cond_wait_d(&bucket->cond, &bucket->mutex);
+            bl=bucket->head; // search again from the start of the bucket
         }
+        else bl=bl->next;
     }
-    pthread_mutex_unlock_d(&block_mutex);
+    pthread_mutex_unlock_d(&bucket->mutex);
 }
 
 
@@ -995,14 +1517,14 @@ struct ddumb_fh *ddumb_alloc_fh(struct fuse_file_info *fi, int fd, int rdonly, i
         fh->buf_loaded=DDFS_BUF_EMPTY;
         fh->pool_status=ps_empty;
         fh->buf_off=-1;
+        fh->buf_map_next=NULL;
         fh->pool_writer=0;
         fh->rdonly=rdonly;
         fh->special=special;
         fh->buf=NULL;
         fh->xstat=NULL;
         fh->delayed_write_error_code=0;
-        fh->zone.op='N';
-        fh->zone.right='n';
+        fh->shared_buf=0;
 #ifdef DO_SEQ_READAHEAD
 	fh->next_seq_off=-1;
 	fh->nbytes=0;
@@ -1085,125 +1607,681 @@ static int ddumb_free_fh(struct fuse_file_info *fi)
 }
 
 
-int tree_explore(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
-{   // called by nftw to walk the tree
-    int res, len;
-    unsigned char node[NODE_SIZE];
-    unsigned char *hash=node+ddfs->c_addr_size;
-    blockaddr addr;
-    long long int prev_addr=-1;
+/*
+ * journal_*() log the blocks allocated and freed, to help the check after
+ * a crash. A record is written only after the blockfile has been synced,
+ * then a block in a committed ALLOC record hold the right data. A freed
+ * block is really released only when its FREE record is committed,
+ * otherwise it could be reused and get new data while the journal still
+ * says it hold the old one.
+ * Segments are switched each time the used block list is saved, the
+ * records of the segment before the previous one are not needed anymore.
+ */
 
-    if (typeflag!=FTW_F || ! S_ISREG(sb->st_mode)) return 0;
-    if (0==strncmp(fpath+ddfs->rdir_len, SPECIAL_DIR, ddfs->special_dir_len))
-    {   // skip SPECIAL_DIR
-        return 0;
+/**
+ * add a record to the journal, it will be written by the next commit
+ *
+ * @param type DDFS_JOURNAL_ALLOC or DDFS_JOURNAL_FREE
+ * @return 0 for success
+ */
+static int journal_append(int type, blockaddr addr, const unsigned char *hash)
+{
+    pthread_mutex_lock_d(&journal_mutex);
+    if (journal_rec_count==journal_rec_size)
+    {
+        long long int size=journal_rec_size ? 2*journal_rec_size : 1024;
+        struct ddfs_journal_rec *recs=realloc(journal_recs, size*sizeof(struct ddfs_journal_rec));
+        if (recs==NULL)
+        {
+            pthread_mutex_unlock_d(&journal_mutex);
+            return 1;
+        }
+        journal_recs=recs;
+        journal_rec_size=size;
     }
+    if (type==DDFS_JOURNAL_FREE && journal_freed_count==journal_freed_size)
+    {
+        long long int size=journal_freed_size ? 2*journal_freed_size : 1024;
+        blockaddr *freed=realloc(journal_freed, size*sizeof(blockaddr));
+        if (freed==NULL)
+        {
+            pthread_mutex_unlock_d(&journal_mutex);
+            return 1;
+        }
+        journal_freed=freed;
+        journal_freed_size=size;
+    }
+
+    struct ddfs_journal_rec *rec=journal_recs+journal_rec_count++;
+    memset(rec, 0, sizeof(struct ddfs_journal_rec));
+    rec->type=type;
+    rec->addr=addr;
+    memcpy(rec->hash, hash, ddfs->c_hash_size);
+    rec->check=ddfs_journal_checksum(rec);
+    if (type==DDFS_JOURNAL_FREE) journal_freed[journal_freed_count++]=addr;
+    ddumb_statistic.journal_record++;
+    pthread_mutex_unlock_d(&journal_mutex);
+    return 0;
+}
 
-    r_file_count++;
+/**
+ * free a block whose node has just been removed from the index
+ * Must be called with ifile_mutex locked.
+ */
+static void block_release(blockaddr addr, const unsigned char *hash)
+{
+    if (journal_fd!=-1 && journal_append(DDFS_JOURNAL_FREE, addr, hash)==0) return; // freed by journal_commit()
+    bit_array_unset(&ddfs->ba_usedblocks, addr);
+}
 
-    FILE *file=fopen(fpath, "r");  // FILE* are faster here
-    if (file==NULL)
-    {
-        DDFS_LOG(LOG_ERR, "reclaim cannot open: %s (%s)\n", fpath, strerror(errno));
-        return 1;
-    }
+/**
+ * write the waiting records after a sync of the blockfile, then free the
+ * blocks of the FREE records. When the journal cannot be written, it is
+ * disabled and removed, the next check will not rely on it.
+ *
+ * @return 0 for success
+ */
+static int journal_commit()
+{
+    int res=0;
+    long long int i;
 
-    // be careful, file_header_set_conv return c_file_header_size for empty file
-    uint64_t file_size;
-    len=file_header_set_conv(fileno(file), &file_size);
-    if (len==-1)
-    {
-        DDFS_LOG(LOG_ERR, "reclaim cannot read header: %s (%s)\n", fpath, strerror(errno));
-        fclose(file);
-        return 1;
-    }
-    else if (len!=ddfs->c_file_header_size)
+    pthread_mutex_lock_d(&journal_commit_mutex);
+    pthread_mutex_lock_d(&journal_mutex);
+    struct ddfs_journal_rec *recs=journal_recs;
+    long long int rec_count=journal_rec_count;
+    blockaddr *freed=journal_freed;
+    long long int freed_count=journal_freed_count;
+    journal_recs=NULL;
+    journal_rec_count=journal_rec_size=0;
+    journal_freed=NULL;
+    journal_freed_count=journal_freed_size=0;
+    pthread_mutex_unlock_d(&journal_mutex);
+
+    if (rec_count && journal_fd!=-1)
     {
-        DDFS_LOG(LOG_ERR, "reclaim invalid ddumbfs header, skip file: %s\n", fpath);
-        fclose(file);
-        return 0;
+        ssize_t size=rec_count*sizeof(struct ddfs_journal_rec);
+        if (fdatasync(ddfs->bfile)==-1 || write(journal_fd, recs, size)!=size || fdatasync(journal_fd)==-1)
+        {
+            DDFS_LOG(LOG_ERR, "cannot write journal, disable it (%s)\n", strerror(errno));
+            close(journal_fd);
+            journal_fd=-1;
+            ddfs_journal_remove();
+            res=1;
+        }
+        else ddumb_statistic.journal_commit++;
     }
+    pthread_mutex_unlock_d(&journal_commit_mutex);
 
-    res=fseek(file, ddfs->c_file_header_size, SEEK_SET);
-    if (res==-1)
+    if (freed_count)
     {
-        DDFS_LOG(LOG_ERR, "reclaim cannot seek after header: %s (%s)\n", fpath, strerror(errno));
-        fclose(file);
-        return 1;
+        pthread_mutex_lock_d(&ifile_mutex);
+        for (i=0; i<freed_count; i++) bit_array_unset(&ddfs->ba_usedblocks, freed[i]);
+        pthread_mutex_unlock_d(&ifile_mutex);
     }
+    free(recs);
+    free(freed);
+    return res;
+}
 
-    long long int offset=ddfs->c_file_header_size;
-    len=fread(node, 1, ddfs->c_node_size, file);
-    while (len==ddfs->c_node_size)
-    {
-        addr=ddfs_get_node_addr(node);
-
-        if (prev_addr!=-1 && prev_addr+1!=addr && addr!=0) r_frag_count++;
-        if (addr!=0) prev_addr=addr;
+/**
+ * switch to the other segment, just before the used block list is saved.
+ * Must be called with ifile_mutex locked.
+ */
+static void journal_checkpoint()
+{
+    if (journal_fd==-1) return;
 
-        if (addr>ddfs->c_block_count)
+    pthread_mutex_lock_d(&journal_commit_mutex);
+    if (journal_fd!=-1)
+    {
+        int fd=ddfs_journal_create(1-journal_segment, journal_seq+1);
+        if (fd!=-1)
         {
-            DDFS_LOG(LOG_WARNING, "reclaim invalid block address %lld: %s\n", addr, fpath);
+            close(journal_fd);
+            journal_fd=fd;
+            journal_segment=1-journal_segment;
+            journal_seq++;
         }
-        else if (addr!=0)
-        {
-            // fprintf(stderr,"addr=%lld\n", addr);
-            r_addr_count++;
+    }
+    pthread_mutex_unlock_d(&journal_commit_mutex);
+}
 
-            // search the index, if the same hash can be found for another block
-            // this will avoid to maybe loose useful information for next fsck
-            blockaddr baddr=addr;
+void *ddumbfs_journal(void *ptr)
+{   // commit the journal at regular interval
+    struct timeval now;
+    struct timespec timeout;
 
-            // Only search the index if we have it locked in memory
-            if(ddfs->lock_index) {
-                pthread_mutex_lock_d(&ifile_mutex);
-                nodeidx node_idx=ddfs_search_hash(hash, &baddr);
-                if (node_idx<-1) r_not_found++; // >=0 means found, -1 means == zeroes block
-                pthread_mutex_unlock_d(&ifile_mutex);
+    pthread_mutex_lock_d(&journal_mutex);
+    while (!ddumbfs_terminate)
+    {
+        gettimeofday(&now, NULL);
+        timeout.tv_sec=now.tv_sec+JOURNAL_COMMIT_DELAY;
+        timeout.tv_nsec=now.tv_usec*1000;
+        pthread_cond_timedwait(&journal_cond, &journal_mutex, &timeout);
+        pthread_mutex_unlock_d(&journal_mutex);
+        journal_commit();
+        pthread_mutex_lock_d(&journal_mutex);
+    }
+    pthread_mutex_unlock_d(&journal_mutex);
+    journal_commit();
+    pthread_exit(NULL);
+}
+
+/**
+ * start a new journal, the previous one has been used by the check at
+ * startup if any
+ *
+ * @return 0 for success
+ */
+static int journal_open()
+{
+    ddfs_journal_remove();
+    journal_segment=0;
+    journal_seq=1;
+    journal_fd=ddfs_journal_create(journal_segment, journal_seq);
+    return journal_fd==-1;
+}
+
+/*
+ * optional summary of the blocks used by each file, saved by reclaim() and
+ * reused by the next one for the files that didn't change (-o reclaim_summary)
+ */
+struct reclaim_run
+{
+    uint64_t start;
+    uint64_t len;
+};
+
+struct reclaim_summary_header
+{
+    char magic[DDFS_MAGIC_FILE_LEN];
+    uint64_t block_count;
+    uint64_t count;             // number of summaries
+};
+
+struct reclaim_summary_rec
+{   // saved in the file and followed by run_count struct reclaim_run
+    uint64_t ino;
+    int64_t mtime, mtime_nsec;
+    int64_t ctime, ctime_nsec;
+    int64_t addr_count;
+    int64_t frag_count;
+    int64_t not_found;
+    uint64_t run_count;
+};
+
+struct reclaim_summary
+{
+    struct reclaim_summary *next;   // in the same bucket of reclaim_summaries
+    int loaded;                     // read from the file, else created by this reclaim
+    struct reclaim_summary_rec rec;
+    struct reclaim_run runs[];
+};
+
+struct reclaim_summary **reclaim_summaries=NULL; // summaries of the previous reclaim, by ino
+long long int reclaim_summaries_size=0;         // number of buckets, a power of 2
+time_t reclaim_summary_start;                   // files changed after this time are not summarized
+
+// per thread data of tree_explore()
+struct reclaim_walk
+{
+    struct bit_array found;     // merged into ba_found_in_files at the end of the walk
+    unsigned char *nodes;       // DDFS_WALK_NODES nodes read at once
+    long long int file_count;
+    long long int addr_count;
+    long long int frag_count;
+    long long int not_found;
+    long long int file_reused;  // files not read thanks to their summary
+    int summary;                // build and use the summaries
+    struct reclaim_run *runs;   // the runs of the current file
+    long long int run_count, run_size;
+    struct reclaim_summary **keep;  // the summaries to save
+    long long int keep_count, keep_size;
+};
+
+/**
+ * add a block to the runs of the current file
+ *
+ * @return 0 for success
+ */
+static int reclaim_summary_add(struct reclaim_walk *rw, blockaddr addr)
+{
+    if (rw->run_count && rw->runs[rw->run_count-1].start+rw->runs[rw->run_count-1].len==addr)
+    {
+        rw->runs[rw->run_count-1].len++;
+        return 0;
+    }
+    if (rw->run_count==rw->run_size)
+    {
+        long long int size=rw->run_size ? 2*rw->run_size : 1024;
+        struct reclaim_run *runs=realloc(rw->runs, size*sizeof(struct reclaim_run));
+        if (runs==NULL) return 1;
+        rw->runs=runs;
+        rw->run_size=size;
+    }
+    rw->runs[rw->run_count].start=addr;
+    rw->runs[rw->run_count].len=1;
+    rw->run_count++;
+    return 0;
+}
+
+/**
+ * add a summary to the list of the summaries to save
+ *
+ * @return 0 for success
+ */
+static int reclaim_summary_keep(struct reclaim_walk *rw, struct reclaim_summary *sum)
+{
+    if (rw->keep_count==rw->keep_size)
+    {
+        long long int size=rw->keep_size ? 2*rw->keep_size : 1024;
+        struct reclaim_summary **keep=realloc(rw->keep, size*sizeof(struct reclaim_summary *));
+        if (keep==NULL) return 1;
+        rw->keep=keep;
+        rw->keep_size=size;
+    }
+    rw->keep[rw->keep_count++]=sum;
+    return 0;
+}
+
+/**
+ * search the summary of a file that didn't change since the last reclaim
+ *
+ * @return the summary or NULL if the file must be read
+ */
+static struct reclaim_summary *reclaim_summary_find(const struct stat *sb)
+{
+    if (reclaim_summaries==NULL) return NULL;
+    struct reclaim_summary *sum=reclaim_summaries[sb->st_ino & (reclaim_summaries_size-1)];
+    for (; sum; sum=sum->next)
+    {
+        if (sum->rec.ino!=sb->st_ino) continue;
+        if (sum->rec.mtime==sb->st_mtim.tv_sec && sum->rec.mtime_nsec==sb->st_mtim.tv_nsec
+            && sum->rec.ctime==sb->st_ctim.tv_sec && sum->rec.ctime_nsec==sb->st_ctim.tv_nsec) return sum;
+        return NULL;
+    }
+    return NULL;
+}
+
+static void reclaim_summary_free()
+{
+    long long int i;
+    for (i=0; reclaim_summaries && i<reclaim_summaries_size; i++)
+    {
+        while (reclaim_summaries[i])
+        {
+            struct reclaim_summary *sum=reclaim_summaries[i];
+            reclaim_summaries[i]=sum->next;
+            free(sum);
+        }
+    }
+    free(reclaim_summaries);
+    reclaim_summaries=NULL;
+    reclaim_summaries_size=0;
+}
+
+/**
+ * load the summaries saved by the last reclaim, if any
+ */
+static void reclaim_summary_load()
+{
+    char filename[FILENAME_MAX];
+    struct reclaim_summary_header header;
+    struct reclaim_summary_rec rec;
+    long long int i, loaded=0;
+
+    snprintf(filename, sizeof(filename), "%s/%s", ddfs->pdir, RECLAIM_SUMMARY_FILENAME);
+    FILE *file=fopen(filename, "r");
+    if (file==NULL) return;
+
+    if (1!=fread(&header, sizeof(header), 1, file)
+        || 0!=memcmp(header.magic, DDFS_MAGIC_RECLAIM, DDFS_MAGIC_FILE_LEN)
+        || header.block_count!=ddfs->c_block_count)
+    {
+        DDFS_LOG(LOG_WARNING, "reclaim ignore invalid summary file: %s\n", filename);
+        fclose(file);
+        return;
+    }
+
+    for (reclaim_summaries_size=1024; reclaim_summaries_size<header.count; reclaim_summaries_size*=2) ;
+    reclaim_summaries=calloc(reclaim_summaries_size, sizeof(struct reclaim_summary *));
+    for (i=0; reclaim_summaries && i<header.count; i++)
+    {
+        if (1!=fread(&rec, sizeof(rec), 1, file) || rec.run_count>ddfs->c_block_count) break;
+        struct reclaim_summary *sum=malloc(sizeof(struct reclaim_summary)+rec.run_count*sizeof(struct reclaim_run));
+        if (sum==NULL) break;
+        sum->loaded=1;
+        sum->rec=rec;
+        if (rec.run_count!=fread(sum->runs, sizeof(struct reclaim_run), rec.run_count, file))
+        {
+            free(sum);
+            break;
+        }
+        struct reclaim_summary **bucket=reclaim_summaries+(rec.ino & (reclaim_summaries_size-1));
+        sum->next=*bucket;  // files with multiple links are saved multiple times, only the last is used
+        *bucket=sum;
+        loaded++;
+    }
+    fclose(file);
+
+    if (i!=header.count)
+    {   // don't trust a part of the file
+        DDFS_LOG(LOG_WARNING, "reclaim ignore invalid summary file: %s\n", filename);
+        reclaim_summary_free();
+        return;
+    }
+    DDFS_LOG(LOG_INFO, "reclaim loaded %lld file summaries\n", loaded);
+}
+
+/**
+ * save the summaries of all files for the next reclaim
+ *
+ * @return 0 for success
+ */
+static int reclaim_summary_save(struct reclaim_walk *rw, int threads)
+{
+    char filename[FILENAME_MAX];
+    char tmpname[FILENAME_MAX];
+    struct reclaim_summary_header header;
+    long long int i, j;
+    int res=0;
+
+    snprintf(filename, sizeof(filename), "%s/%s", ddfs->pdir, RECLAIM_SUMMARY_FILENAME);
+    snprintf(tmpname, sizeof(tmpname), "%s/%s.tmp", ddfs->pdir, RECLAIM_SUMMARY_FILENAME);
+    FILE *file=fopen(tmpname, "w");
+    if (file==NULL)
+    {
+        DDFS_LOG(LOG_ERR, "reclaim cannot create summary file: %s (%s)\n", tmpname, strerror(errno));
+        return 1;
+    }
+
+    memcpy(header.magic, DDFS_MAGIC_RECLAIM, DDFS_MAGIC_FILE_LEN);
+    header.block_count=ddfs->c_block_count;
+    header.count=0;
+    for (i=0; i<threads; i++) header.count+=rw[i].keep_count;
+    if (1!=fwrite(&header, sizeof(header), 1, file)) res=1;
+
+    for (i=0; res==0 && i<threads; i++)
+    {
+        for (j=0; res==0 && j<rw[i].keep_count; j++)
+        {
+            struct reclaim_summary *sum=rw[i].keep[j];
+            if (1!=fwrite(&sum->rec, sizeof(sum->rec), 1, file)
+                || sum->rec.run_count!=fwrite(sum->runs, sizeof(struct reclaim_run), sum->rec.run_count, file)) res=1;
+        }
+    }
+
+    if (fclose(file)!=0) res=1;
+    if (res==0 && rename(tmpname, filename)==-1) res=1;
+    if (res)
+    {
+        DDFS_LOG(LOG_ERR, "reclaim cannot write summary file: %s (%s)\n", filename, strerror(errno));
+        unlink(tmpname);
+    }
+    return res;
+}
+
+int tree_explore(const char *fpath, const struct stat *sb, int thread, void *ctx)
+{   // called by ddfs_walk_tree() to walk the tree, concurrently by multiple threads
+    struct reclaim_walk *rw=(struct reclaim_walk *)ctx+thread;
+    int i, len, count;
+    unsigned char *node;
+    blockaddr addr;
+    long long int prev_addr=-1;
+
+    if (0==strncmp(fpath+ddfs->rdir_len, SPECIAL_DIR, ddfs->special_dir_len))
+    {   // skip SPECIAL_DIR
+        return 0;
+    }
+
+    if (refcount_rebuild && sb->st_nlink>1)
+    {   // count the blocks of a file with multiple links only once
+        struct xstat *key=malloc(sizeof(struct xstat));
+        if (key==NULL)
+        {
+            DDFS_LOG(LOG_ERR, "reclaim cannot allocate memory: %s\n", fpath);
+            return 1;
+        }
+        key->ino=sb->st_ino;
+        pthread_mutex_lock_d(&refcount_mutex);
+        void *val=tsearch(key, &refcount_links, xstat_compare);
+        pthread_mutex_unlock_d(&refcount_mutex);
+        if (val==NULL) { free(key); return 1; }
+        if (*(struct xstat **)val!=key) { free(key); return 0; }
+    }
+
+    rw->file_count++;
+
+    if (rw->summary)
+    {
+        struct reclaim_summary *sum=reclaim_summary_find(sb);
+        if (sum)
+        {   // the file didn't change since the last reclaim
+            long long int j;
+            for (j=0; j<sum->rec.run_count; j++)
+            {
+                blockaddr a;
+                for (a=sum->runs[j].start; a<sum->runs[j].start+sum->runs[j].len && a<ddfs->c_block_count; a++) bit_array_set(&rw->found, a);
             }
+            rw->addr_count+=sum->rec.addr_count;
+            rw->frag_count+=sum->rec.frag_count;
+            rw->not_found+=sum->rec.not_found;
+            rw->file_reused++;
+            if (reclaim_summary_keep(rw, sum)) rw->summary=0;
+            return 0;
+        }
+        rw->run_count=0;
+    }
+    long long int addr_count=rw->addr_count;
+    long long int frag_count=rw->frag_count;
+    long long int not_found=rw->not_found;
 
-            pthread_spin_lock(&reclaim_spinlock);
-            bit_array_set(&ba_found_in_files, addr);
-            // if another block was found, keep it too. I don't want to loose information
-            // that could be verified and maybe useful for fsck.
-            if (baddr!=addr) bit_array_set(&ba_found_in_files, baddr); // FYI block 0 can be set here when node_idx==-1
-            pthread_spin_unlock(&reclaim_spinlock);
+    int fd=open(fpath, O_RDONLY);
+    if (fd==-1)
+    {
+        if (errno==ENOENT || errno==ENOTDIR)
+        {   // removed in between
+            rw->file_count--;
+            return 0;
+        }
+        DDFS_LOG(LOG_ERR, "reclaim cannot open: %s (%s)\n", fpath, strerror(errno));
+        return 1;
+    }
+
+    // be careful, file_header_set_conv return c_file_header_size for empty file
+    uint64_t file_size;
+    len=file_header_set_conv(fd, &file_size);
+    if (len==-1)
+    {
+        DDFS_LOG(LOG_ERR, "reclaim cannot read header: %s (%s)\n", fpath, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    else if (len!=ddfs->c_file_header_size)
+    {
+        DDFS_LOG(LOG_ERR, "reclaim invalid ddumbfs header, skip file: %s\n", fpath);
+        close(fd);
+        return 0;
+    }
+
+    long long int node_pos=0;
+    while ((len=ddfs_read_nodes(fd, node_pos, rw->nodes, DDFS_WALK_NODES))>0)
+    {
+        count=len/ddfs->c_node_size;
+        for (i=0, node=rw->nodes; i<count; i++, node+=ddfs->c_node_size)
+        {
+            addr=ddfs_get_node_addr(node);
+
+            if (prev_addr!=-1 && prev_addr+1!=addr && addr!=0) rw->frag_count++;
+            if (addr!=0) prev_addr=addr;
+
+            if (addr>ddfs->c_block_count)
+            {
+                DDFS_LOG(LOG_WARNING, "reclaim invalid block address %lld: %s\n", addr, fpath);
+            }
+            else if (addr!=0)
+            {
+                rw->addr_count++;
+
+                // search the index, if the same hash can be found for another block
+                // this will avoid to maybe loose useful information for next fsck
+                blockaddr baddr=addr;
+
+                // Only search the index if we have it locked in memory
+                if(ddfs->lock_index) {
+                    pthread_mutex_lock_d(&ifile_mutex);
+                    nodeidx node_idx=ddfs_search_hash(node+ddfs->c_addr_size, &baddr);
+                    if (node_idx<-1) rw->not_found++; // >=0 means found, -1 means == zeroes block
+                    pthread_mutex_unlock_d(&ifile_mutex);
+                }
+
+                if (refcount_rebuild && addr<ddfs->c_block_count) __sync_add_and_fetch(&refcount[addr], 1);
+
+                bit_array_set(&rw->found, addr);
+                // if another block was found, keep it too. I don't want to loose information
+                // that could be verified and maybe useful for fsck.
+                if (baddr!=addr) bit_array_set(&rw->found, baddr); // FYI block 0 can be set here when node_idx==-1
+                if (rw->summary && (reclaim_summary_add(rw, addr) || (baddr!=addr && reclaim_summary_add(rw, baddr)))) rw->summary=0;
+            }
         }
-        offset+=len;
-        len=fread(node, 1, ddfs->c_node_size, file);
+        node_pos+=count;
+        if (count<DDFS_WALK_NODES) break; // end of file
     }
 
     if (len==-1)
     {
         DDFS_LOG(LOG_ERR, "reclaim cannot read: %s (%s)\n", fpath, strerror(errno));
-        fclose(file);
+        close(fd);
         return 1;
     }
 
-    if (len && len!=ddfs->c_node_size)
+    if (len%ddfs->c_node_size)
     {   // maybe the file has been truncated during the read
         // get the new file size and compare with faulty offset
+        long long int offset=ddfs->c_file_header_size+node_pos*ddfs->c_node_size;
         struct stat st;
-        if (fstat(fileno(file), &st)==0) file_size=st.st_size;
+        if (fstat(fd, &st)==0) file_size=st.st_size;
         if (offset!=file_size)
         {
-            DDFS_LOG(LOG_WARNING, "reclaim short read node (%d/%d): %s:%lld/%lld\n", len, ddfs->c_node_size, fpath, offset, (long long int)sb->st_size);
+            DDFS_LOG(LOG_WARNING, "reclaim short read node (%d/%d): %s:%lld/%lld\n", len%ddfs->c_node_size, ddfs->c_node_size, fpath, offset, (long long int)sb->st_size);
         }
         // the opposite situation is not a problem because new blocks
         // are registered into ba_found_in_files when reclaim is running.
     }
-    fclose(file);
+    close(fd);
+
+    // a file changed in the last seconds could be modified again without
+    // any visible change of its times, don't summarize it
+    if (rw->summary && sb->st_ctime<reclaim_summary_start-1 && sb->st_mtime<reclaim_summary_start-1)
+    {
+        struct reclaim_summary *sum=malloc(sizeof(struct reclaim_summary)+rw->run_count*sizeof(struct reclaim_run));
+        if (sum==NULL) rw->summary=0;
+        else
+        {
+            sum->loaded=0;
+            sum->rec.ino=sb->st_ino;
+            sum->rec.mtime=sb->st_mtim.tv_sec;
+            sum->rec.mtime_nsec=sb->st_mtim.tv_nsec;
+            sum->rec.ctime=sb->st_ctim.tv_sec;
+            sum->rec.ctime_nsec=sb->st_ctim.tv_nsec;
+            sum->rec.addr_count=rw->addr_count-addr_count;
+            sum->rec.frag_count=rw->frag_count-frag_count;
+            sum->rec.not_found=rw->not_found-not_found;
+            sum->rec.run_count=rw->run_count;
+            memcpy(sum->runs, rw->runs, rw->run_count*sizeof(struct reclaim_run));
+            if (reclaim_summary_keep(rw, sum))
+            {
+                free(sum);
+                rw->summary=0;
+            }
+        }
+    }
     return 0;
 }
 
+/**
+ * read all the files in parallel to find the blocks in use and
+ * add them to ba_found_in_files
+ *
+ * @return 0 if all files have been read
+ */
+int reclaim_walk_tree()
+{
+    int i, res=0;
+    long long int j;
+    int summary=ddumb_param.reclaim_summary && !refcount_rebuild; // the counters need all the references
+    int threads=ddfs_walk_threads((ddfs->c_block_count+7)/8+DDFS_WALK_NODES*ddfs->c_node_size);
+    struct reclaim_walk *rw=calloc(threads, sizeof(struct reclaim_walk));
+    if (rw==NULL) res=-1;
+    for (i=0; res==0 && i<threads; i++)
+    {
+        rw[i].summary=summary;
+        rw[i].nodes=malloc(DDFS_WALK_NODES*ddfs->c_node_size);
+        if (rw[i].nodes==NULL || bit_array_init(&rw[i].found, ddfs->c_block_count, 0)) res=-1;
+    }
+
+    if (res==0)
+    {
+        if (summary)
+        {
+            reclaim_summary_start=time(NULL);
+            reclaim_summary_load();
+        }
+        res=ddfs_walk_tree(ddfs->rdir, threads, tree_explore, rw);
+    }
+    else DDFS_LOG(LOG_ERR, "reclaim cannot allocate memory for %d threads\n", threads);
+
+    if (res==0 && summary)
+    {   // save only a complete list
+        for (i=0; i<threads && rw[i].summary; i++) ;
+        if (i==threads) reclaim_summary_save(rw, threads);
+        else DDFS_LOG(LOG_WARNING, "reclaim cannot allocate memory for the file summaries\n");
+    }
+
+    r_file_count=r_addr_count=r_frag_count=r_not_found=r_file_reused=0;
+    for (i=0; rw && i<threads; i++)
+    {
+        for (j=0; j<rw[i].keep_count; j++) if (!rw[i].keep[j]->loaded) free(rw[i].keep[j]);
+        free(rw[i].keep);
+        free(rw[i].runs);
+        r_file_reused+=rw[i].file_reused;
+        if (res==0)
+        {
+            pthread_spin_lock(&reclaim_spinlock);
+            bit_array_bwor(&rw[i].found, &ba_found_in_files);
+            pthread_spin_unlock(&reclaim_spinlock);
+        }
+        r_file_count+=rw[i].file_count;
+        r_addr_count+=rw[i].addr_count;
+        r_frag_count+=rw[i].frag_count;
+        r_not_found+=rw[i].not_found;
+        bit_array_release(&rw[i].found);
+        free(rw[i].nodes);
+    }
+    free(rw);
+    reclaim_summary_free();
+    return res;
+}
+
 int ddumbfs_save_usedblocks(int limit)
 {   // if required, save used block list
     int res=0;
 
 //    DDFS_LOG_DEBUG("save used block %lld-%lld>%d\n", ddfs->usedblock, used_block_saved, limit);
-    if (llabs(ddfs->usedblock-used_block_saved)>=limit)
+    if (llabs(ddfs->usedblock-used_block_saved)>=limit && ddfs->ba_usedblocks.dirty)
+    {   // copy the modified pages, ddumbfs_background will write them
+        if (ddfs_save_usedblocks_prepare()==0)
+        {
+            journal_checkpoint();
+            used_block_saved=ddfs->usedblock;
+            pthread_cond_signal(&ddumb_background_cond);
+        }
+    }
+    else if (llabs(ddfs->usedblock-used_block_saved)>=limit)
     {
 	time_t start_time=time(NULL);
+        journal_checkpoint();
         res=ddfs_save_usedblocks();
         if (res==0)
         {
@@ -1221,6 +2299,81 @@ int ddumbfs_save_usedblocks(int limit)
     return res;
 }
 
+/**
+ * write the used block list prepared by ddumbfs_save_usedblocks(),
+ * don't need the ifile_mutex
+ *
+ * @return 0 for success, 1 if there was nothing to write, -errno for error
+ */
+int ddumbfs_save_usedblocks_finish()
+{
+    time_t start_time=time(NULL);
+    int res=ddfs_save_usedblocks_finish();
+    if (res==0)
+    {
+        DDFS_LOG(LOG_INFO, "save used block list in %d seconds: %lld blocks in use\n", (int)(time(NULL)-start_time), used_block_saved);
+    }
+    return res;
+}
+
+/**
+ * delete the nodes of the blocks that are not in ba_found_in_files for
+ * about RECLAIM_SWEEP_SIZE bytes of index. The surviving nodes are moved
+ * up in a single pass, like node_delete() would do for each deleted node.
+ * The sweep continues after the end of the chunk until no node is waiting
+ * to be moved up, to leave a consistent index when ifile_mutex is released.
+ * Must be called with ifile_mutex locked.
+ *
+ * @param node_idx the first node to sweep
+ * @return the next node to sweep
+ */
+nodeidx reclaim_sweep(nodeidx node_idx, long long int *node_count, long long int *node_deleted, long long int *refcount_leaked)
+{
+    nodeidx end=node_idx+RECLAIM_SWEEP_SIZE/ddfs->c_node_size;
+    nodeidx dst=node_idx;   // the first place where a node can be moved up
+    nodeidx idx;
+
+    pthread_spin_lock(&reclaim_spinlock);
+    for (idx=node_idx; idx<ddfs->c_node_count && (idx<end || dst<idx); idx++)
+    {
+        unsigned char *node=ddfs->nodes+(idx*ddfs->c_node_size);
+        blockaddr addr=ddfs_get_node_addr(node);
+        if (addr==0)
+        {   // end of the cluster, nothing more to move up
+            dst=idx+1;
+            continue;
+        }
+
+        if (!bit_array_get(&ba_found_in_files, addr))
+        {
+            block_release(addr, node+ddfs->c_addr_size);
+            memset(node, '\0', ddfs->c_node_size);
+            if (refcount && refcount[addr])
+            {   // the block is not used anymore, its counter was wrong
+                refcount[addr]=0;
+                (*refcount_leaked)++;
+            }
+            (*node_deleted)++;
+            continue;
+        }
+
+        (*node_count)++;
+        // a node never goes above its ideal place, and a node after its
+        // ideal place stays where it is, like in node_delete()
+        nodeidx cidx=ddfs_hash2idx(node+ddfs->c_addr_size);
+        if (cidx<dst) cidx=dst;
+        if (cidx<idx)
+        {
+            memcpy(ddfs->nodes+(cidx*ddfs->c_node_size), node, ddfs->c_node_size);
+            memset(node, '\0', ddfs->c_node_size);
+            dst=cidx+1;
+        }
+        else dst=idx+1;
+    }
+    pthread_spin_unlock(&reclaim_spinlock);
+    return idx;
+}
+
 void reclaim(FILE *output)
 {   // the reclaim() process
     int res;
@@ -1253,12 +2406,11 @@ void reclaim(FILE *output)
     pthread_mutex_unlock_d(&reclaim_mutex);
 
     // Collect blocks from file (but also from index, when index has a different blockidx for the same hash)
-    r_file_count=r_addr_count=r_frag_count=r_not_found=0;
     long long int start=now();
-    res=nftw(ddfs->rdir, tree_explore, 10, FTW_MOUNT | FTW_PHYS);
+    res=reclaim_walk_tree();
     long long int end=now();
 
-    if (res==-1)
+    if (res)
     {
         DDFS_LOG(LOG_ERR, "reclaim error, cannot run, correct and check filesystem\n");
         L_SYS(LOG_ERR, "reclaim error, cannot run, correct and check filesystem\n");
@@ -1269,6 +2421,7 @@ void reclaim(FILE *output)
         long long int block_allocated, block_not_allocated;
         long long int block_in_use, block_not_in_use;
         DDFS_LOG(LOG_INFO, "reclaim read used blocks from %lld files in %.1fs\n", r_file_count, (end-start)*1.0/NOW_PER_SEC);
+        if (ddumb_param.reclaim_summary) DDFS_LOG(LOG_INFO, "reclaim used the summary of %lld unchanged files\n", r_file_reused);
         if (output) fprintf(output, "== Read used blocks from files in %.1fs\n", (end-start)*1.0/NOW_PER_SEC);
 
         int cmp, cmp_res;
@@ -1302,6 +2455,7 @@ void reclaim(FILE *output)
             if (output) fprintf(output, "%-30s %9lld\n", "block_not_in_use", block_not_in_use);
             if (output) fprintf(output, "%-30s %9lld\n", "hash_not_found", r_not_found);
             if (output) fprintf(output, "%-30s %9lld\n", "files", r_file_count);
+            if (output && ddumb_param.reclaim_summary) fprintf(output, "%-30s %9lld\n", "files_unchanged", r_file_reused);
             if (output) fprintf(output, "%-30s %9lld\n", "block_references", r_addr_count);
             if (output) fprintf(output, "%-30s %8.1f%%\n", "fragmentation", r_frag_count*100.0/r_addr_count_nz);
 
@@ -1309,9 +2463,10 @@ void reclaim(FILE *output)
 
             long long int node_count=0;
             long long int node_deleted=0;
+            long long int refcount_leaked=0;
             long long int node_idx=0;
             long long int node_preload_idx=0;
-            // read all nodes, delete unused blocks
+            // read all nodes, delete unused blocks, a chunk at a time
             while (node_idx<ddfs->c_node_count)
             {
                 if (!ddfs->lock_index)
@@ -1322,31 +2477,11 @@ void reclaim(FILE *output)
 		    }
                 }
                 pthread_mutex_lock_d(&ifile_mutex);
-                long long int addr=ddfs_get_node_addr(ddfs->nodes+(node_idx*ddfs->c_node_size));
-                if (addr==0)
-                {
-                    node_idx++;
-                }
-                else
-                {
-                    pthread_spin_lock(&reclaim_spinlock);
-                    int found=bit_array_get(&ba_found_in_files, addr);
-                    pthread_spin_unlock(&reclaim_spinlock);
-                    if (found)
-                    {
-                        node_count++;
-                        node_idx++;
-                    }
-                    else
-                    {
-                        node_delete(node_idx);
-                        bit_array_unset(&ddfs->ba_usedblocks, addr);
-                        node_deleted++;
-                    }
-                }
-                // don't increment node_idx, because nodes have moved up and current node is a new node
+                node_idx=reclaim_sweep(node_idx, &node_count, &node_deleted, &refcount_leaked);
                 pthread_mutex_unlock_d(&ifile_mutex);
+                sched_yield(); // let the writers get ifile_mutex between two chunks
             }
+            if (journal_fd!=-1) journal_commit(); // really free the blocks now
             end=now();
             success=1;
             ddumb_statistic.reclaim++;
@@ -1355,6 +2490,11 @@ void reclaim(FILE *output)
             DDFS_LOG(LOG_INFO, "reclaim     node_in_index=%9lld         node_deleted=%9lld\n", node_count, node_deleted);
             if (output) fprintf(output, "%-30s %9lld\n", "nodes_in_index", node_count);
             if (output) fprintf(output, "%-30s %9lld\n", "node_deleted", node_deleted);
+            if (refcount)
+            {
+                DDFS_LOG(LOG_INFO, "reclaim  refcount_leaked=%9lld\n", refcount_leaked);
+                if (output) fprintf(output, "%-30s %9lld\n", "refcount_leaked", refcount_leaked);
+            }
         }
     }
     pthread_spin_lock(&reclaim_spinlock);
@@ -1389,34 +2529,361 @@ void reclaim(FILE *output)
 
 }
 
-static int ddumb_simple_block_read(struct ddumb_fh *fh, char *buf, long long int offset, long long int size)
+/*
+ * refcount_*() maintain an optional reference counter for each block.
+ * The counter is incremented by ddfs_write_block2() when the address is
+ * returned, with ifile_mutex locked, and decremented when a file forget
+ * the address because it is overwritten, truncated or removed.
+ * When a counter reach zero, ddumbfs_refcount() free the block within a
+ * few seconds without walking the tree. The counters are saved in
+ * REFCOUNT_FILENAME at umount and rebuilt by a walk of the tree at mount
+ * when they cannot be trusted. reclaim() stay the reference and reset the
+ * counters of the blocks it frees.
+ */
+static inline void refcount_inc(blockaddr addr)
 {
-    unsigned char baddr[ADDR_SIZE];
-    long long int gap=(offset & ddfs->block_gap_mask);
+    if (refcount && addr>DDFS_LAST_RESERVED_BLOCK && addr<ddfs->c_block_count) __sync_add_and_fetch(refcount+addr, 1);
+}
 
-    DDFS_LOG_DEBUG("[%lu]++  ddumb_simple_block_read fd=%d fh=%p offset=0x%llx(%lld) size=0x%llx(%lld) gap=%lld %s\n", thread_id(), fh->fd, (void*)fh, offset, offset, size, size, gap, fh->filename);
+static inline void refcount_dec(blockaddr addr)
+{
+    if (refcount==NULL || addr<=DDFS_LAST_RESERVED_BLOCK || addr>=ddfs->c_block_count) return;
+
+    uint32_t c;
+    do
+    {
+        c=refcount[addr];
+        if (c==0)
+        {
+            ddumb_statistic.refcount_underflow++;
+            return;
+        }
+    } while (!__sync_bool_compare_and_swap(refcount+addr, c, c-1));
+    if (c==1) __sync_add_and_fetch(&refcount_zero, 1);
+}
+
+/**
+ * decrement the counters of the blocks referenced by a file
+ *
+ * @param fd the file
+ * @param from_node the first node to forget
+ * @param to_node stop before this node, -1 for the end of the file
+ * @return 0 for success or <0 for error
+ */
+static int refcount_dec_file(int fd, long long int from_node, long long int to_node)
+{
+    unsigned char nodes[256*NODE_SIZE];
+    int n=256;
+    uint64_t file_size;
+
+    // don't touch files that are not ddumbfs files
+    if (file_header_set_conv(fd, &file_size)!=ddfs->c_file_header_size) return 0;
+
+    long long int node_idx=from_node;
+    while (to_node==-1 || node_idx<to_node)
+    {
+        if (to_node!=-1 && to_node-node_idx<n) n=to_node-node_idx;
+        int len=pread(fd, nodes, n*ddfs->c_node_size, node_idx*ddfs->c_node_size+ddfs->c_file_header_size);
+        if (len==-1)
+        {
+            DDFS_LOG(LOG_ERR, "refcount_dec_file cannot read nodes (%s)\n", strerror(errno));
+            return -errno;
+        }
+        int i;
+        for (i=0; i<len/ddfs->c_node_size; i++) refcount_dec(ddfs_get_node_addr(nodes+i*ddfs->c_node_size));
+        node_idx+=len/ddfs->c_node_size;
+        if (len<n*ddfs->c_node_size) break; // end of file
+    }
+    return 0;
+}
+
+/**
+ * unlink a file or rename a file over another one and release the blocks
+ * of the file that disappear
+ *
+ * The blocks are released only if this was the last link. If the file is
+ * open, they are released by the last xstat_release(). Once the link count
+ * is zero, _xstat_register() refuses to register the file again, then the
+ * blocks can be released without xstat_root.mutex.
+ *
+ * @param from the file to unlink or rename
+ * @param to the new name or NULL to unlink
+ * @return 0 for success or -errno
+ */
+static int refcount_remove(const char *from, const char *to)
+{
+    const char *victim=to?to:from;
+    struct stat st;
+    int fd=-1;
+    int res;
+
+    if (lstat(victim, &st)==0 && S_ISREG(st.st_mode)) fd=open(victim, O_RDONLY);
+
+    if (to) res=rename(from, to);
+    else res=unlink(from);
+    if (res==-1) res=-errno;
+
+    if (res==0 && fd!=-1 && fstat(fd, &st)==0 && st.st_nlink==0)
+    {
+        struct xstat key;
+        key.ino=st.st_ino;
+        pthread_mutex_lock_d(&xstat_root.mutex);
+        void *val=tfind(&key, &xstat_root.root, xstat_compare);
+        if (val) (*(struct xstat **)val)->refcount_unlinked=1;
+        pthread_mutex_unlock_d(&xstat_root.mutex);
+        if (val==NULL) refcount_dec_file(fd, 0, -1);
+    }
+    if (fd!=-1) close(fd);
+    return res;
+}
+
+/**
+ * free the blocks whose counter is zero
+ *
+ * the hash is needed to find the node, then the block is read and hashed
+ */
+static void refcount_release_blocks(char *block)
+{
+    unsigned char hash[HASH_SIZE];
+    long long int released=0;
+    blockaddr addr;
+
+    __sync_lock_test_and_set(&refcount_zero, 0);
+    for (addr=DDFS_LAST_RESERVED_BLOCK+1; addr<ddfs->c_block_count && !ddumbfs_terminate; addr++)
+    {
+        if (refcount[addr]) continue;
+
+        pthread_mutex_lock_d(&ifile_mutex);
+        int used=bit_array_get(&ddfs->ba_usedblocks, addr);
+        pthread_mutex_unlock_d(&ifile_mutex);
+        if (!used) continue;
+
+        if (ddfs_read_block(addr, block, ddfs->c_block_size, 0)!=ddfs->c_block_size)
+        {
+            DDFS_LOG(LOG_ERR, "refcount cannot read block %lld (%s)\n", addr, strerror(errno));
+            continue;
+        }
+        ddfs_hash(block, hash);
+
+        pthread_mutex_lock_d(&ifile_mutex);
+        pthread_spin_lock(&reclaim_spinlock);
+        int reclaiming=reclaim_enable;
+        pthread_spin_unlock(&reclaim_spinlock);
+        if (reclaiming)
+        {   // reclaim() could have found the block in a file, let it finish and retry later
+            pthread_mutex_unlock_d(&ifile_mutex);
+            __sync_add_and_fetch(&refcount_zero, 1);
+            break;
+        }
+        // ddfs_write_block2() could have reused the block while unlocked
+        if (refcount[addr]==0 && bit_array_get(&ddfs->ba_usedblocks, addr))
+        {
+            blockaddr baddr;
+            nodeidx node_idx=ddfs_search_hash(hash, &baddr);
+            while (node_idx>=0 && node_idx<ddfs->c_node_count && baddr!=addr)
+            {   // search for the node with the same hash and the right address
+                node_idx++;
+                unsigned char *node=ddfs->nodes+(node_idx*ddfs->c_node_size);
+                if (node_idx>=ddfs->c_node_count || 0!=memcmp(node+ddfs->c_addr_size, hash, ddfs->c_hash_size)) node_idx=-1;
+                else baddr=ddfs_get_node_addr(node);
+            }
+            if (node_idx>=0)
+            {
+                node_delete(node_idx);
+                block_release(addr, hash);
+                ddfs->usedblock--;
+                ddumb_statistic.refcount_release++;
+                released++;
+            }
+            else
+            {   // this is a job for reclaim()
+                ddumb_statistic.refcount_not_found++;
+            }
+        }
+        pthread_mutex_unlock_d(&ifile_mutex);
+    }
+    if (released)
+    {
+        DDFS_LOG(LOG_INFO, "refcount released %lld blocks\n", released);
+        pthread_mutex_lock_d(&ifile_mutex);
+        if (ddfs->c_reuse_asap) ddfs->ba_usedblocks.index=DDFS_LAST_RESERVED_BLOCK+1;
+        pthread_mutex_unlock_d(&ifile_mutex);
+    }
+}
+
+void *ddumbfs_refcount(void *ptr)
+{
+    struct timeval now;
+    struct timespec timeout;
+    char *block=NULL;
+
+    int res=posix_memalign((void *)&block, BLOCK_ALIGMENT, ddfs->c_block_size);
+    if (res)
+    {
+        DDFS_LOG(LOG_ERR, "ddumbfs_refcount: cannot allocate aligned buffer (%s)\n", strerror(res));
+        pthread_exit(NULL);
+    }
+
+    pthread_mutex_lock_d(&refcount_mutex);
+    while (!ddumbfs_terminate)
+    {
+        gettimeofday(&now, NULL);
+        timeout.tv_sec=now.tv_sec+REFCOUNT_RELEASE_DELAY;
+        timeout.tv_nsec=now.tv_usec*1000;
+        pthread_cond_timedwait(&refcount_cond, &refcount_mutex, &timeout);
+        if (refcount_zero==0 || ddumbfs_terminate) continue;
+
+        pthread_mutex_unlock_d(&refcount_mutex);
+        refcount_release_blocks(block);
+        pthread_mutex_lock_d(&refcount_mutex);
+    }
+    pthread_mutex_unlock_d(&refcount_mutex);
+    free(block);
+    pthread_exit(NULL);
+}
+
+/**
+ * open and map the counters, rebuild them if they cannot be trusted
+ *
+ * must be called before the filesystem is available, when ddfs->rdir is
+ * the current directory
+ *
+ * @return 0 for success
+ */
+static int refcount_open()
+{
+    char filename[FILENAME_MAX];
+    struct stat st;
+
+    snprintf(filename, sizeof(filename), "%s/%s", ddfs->pdir, REFCOUNT_FILENAME);
+    refcount_map_size=REFCOUNT_HEADER_SIZE+ddfs->c_block_count*sizeof(uint32_t);
+    refcount_fd=open(filename, O_RDWR|O_CREAT, 0600);
+    if (refcount_fd==-1)
+    {
+        DDFS_LOG(LOG_ERR, "cannot open %s (%s)\n", filename, strerror(errno));
+        return 1;
+    }
+    if (fstat(refcount_fd, &st)==-1 || (st.st_size!=refcount_map_size && ftruncate(refcount_fd, refcount_map_size)==-1))
+    {
+        DDFS_LOG(LOG_ERR, "cannot resize %s (%s)\n", filename, strerror(errno));
+        close(refcount_fd);
+        return 1;
+    }
+    refcount_map=mmap(NULL, refcount_map_size, PROT_READ|PROT_WRITE, MAP_SHARED, refcount_fd, 0);
+    if (refcount_map==MAP_FAILED)
+    {
+        DDFS_LOG(LOG_ERR, "cannot map %s (%s)\n", filename, strerror(errno));
+        close(refcount_fd);
+        return 1;
+    }
+
+    struct refcount_header *header=refcount_map;
+    int valid=st.st_size==refcount_map_size
+              && 0==memcmp(header->magic, DDFS_MAGIC_REFCOUNT, DDFS_MAGIC_FILE_LEN)
+              && header->block_count==ddfs->c_block_count
+              && header->clean
+              && !ddfs->auto_fsck && !ddfs->auto_fsck_clean
+              && fstat(ddfs->ifile, &st)==0 && header->ifile_mtime==st.st_mtime;
+
+    // from now, the counters are not in sync with the disk
+    memcpy(header->magic, DDFS_MAGIC_REFCOUNT, DDFS_MAGIC_FILE_LEN);
+    header->block_count=ddfs->c_block_count;
+    header->clean=0;
+    msync(refcount_map, REFCOUNT_HEADER_SIZE, MS_SYNC);
+
+    refcount=(uint32_t *)((char *)refcount_map+REFCOUNT_HEADER_SIZE);
+    if (!valid)
+    {
+        fprintf(stderr, "rebuild block reference counters, this can take a while\n");
+        DDFS_LOG(LOG_INFO, "rebuild block reference counters\n");
+        memset((void *)refcount, 0, ddfs->c_block_count*sizeof(uint32_t));
+        refcount_rebuild=1;
+        long long int start=now();
+        int res=reclaim_walk_tree();
+        refcount_rebuild=0;
+        tdestroy(refcount_links, free);
+        refcount_links=NULL;
+        if (res)
+        {
+            DDFS_LOG(LOG_ERR, "cannot rebuild block reference counters\n");
+            munmap(refcount_map, refcount_map_size);
+            close(refcount_fd);
+            refcount=NULL;
+            return 1;
+        }
+        DDFS_LOG(LOG_INFO, "block reference counters rebuilt from %lld files in %.1fs\n", r_file_count, (now()-start)*1.0/NOW_PER_SEC);
+        refcount_zero=1; // release unused blocks ASAP
+    }
+    return 0;
+}
+
+/**
+ * save the counters, must be called after ddfs_close()
+ */
+static void refcount_close()
+{
+    struct stat st;
+    struct refcount_header *header=refcount_map;
+
+    if (refcount==NULL) return;
+    refcount=NULL;
+    msync(refcount_map, refcount_map_size, MS_SYNC);
+    if (stat(ddfs->indexfile, &st)==0)
+    {
+        header->ifile_mtime=st.st_mtime;
+        header->clean=1;
+        msync(refcount_map, REFCOUNT_HEADER_SIZE, MS_SYNC);
+    }
+    munmap(refcount_map, refcount_map_size);
+    close(refcount_fd);
+}
+
+/**
+ * read the address of a block of a file
+ *
+ * @param fh the file
+ * @param offset an offset inside the block
+ * @param addr where to store the address
+ * @return 0 for success, -errno for error
+ */
+static int ddumb_block_addr(struct ddumb_fh *fh, long long int offset, long long int *addr)
+{
+    unsigned char baddr[ADDR_SIZE];
 
-    // read the address of the block in the block file
     long long int idx_off=(offset>>ddfs->block_size_shift)*ddfs->c_node_size+ddfs->c_file_header_size;
 
     int len=pread(fh->fd, baddr, ddfs->c_addr_size, idx_off);
     if (len==-1)
     {
-        DDFS_LOG(LOG_ERR, "ddumb_simple_block_read pread %s (%s)\n", fh->filename, strerror(errno));
+        DDFS_LOG(LOG_ERR, "ddumb_block_addr pread %s (%s)\n", fh->filename, strerror(errno));
         return -errno;
     }
     else if (len==0)
     {
-        DDFS_LOG(LOG_ERR, "ddumb_simple_block_read read 0 bytes, maybe end of file. file_size=%lld rdonly=%d op=%c(%lld-%lld) %s:%lld\n", (long long int)fh->xstat->h.size, fh->rdonly, fh->zone.op, fh->zone.start, fh->zone.end, fh->filename, offset);
+        DDFS_LOG(LOG_ERR, "ddumb_block_addr read 0 bytes, maybe end of file. file_size=%lld rdonly=%d %s:%lld\n", (long long int)fh->xstat->h.size, fh->rdonly, fh->filename, offset);
         return -EIO;
     }
     else if (len!=ddfs->c_addr_size)
     {
-        DDFS_LOG(LOG_ERR, "ddumb_simple_block_read short read %d/%d %s:%lld\n", len, ddfs->c_addr_size, fh->filename, offset);
+        DDFS_LOG(LOG_ERR, "ddumb_block_addr short read %d/%d %s:%lld\n", len, ddfs->c_addr_size, fh->filename, offset);
         return -EIO;
     }
 
-    long long int block_addr=ddfs_get_node_addr(baddr);
+    *addr=ddfs_get_node_addr(baddr);
+    return 0;
+}
+
+static int ddumb_simple_block_read(struct ddumb_fh *fh, char *buf, long long int offset, long long int size)
+{
+    long long int gap=(offset & ddfs->block_gap_mask);
+    long long int block_addr;
+    int len;
+
+    DDFS_LOG_DEBUG("[%lu]++  ddumb_simple_block_read fd=%d fh=%p offset=0x%llx(%lld) size=0x%llx(%lld) gap=%lld %s\n", thread_id(), fh->fd, (void*)fh, offset, offset, size, size, gap, fh->filename);
+
+    // read the address of the block in the block file
+    int res=ddumb_block_addr(fh, offset, &block_addr);
+    if (res) return res;
 
     if (block_addr==0)
     {   // addr==0 means block '\0......\0',  ddfs_read_block() is optimized for such block
@@ -1428,7 +2895,9 @@ static int ddumb_simple_block_read(struct ddumb_fh *fh, char *buf, long long int
     // just to avoid a very improbable race condition with ddfs_write_block2()
     block_wait(block_addr); // if this block is being written, wait for the end of the write
 
+    long long int start=nanonow();
     len=ddfs_read_block(block_addr, buf, size, gap);
+    if (block_addr!=0) hist_add(hist_bfile_read, start);
 
     if (len==-1)
     {
@@ -1458,22 +2927,16 @@ static int ddumb_block_read(struct ddumb_fh *fh, char *buf, long long int offset
 
     DDFS_LOG_DEBUG("[%lu]++  ddumb_block_read fd=%d offset=0x%llx(%lld) size=0x%llx(%lld) gap=%lld fhs_n=%d %s\n", thread_id(), fh->fd, offset, offset, size, size, gap, xstat->fhs_n, fh->filename);
 
-    // search if the required block is already somewhere in one open fh
-    int i, found;
+    // search if the required block is already loaded in one open fh
     pthread_mutex_lock_d(&xstat->xstat_lock);
-    for(i=0, found=0; !found && i<xstat->fhs_n; i++)
+    struct ddumb_fh *xfh=xstat_buf_find(xstat, block_boundary);
+    if (xfh)
     {
-        struct ddumb_fh *xfh=xstat->fhs[i];
-//        DDFS_LOG_DEBUG("[%lu]>>>>ddumb_block_read fh=%p xfh=%p buf_loaded=%d buf_off=0x%llx(%lld) I=%d \n", thread_id(), (void*)fh, (void*)xfh, xfh->buf_loaded, xfh->buf_off, xfh->buf_off, i);
-        if (xfh->buf_loaded && xfh->buf_off==block_boundary)
-        {
-            found=1;
-            memcpy(buf, xfh->buf+gap, size);
-            DDFS_LOG_DEBUG("[%lu]--  ddumb_block_read fd=%d fh=%p FOUND in buffer xstat=%p xfd=%d xfh=%p I=%d %s\n", thread_id(), fh->fd, (void*)fh, (void*)fh->xstat, xfh->fd, (void*)xfh, i, fh->filename);
-        }
+        memcpy(buf, xfh->buf+gap, size);
+        DDFS_LOG_DEBUG("[%lu]--  ddumb_block_read fd=%d fh=%p FOUND in buffer xstat=%p xfd=%d xfh=%p %s\n", thread_id(), fh->fd, (void*)fh, (void*)fh->xstat, xfh->fd, (void*)xfh, fh->filename);
     }
     pthread_mutex_unlock_d(&xstat->xstat_lock);
-    if (found) return 0;
+    if (xfh) return 0;
 
     return ddumb_simple_block_read(fh, buf, offset, size);
 }
@@ -1492,7 +2955,16 @@ long long int ddfs_write_block2(const char *block, unsigned char *bhash, struct
     long long int addr;
     long long int node_idx;
 
+    if (ddfs_is_zero_block(block))
+    {   // don't waste time to hash it
+        memcpy(bhash, ddfs->zero_block_hash, ddfs->c_hash_size);
+        ddumb_statistic.block_write_zero++;
+        return 0;
+    }
+
+    long long int start=nanonow();
     ddfs_hash(block, bhash);
+    hist_add(hist_hash, start);
     ddumb_statistic.hash++;
 
     if (memcmp(bhash, ddfs->zero_block_hash, ddfs->c_hash_size)==0) return 0;
@@ -1506,7 +2978,9 @@ long long int ddfs_write_block2(const char *block, unsigned char *bhash, struct
 
     pthread_mutex_lock_d(&ifile_mutex);
 
+    start=nanonow();
     int res=ddfs_locate_hash(bhash, &addr, &node_idx);
+    hist_add(hist_locate_hash, start);
 
     if (res<0)
     {
@@ -1516,6 +2990,7 @@ long long int ddfs_write_block2(const char *block, unsigned char *bhash, struct
 
     if (res==0)
     {   // the block is already stored, return its current address
+        refcount_inc(addr);
         pthread_mutex_unlock_d(&ifile_mutex);
         ddumb_statistic.ghost_write++;
         return addr;
@@ -1570,8 +3045,10 @@ long long int ddfs_write_block2(const char *block, unsigned char *bhash, struct
 
     // now node_idx is ready to receive new node
     ddfs_set_node(node_idx, baddr, bhash);
+    refcount_inc(baddr);
 
-    block_lock(baddr);  // avoid this block to be read when being written
+    struct block_locked bl;
+    block_lock(&bl, baddr);  // avoid this block to be read when being written
 
     pthread_mutex_unlock_d(&ifile_mutex);
 
@@ -1583,19 +3060,77 @@ long long int ddfs_write_block2(const char *block, unsigned char *bhash, struct
     // process 2 read the file of process 1, get the address and read the block before ...
     // process 0 has written the block
 
+    start=nanonow();
     baddr=ddfs_store_block(block, baddr);
+    hist_add(hist_bfile_write, start);
+    if (baddr<0) refcount_dec(bl.baddr); // the caller will not use the block
+    else if (journal_fd!=-1) journal_append(DDFS_JOURNAL_ALLOC, baddr, bhash);
 
-    block_unlock(baddr);
+    block_unlock(&bl);
 
     return baddr;
 }
 
 
-static int ddumb_buf_write(struct ddumb_fh *fh)
+/**
+ * write the node of a block in the file
+ *
+ * @param fh the file
+ * @param block_off the offset of the block in the file
+ * @param addr the address of the block, its reference is released on error
+ * @param node the node with the hash already set
+ * @return 0 for success, -errno for error
+ */
+static int ddumb_node_write(struct ddumb_fh *fh, off_t block_off, long long int addr, unsigned char *node)
+{
+    int len;
+    int ret=0;
+
+    ddfs_convert_addr(addr, node);
+
+    off_t addr_off=(block_off>>ddfs->block_size_shift)*ddfs->c_node_size+ddfs->c_file_header_size;
+
+    long long int old_addr=0;
+    if (refcount)
+    {   // the file will forget the block currently at this offset
+        unsigned char old_node[ADDR_SIZE];
+        if (pread(fh->fd, old_node, ddfs->c_addr_size, addr_off)==ddfs->c_addr_size) old_addr=ddfs_get_node_addr(old_node);
+    }
+
+    len=pwrite(fh->fd, node, ddfs->c_node_size, addr_off);
+    if (len==ddfs->c_node_size) refcount_dec(old_addr);
+    else refcount_dec(addr); // the reference to the new block was not written
+
+    pthread_spin_lock(&reclaim_spinlock);
+    // This is 2nd place where ba_found_in_files is updated
+    if (reclaim_enable) bit_array_set(&ba_found_in_files, addr);
+    pthread_spin_unlock(&reclaim_spinlock);
+
+    if (len==-1)
+    {
+        DDFS_LOG(LOG_ERR, "ddumb_buf_write addr offset=%lld %s (%s)\n", (long long int)addr_off, fh->filename, strerror(errno));
+        ret=-errno;
+    }
+    else if (len!=ddfs->c_node_size)
+    {
+        DDFS_LOG(LOG_ERR, "ddumb_buf_write addr offset=%lld wrote only %d/%d %s\n", (long long int)addr_off, len, ddfs->c_node_size, fh->filename);
+        ret=-EIO;
+    }
+    return ret;
+}
+
+/**
+ * store a full block and write its node in the file
+ *
+ * @param fh the file
+ * @param block the data of the block
+ * @param block_off the offset of the block in the file
+ * @return 0 for success, -errno for error
+ */
+static int ddumb_block_write(struct ddumb_fh *fh, const char *block, off_t block_off)
 {
     unsigned char node[NODE_SIZE];
 
-    int len;
     int ret=0;
 
     // I cannot enter this function when reclaim() is _starting_ and reclaim()
@@ -1606,7 +3141,7 @@ static int ddumb_buf_write(struct ddumb_fh *fh)
 
     ddumb_statistic.block_write++;
 
-    long long int addr=ddfs_write_block2(fh->buf, node+ddfs->c_addr_size, fh);
+    long long int addr=ddfs_write_block2(block, node+ddfs->c_addr_size, fh);
     if (addr<0)
     {
         ret=addr;
@@ -1615,43 +3150,79 @@ static int ddumb_buf_write(struct ddumb_fh *fh)
     {
         // addr is already registered into ba_found_in_files by index_new_block
 
-        DDFS_LOG_DEBUG("[%lu]++  ddumb_buf_write fh=%p fd=%d offset=0x%llx(%lld) addr=%lld data=0x%llx %s\n", thread_id(), (void*)fh, fh->fd, (long long int)fh->buf_off, (long long int)fh->buf_off, addr, *(long long int*)fh->buf, fh->filename);
+        DDFS_LOG_DEBUG("[%lu]++  ddumb_buf_write fh=%p fd=%d offset=0x%llx(%lld) addr=%lld data=0x%llx %s\n", thread_id(), (void*)fh, fh->fd, (long long int)block_off, (long long int)block_off, addr, *(long long int*)block, fh->filename);
 
-        ddfs_convert_addr(addr, node);
+        ret=ddumb_node_write(fh, block_off, addr, node);
+    }
 
-        off_t addr_off=(fh->buf_off>>ddfs->block_size_shift)*ddfs->c_node_size+ddfs->c_file_header_size;
+    pthread_mutex_lock_d(&reclaim_mutex);
+    reclaim_ddumb_buf_write_is_in_use--;
+    if (reclaim_ddumb_buf_write_is_in_use==0) pthread_cond_signal(&reclaim_ddumb_buf_write_is_unused);
+    pthread_mutex_unlock_d(&reclaim_mutex);
 
-        len=pwrite(fh->fd, node, ddfs->c_node_size, addr_off);
+    return ret;
+}
 
-        pthread_spin_lock(&reclaim_spinlock);
-        // This is 2nd place where ba_found_in_files is updated
-        if (reclaim_enable) bit_array_set(&ba_found_in_files, addr);
-        pthread_spin_unlock(&reclaim_spinlock);
+/**
+ * write the node of a block already stored, knowing only its hash
+ *
+ * @param fh the file
+ * @param hash the hash of the block
+ * @param block_off the offset of the block in the file
+ * @return 1 if the node is written, 0 if the hash is unknown, -errno for error
+ */
+static int ddumb_hash_write(struct ddumb_fh *fh, const unsigned char *hash, off_t block_off)
+{
+    unsigned char node[NODE_SIZE];
+    long long int addr=0;
+    long long int node_idx;
+    int res=0;
 
-        if (len==-1)
-        {
-            DDFS_LOG(LOG_ERR, "ddumb_buf_write addr offset=%lld %s (%s)\n", (long long int)addr_off, fh->filename, strerror(errno));
-            ret=-errno;
-        }
-        else if (len!=ddfs->c_node_size)
-        {
-            DDFS_LOG(LOG_ERR, "ddumb_buf_write addr offset=%lld wrote only %d/%d %s\n", (long long int)addr_off, len, ddfs->c_node_size, fh->filename);
-            ret=-EIO;
-        }
+    // like ddumb_block_write(), reclaim() must not start in the middle
+    pthread_mutex_lock_d(&reclaim_mutex);
+    reclaim_ddumb_buf_write_is_in_use++;
+    pthread_mutex_unlock_d(&reclaim_mutex);
+
+    memcpy(node+ddfs->c_addr_size, hash, ddfs->c_hash_size);
+    if (memcmp(hash, ddfs->zero_block_hash, ddfs->c_hash_size)!=0)
+    {
+        if (!ddfs->lock_index) preload_node(ddfs_hash2idx(node+ddfs->c_addr_size));
+        pthread_mutex_lock_d(&ifile_mutex);
+        long long int start=nanonow();
+        res=ddfs_locate_hash(node+ddfs->c_addr_size, &addr, &node_idx);
+        hist_add(hist_locate_hash, start);
+        if (res==0) refcount_inc(addr);
+        pthread_mutex_unlock_d(&ifile_mutex);
     }
 
-    pthread_mutex_lock_d(&fh->xstat->xstat_lock);
-    // buffer has been written (or not) and don't contain anything useful now
-    fh->buf_loaded=DDFS_BUF_EMPTY;
-    // warn everybody about the change
-    pthread_cond_broadcast(&fh->xstat->buf_cond);
-    pthread_mutex_unlock_d(&fh->xstat->xstat_lock);
+    if (res==0)
+    {
+        ddumb_statistic.block_write++;
+        ddumb_statistic.ghost_write++;
+        res=ddumb_node_write(fh, block_off, addr, node);
+        if (res==0) res=1;
+    }
+    else if (res>0) res=0;
 
     pthread_mutex_lock_d(&reclaim_mutex);
     reclaim_ddumb_buf_write_is_in_use--;
     if (reclaim_ddumb_buf_write_is_in_use==0) pthread_cond_signal(&reclaim_ddumb_buf_write_is_unused);
     pthread_mutex_unlock_d(&reclaim_mutex);
 
+    return res;
+}
+
+static int ddumb_buf_write(struct ddumb_fh *fh)
+{
+    int ret=ddumb_block_write(fh, fh->buf, fh->buf_off);
+
+    pthread_mutex_lock_d(&fh->xstat->xstat_lock);
+    // buffer has been written (or not) and don't contain anything useful now
+    xstat_buf_unload(fh->xstat, fh);
+    // warn everybody about the change
+    pthread_cond_broadcast(&fh->xstat->buf_cond);
+    pthread_mutex_unlock_d(&fh->xstat->xstat_lock);
+
     return ret;
 }
 
@@ -1684,6 +3255,7 @@ static void *writer_pool_loop(void *ptr)
         writers_fh_n_ready--;
         fh->pool_status=ps_busy; // don't steal it to me
         pthread_mutex_unlock_d(&writer_pool_mutex);
+        hist_add(hist_pool_wait, fh->pool_submit);
 //        DDFS_LOG(LOG_NOTICE, "[%lu]**  writer_pool_loop TAKE fh=%p fh_src=%p writer=%d fd=%d offset=0x%llx(%lld) data=0x%llx %s\n", thread_id(), fh, fh_src, fh_src->pool_writer, fh->fd, fh->buf_off, fh->buf_off, *(long long int*)fh->buf, fh->filename);
 
         int write_error_code=ddumb_buf_write(fh);
@@ -1752,6 +3324,7 @@ static int writer_pool_load(struct ddumb_fh *fh)
     {
 //        DDFS_LOG(LOG_NOTICE, "[%lu]++  writer_pool_load fh=%p fh_dst=%p writer=%d+1 pool_status=%d\n", thread_id(), fh, fh_dst, fh->pool_writer, fh_dst->pool_status);
         fh_dst->pool_status=ps_ready; // let it go (to a writer_pool_loop())
+        fh_dst->pool_submit=nanonow();
         writers_fh_n_ready++;
         fh->pool_writer++;
         res=fh->delayed_write_error_code;
@@ -1792,8 +3365,6 @@ static int init_writer_pool()
             return -ENOMEM;
         }
         writers_fh[i]=fh;
-        fh->zone.op='F';
-        fh->zone.right='n';
     }
 
     for (i=0; i<ddumb_param.pool; i++)
@@ -1853,7 +3424,7 @@ static int ddumb_getattr(const char *path, struct stat *stbuf)
         // retrieve size
         struct xstat xstat;
         xstat.ino=stbuf->st_ino;
-        res=xstat_get(&xstat_root, &xstat, path+1);
+        res=xstat_get(&xstat_root, &xstat, path+1, stbuf);
         if (res>=0)
         {
             stbuf->st_size=xstat.h.size;
@@ -2027,9 +3598,17 @@ static int ddumb_unlink(const char *path)
     int res;
 
     if (strcmp(path, "/")==0) path="/.";
-    res = unlink(path+1);
-    if (res == -1)
-        return -errno;
+    if (refcount)
+    {
+        res=refcount_remove(path+1, NULL);
+        if (res<0) return res;
+    }
+    else
+    {
+        res = unlink(path+1);
+        if (res == -1)
+            return -errno;
+    }
     reclaim_could_find_free_blocks=1;
     return 0;
 }
@@ -2066,10 +3645,18 @@ static int ddumb_rename(const char *from, const char *to)
 
     if (strcmp(from, "/")==0) from="/.";
     if (strcmp(to, "/")==0) to="/.";
-    res = rename(from+1, to+1);
-    if (res == -1)
-        return -errno;
-
+    if (refcount)
+    {
+        res=refcount_remove(from+1, to+1);
+        if (res<0) return res;
+    }
+    else
+    {
+        res = rename(from+1, to+1);
+        if (res == -1)
+            return -errno;
+    }
+    reclaim_could_find_free_blocks=1;   // the rename can overwrite a file
     return 0;
 }
 
@@ -2131,23 +3718,26 @@ int do_truncate(struct ddumb_fh *fh, long long int size)
 
         pthread_mutex_lock_d(&xstat->xstat_lock);
         int i;
-        for(i=0; i<xstat->fhs_n; i++)
+        for(i=0; i<XSTAT_BUF_MAP_SZ; i++)
         {
-            struct ddumb_fh *xfh=xstat->fhs[i];
-            // DDFS_LOG_DEBUG("[%lu]++  do_truncate fh=%p xstat=%p xfh=%p I=%d\n", thread_id(), (void*)fh, (void*)fh->xstat, (void*)xfh, i);
-            if (xfh->buf_loaded && (xfh->buf_off>block_boundary || xfh->buf_off==size))
+            struct ddumb_fh *xfh=xstat->buf_map[i];
+            while (xfh)
             {
-                if (xfh->buf_loaded==DDFS_BUF_RDONLY)
-                {   // the buffer is being flushed, wait for the end
-                    ddumb_statistic.wait_buf_truncate++;
-                    pthread_cond_wait_d(&xstat->buf_cond, &xstat->xstat_lock);
-                    // and retry from beginning
-                    i=-1;
-                }
-                else
-                {   // the buffer is now useless
-                    xfh->buf_loaded=DDFS_BUF_EMPTY;
+                struct ddumb_fh *next=xfh->buf_map_next;
+                if (xfh->buf_off>block_boundary || xfh->buf_off==size)
+                {
+                    if (xfh->buf_loaded==DDFS_BUF_RDONLY)
+                    {   // the buffer is being flushed, wait for the end and retry this bucket
+                        ddumb_statistic.wait_buf_truncate++;
+                        pthread_cond_wait_d(&xstat->buf_cond, &xstat->xstat_lock);
+                        next=xstat->buf_map[i];
+                    }
+                    else
+                    {   // the buffer is now useless
+                        xstat_buf_unload(xstat, xfh);
+                    }
                 }
+                xfh=next;
             }
         }
         pthread_mutex_unlock_d(&xstat->xstat_lock);
@@ -2167,6 +3757,11 @@ int do_truncate(struct ddumb_fh *fh, long long int size)
         // and this address is reserved for block"\0......\0"
     }
 
+    if (refcount && size<xstat->h.size)
+    {   // forget the blocks after the new end of file
+        refcount_dec_file(fh->fd, (size+ddfs->c_block_size-1)>>ddfs->block_size_shift, (xstat->h.size+ddfs->c_block_size-1)>>ddfs->block_size_shift);
+    }
+
     // size of the file after truncate
     off_t sz=((size+ddfs->c_block_size-1)>>ddfs->block_size_shift)*ddfs->c_node_size+ddfs->c_file_header_size;
 
@@ -2205,10 +3800,11 @@ static int ddumb_truncate(const char *path, off_t size)
         return -ENOMEM;
     }
 
+    struct xzone zone;
     pthread_mutex_lock_d(&fh->lock); // useless because fh cannot be "owned" by another thread
-    xzone_lock(fh, size, 0, 'T');
+    xzone_lock(fh, &zone, size, 0, 'T');
     res=do_truncate(fh, size);
-    xzone_unlock(fh);
+    xzone_unlock(fh, &zone);
     pthread_mutex_unlock_d(&fh->lock); // useless because fh cannot be "owned" by another thread
     _ddumb_flush(fh);
     ddumb_free_fh(&fi);
@@ -2222,9 +3818,10 @@ static int ddumb_ftruncate(const char *path, off_t size, struct fuse_file_info *
 {
     (void) path;
     struct ddumb_fh *fh=ddumb_get_fh(fi);
+    struct xzone zone;
 
     pthread_mutex_lock_d(&fh->lock);
-    xzone_lock(fh, size, 0, 'T');
+    xzone_lock(fh, &zone, size, 0, 'T');
 
     ddumb_statistic.ftruncate++;
 
@@ -2236,7 +3833,7 @@ static int ddumb_ftruncate(const char *path, off_t size, struct fuse_file_info *
         res=xstat_save(fh->fd, fh->xstat, fh->filename);
     }
 
-    xzone_unlock(fh);
+    xzone_unlock(fh, &zone);
     pthread_mutex_unlock_d(&fh->lock);
 
     return res;
@@ -2349,7 +3946,7 @@ static int ddumb_open(const char *path, struct fuse_file_info *fi)
             FILE *file=fopen(path+1, "w");
             ddumb_write_statistic(file);
             fclose(file);
-            if (strcmp(path, STATS0_FILE)==0) memset(&ddumb_statistic, '\0', sizeof(struct ddumb_statistic));
+            if (strcmp(path, STATS0_FILE)==0) statistic_reset();
         }
         else if (strcmp(path, RECLAIM_FILE)==0)
         {
@@ -2423,6 +4020,7 @@ static int ddumb_read(const char *path, char *buf, size_t size, off_t offset, st
 {
     (void) path;
     int res;
+    long long int start=nanonow();
     struct ddumb_fh *fh=ddumb_get_fh(fi);
 
     if (fh->special)
@@ -2432,17 +4030,12 @@ static int ddumb_read(const char *path, char *buf, size_t size, off_t offset, st
     }
     else
     {
-        pthread_mutex_lock_d(&fh->lock);
-        // This lock don't allow simultaneous access in read to this fh
-        // To allow simultaneous access, I must mel the xzone dynamic
-        // to allow each request to lock its own zone (because here the zone is attached
-        // to the fh
-
-        xzone_lock(fh, (long long int)offset, (long long int)size, 'R');
+        // reading don't use fh->buf, then fh->lock is not needed and simultaneous
+        // reads on the same fh only share their zones
+        struct xzone zone;
+        xzone_lock(fh, &zone, (long long int)offset, (long long int)size, 'R');
         res=_ddumb_read(path, buf, size, offset, fh);
-        xzone_unlock(fh);
-
-        pthread_mutex_unlock_d(&fh->lock);
+        xzone_unlock(fh, &zone);
 
 #ifdef DO_SEQ_READAHEAD
 	// Only consider read-ahead if the read returned all data
@@ -2498,9 +4091,157 @@ static int ddumb_read(const char *path, char *buf, size_t size, off_t offset, st
 #endif
     }
 
+    hist_add(hist_read, start);
     return res;
 }
 
+#if FUSE_VERSION >= 29
+/**
+ * add a piece of data to the buffers returned to fuse
+ *
+ * consecutive pieces from the block file are merged into one buffer
+ */
+static void ddumb_bufvec_add(struct fuse_bufvec *bufv, int fd, off_t pos, char *mem, size_t size)
+{
+    struct fuse_buf *last=bufv->count?bufv->buf+bufv->count-1:NULL;
+    if (mem==NULL && last && last->mem==NULL && last->pos+last->size==pos)
+    {
+        last->size+=size;
+        return;
+    }
+    struct fuse_buf *b=bufv->buf+bufv->count++;
+    b->size=size;
+    b->mem=mem;
+    b->fd=fd;
+    b->pos=pos;
+    b->flags=(mem==NULL)?(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK):0;
+}
+
+/**
+ * read data without copying the blocks through user space
+ *
+ * the blocks stored as is in the block file are returned as file descriptor
+ * buffers that fuse can splice to the kernel, the other ones are read in
+ * memory. The splice happens after the zone is unlocked, this is like
+ * a read that would return just before a concurrent write of the same zone.
+ * The block cannot be reused before it is freed by the reclaim, that takes
+ * much longer than a reply to fuse. The refcount can free the block as soon
+ * as it is overwritten, then everything is read in memory when it is enabled.
+ */
+static int ddumb_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct ddumb_fh *fh=ddumb_get_fh(fi);
+    struct fuse_bufvec *bufv;
+    int res=0;
+
+    if (fh->special || ddfs->c_compress || refcount)
+    {   // read into a single memory buffer
+        bufv=malloc(sizeof(struct fuse_bufvec));
+        char *mem=malloc(size);
+        if (bufv==NULL || mem==NULL)
+        {
+            free(bufv);
+            free(mem);
+            return -ENOMEM;
+        }
+        res=ddumb_read(path, mem, size, offset, fi);
+        if (res<0)
+        {
+            free(bufv);
+            free(mem);
+            return res;
+        }
+        *bufv=FUSE_BUFVEC_INIT(res);
+        bufv->buf[0].mem=mem;
+        *bufp=bufv;
+        return 0;
+    }
+
+    long long int start=nanonow();
+    ddumb_statistic.read++;
+    struct xzone zone;
+    xzone_lock(fh, &zone, (long long int)offset, (long long int)size, 'R');
+
+    if (offset>fh->xstat->h.size) size=0;
+    else if (offset+size>fh->xstat->h.size) size=fh->xstat->h.size-offset;
+
+    long long int gap=(offset & ddfs->block_gap_mask);
+    int count=(gap+size+ddfs->c_block_size-1)>>ddfs->block_size_shift;
+    bufv=malloc(sizeof(struct fuse_bufvec)+(count?count-1:0)*sizeof(struct fuse_buf));
+    if (bufv==NULL)
+    {
+        xzone_unlock(fh, &zone);
+        return -ENOMEM;
+    }
+    bufv->count=0;
+    bufv->idx=0;
+    bufv->off=0;
+
+    size_t remain=size;
+    long long int off=offset;
+    while (remain>0 && res==0)
+    {
+        long long int sz=ddfs->c_block_size-gap;
+        if (remain<sz) sz=remain;
+
+        long long int block_addr=-1;
+        struct xstat *xstat=fh->xstat;
+        pthread_mutex_lock_d(&xstat->xstat_lock);
+        int in_buffer=(xstat_buf_find(xstat, off & ddfs->block_boundary_mask)!=NULL);
+        pthread_mutex_unlock_d(&xstat->xstat_lock);
+
+        if (!in_buffer)
+        {
+            res=ddumb_block_addr(fh, off, &block_addr);
+            if (res) break;
+        }
+
+        if (in_buffer || block_addr==0 || block_addr==1 || block_addr>=ddfs->c_block_count)
+        {   // the block is being written or is not in the block file
+            char *mem=malloc(sz);
+            if (mem==NULL)
+            {
+                res=-ENOMEM;
+                break;
+            }
+            res=ddumb_block_read(fh, mem, off, sz);
+            if (res<0)
+            {
+                free(mem);
+                break;
+            }
+            ddumb_bufvec_add(bufv, -1, 0, mem, sz);
+        }
+        else
+        {
+            block_wait(block_addr);
+            ddumb_statistic.block_read++;
+            ddumb_statistic.block_read_splice++;
+            ddumb_bufvec_add(bufv, ddfs->bfile_ro, (block_addr<<ddfs->block_size_shift)+gap, NULL, sz);
+        }
+        remain-=sz;
+        off+=sz;
+        gap=0;
+    }
+    xzone_unlock(fh, &zone);
+
+    if (res<0)
+    {
+        int i;
+        for (i=0; i<bufv->count; i++) free(bufv->buf[i].mem);
+        free(bufv);
+        return res;
+    }
+    if (bufv->count==0)
+    {   // end of file
+        *bufv=FUSE_BUFVEC_INIT(0);
+    }
+    *bufp=bufv;
+    hist_add(hist_read, start);
+    return 0;
+}
+#endif
+
 static int _ddumb_write(const char *path, const char *buf, size_t size, off_t offset, struct ddumb_fh *fh)
 {   // be careful _ddumb_write can call itself via do_truncate
     (void) path;
@@ -2524,6 +4265,10 @@ static int _ddumb_write(const char *path, const char *buf, size_t size, off_t of
         reclaim_could_find_free_blocks=1; // we can run reclaim
     }
 
+    // the full blocks of a multi-block request don't need to be searched one by one
+    int buf_none=xstat_buf_none(xstat, offset, size);
+    if (buf_none) ddumb_statistic.write_multi_block++;
+
     long long int remain=size;
     long long int off=offset;
     while (remain>0)
@@ -2531,44 +4276,69 @@ static int _ddumb_write(const char *path, const char *buf, size_t size, off_t of
         long long int sz=ddfs->c_block_size-gap;
         if (remain<sz) sz=remain;
 
-        // search if buf can be written into any available buffers registered in xstat
+        // search if buf can be written into an available buffer registered in xstat
         int found=0;
-        int i=0;
-        pthread_mutex_lock_d(&xstat->xstat_lock);
-        for(; i<xstat->fhs_n; i++)
-        {
-            struct ddumb_fh *xfh=xstat->fhs[i];
-            // DDFS_LOG_DEBUG("[%lu]++  ddumb_write fh=%p xstat=%p xfh=%p I=%d\n", thread_id(), (void*)fh, (void*)fh->xstat, (void*)xfh, i);
-            if (xfh->buf_loaded && xfh->buf_off==block_boundary)
+        struct ddumb_fh *xfh=NULL;
+        if (!(buf_none && sz==ddfs->c_block_size))
+        {   // a full block inside a request without loaded buffer can skip the search
+            pthread_mutex_lock_d(&xstat->xstat_lock);
+            while ((xfh=xstat_buf_find(xstat, block_boundary))!=NULL && xfh->buf_loaded==DDFS_BUF_RDONLY)
+            {   // the buffer is being flushed, wait for the end
+                ddumb_statistic.wait_buf_write++;
+                pthread_cond_wait_d(&xstat->buf_cond, &xstat->xstat_lock);
+            }
+            if (xfh)
             {
-                if (xfh->buf_loaded==DDFS_BUF_RDONLY)
-                {
-                    ddumb_statistic.wait_buf_write++;
-                    pthread_cond_wait_d(&xstat->buf_cond, &xstat->xstat_lock);
-                    i=-1;
-                }
-                else
-                {
-                    found=1;
-                    // if (xfh!=fh) DDFS_LOG_DEBUG("[%lu]--  ddumb_write write into another fh=%p xfh=%p\n", thread_id(), (void*)fh, (void*)xfh);
+                found=1;
+                // if (xfh!=fh) DDFS_LOG_DEBUG("[%lu]--  ddumb_write write into another fh=%p xfh=%p\n", thread_id(), (void*)fh, (void*)xfh);
 
-                    if (off > xstat->h.size)
-                    { // handle write after EOF
-                        DDFS_LOG_DEBUG("[%lu]--  ddumb_write write after EOF but inside last block, file size=0x%llx(%lld) offset=0x%llx(%lld)\n", thread_id(), (long long int)xstat->h.size, (long long int)xstat->h.size, (long long int)off, (long long int)off);
-                        memset(xfh->buf+(xstat->h.size-block_boundary), '\0', off-xstat->h.size);
-                        DDFS_LOG_DEBUG("[%lu]--  ddumb_write eof MEMSET from=0x%llx(%lld) to=0x%llx(%lld) \n", thread_id(), (long long int)xstat->h.size, (long long int)xstat->h.size, off, off);
+                if (off > xstat->h.size)
+                { // handle write after EOF
+                    DDFS_LOG_DEBUG("[%lu]--  ddumb_write write after EOF but inside last block, file size=0x%llx(%lld) offset=0x%llx(%lld)\n", thread_id(), (long long int)xstat->h.size, (long long int)xstat->h.size, (long long int)off, (long long int)off);
+                    memset(xfh->buf+(xstat->h.size-block_boundary), '\0', off-xstat->h.size);
+                    DDFS_LOG_DEBUG("[%lu]--  ddumb_write eof MEMSET from=0x%llx(%lld) to=0x%llx(%lld) \n", thread_id(), (long long int)xstat->h.size, (long long int)xstat->h.size, off, off);
 
-                    }
-                    if (buf) memcpy(xfh->buf+gap, buf, sz);
-                    else {
-                        memset(xfh->buf+gap, '\0', sz);
-                        DDFS_LOG_DEBUG("[%lu]--  ddumb_write zero MEMSET from=0x%llx(%lld) to=0x%llx(%lld) \n", thread_id(), off, off, off+sz-1, off+sz-1);
-                    }
-                    break;
+                }
+                if (buf) memcpy(xfh->buf+gap, buf, sz);
+                else {
+                    memset(xfh->buf+gap, '\0', sz);
+                    DDFS_LOG_DEBUG("[%lu]--  ddumb_write zero MEMSET from=0x%llx(%lld) to=0x%llx(%lld) \n", thread_id(), off, off, off+sz-1, off+sz-1);
                 }
             }
+            pthread_mutex_unlock_d(&xstat->xstat_lock);
+        }
+
+        if (!found && gap==0 && sz==ddfs->c_block_size && (buf==NULL || ddfs_is_zero_block(buf)))
+        {   // a full block of zeros (or a hole), write the node without using the buffer
+            unsigned char node[NODE_SIZE];
+
+            if (fh->buf_loaded)
+            {
+                ddumb_statistic.write_save++;
+                res=ddumb_buffer_flush(fh);
+                if (res<0) return res;
+            }
+            ddumb_statistic.block_write++;
+            ddumb_statistic.block_write_zero++;
+            memcpy(node+ddfs->c_addr_size, ddfs->zero_block_hash, ddfs->c_hash_size);
+            res=ddumb_node_write(fh, block_boundary, 0, node);
+            if (res<0) return res;
+            found=1;
+        }
+        else if (!found && gap==0 && sz==ddfs->c_block_size && ddumb_param.pool==0 && !fh->shared_buf && (!ddfs->align || ((uintptr_t)buf%BLOCK_ALIGMENT)==0))
+        {   // a full block and no writer pool, hash it from the caller buffer,
+            // direct io needs an aligned buffer and a shared buffer could change
+            // between the hash and the write, else go through fh->buf
+            if (fh->buf_loaded)
+            {
+                ddumb_statistic.write_save++;
+                res=ddumb_buffer_flush(fh);
+                if (res<0) return res;
+            }
+            res=ddumb_block_write(fh, buf, block_boundary);
+            if (res<0) return res;
+            found=1;
         }
-        pthread_mutex_unlock_d(&xstat->xstat_lock);
 
         if (!found)
         {
@@ -2615,11 +4385,11 @@ static int _ddumb_write(const char *path, const char *buf, size_t size, off_t of
                 memset(fh->buf+gap, '\0', sz);
                 DDFS_LOG_DEBUG("[%lu]--  ddumb_write zero2 MEMSET from=0x%llx(%lld) to=0x%llx(%lld) \n", thread_id(), off, off, off+sz, off+sz);
             }
-            fh->buf_off=block_boundary;
-//            pthread_mutex_lock_d(&xstat->xstat_lock);
             fh->buf_firstwrite=time(NULL);
-            fh->buf_loaded=DDFS_BUF_RDWR; // the locked zone "protect" this fh
-//            pthread_mutex_unlock_d(&xstat->xstat_lock);
+            pthread_mutex_lock_d(&xstat->xstat_lock);
+            fh->buf_off=block_boundary;
+            xstat_buf_load(xstat, fh, DDFS_BUF_RDWR);
+            pthread_mutex_unlock_d(&xstat->xstat_lock);
 
         }
 
@@ -2646,7 +4416,12 @@ static int _ddumb_write(const char *path, const char *buf, size_t size, off_t of
     return size;
 }
 
-static int ddumb_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+/**
+ * refuse to write when the free blocks are too low
+ *
+ * @return 0 or -ENOSPC
+ */
+static int ddumb_write_check_space()
 {
 	if (ddfs->c_block_count-ddfs->usedblock<1000)
 	{
@@ -2658,21 +4433,558 @@ static int ddumb_write(const char *path, const char *buf, size_t size, off_t off
 		return -ENOSPC;
 	}
 	else low_free_block_warning=0;
+	return 0;
+}
+
+static int ddumb_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    int res=ddumb_write_check_space();
+    if (res) return res;
 
     struct ddumb_fh *fh=ddumb_get_fh(fi);
     assert(!fh->rdonly);
     assert(!fh->special); // special file are RO (until now) and have no fh->lock
 
+    struct xzone zone;
+    long long int start=nanonow();
     pthread_mutex_lock_d(&fh->lock);
 
-    xzone_lock(fh, (long long int)offset, (long long int)size, 'W');
-    int res=_ddumb_write(path, buf, size, offset, fh);
-    xzone_unlock(fh);
+    xzone_lock(fh, &zone, (long long int)offset, (long long int)size, 'W');
+    res=_ddumb_write(path, buf, size, offset, fh);
+    xzone_unlock(fh, &zone);
 
     pthread_mutex_unlock_d(&fh->lock);
+    hist_add(hist_write, start);
     return res;
 }
 
+/**
+ * write the blocks of a range that are already stored, knowing only their hash
+ *
+ * the blocks that are unknown, or that have a buffer loaded, are left
+ * untouched and must be written with their data
+ *
+ * @param fh the file
+ * @param hashes the hashes of the blocks of the range
+ * @param unknown set to 1 for the blocks to write with their data, else 0
+ * @param size the size of the range, a multiple of the block size
+ * @param offset the offset of the range, aligned on a block
+ * @return the number of unknown blocks or -errno
+ */
+static int ddumb_write_hashes(struct ddumb_fh *fh, const unsigned char *hashes, char *unknown, size_t size, off_t offset)
+{
+    struct xstat *xstat=fh->xstat;
+    struct xzone zone;
+    int res=0, count=0, i;
+    off_t off;
+
+    if ((offset & ddfs->block_gap_mask) || (size & ddfs->block_gap_mask)) return -EINVAL;
+
+    pthread_mutex_lock_d(&fh->lock);
+    xzone_lock(fh, &zone, (long long int)offset, (long long int)size, 'W');
+
+    if (offset > xstat->h.size)
+    {   // like _ddumb_write(), fill the gap first
+        ddumb_statistic.eof_write++;
+        res=do_truncate(fh, offset);
+    }
+
+    for (i=0, off=offset; res>=0 && off<offset+size; i++, off+=ddfs->c_block_size)
+    {
+        pthread_mutex_lock_d(&xstat->xstat_lock);
+        int loaded=(xstat_buf_find(xstat, off)!=NULL);
+        pthread_mutex_unlock_d(&xstat->xstat_lock);
+
+        // a loaded buffer would overwrite the node when flushed
+        res=loaded?0:ddumb_hash_write(fh, hashes+i*ddfs->c_hash_size, off);
+        unknown[i]=(res==0);
+        if (res==0) count++;
+        else if (res>0)
+        {
+            ddumb_statistic.write_hash++;
+            if (off+ddfs->c_block_size > xstat->h.size)
+            {
+                xstat->h.size=off+ddfs->c_block_size;
+                xstat->saved=0;
+            }
+        }
+    }
+    if (!xstat->saved) xstat_save_fh(fh);
+
+    xzone_unlock(fh, &zone);
+    pthread_mutex_unlock_d(&fh->lock);
+    ddumb_statistic.write_hash_unknown+=count;
+    return (res<0)?res:count;
+}
+
+#define CLONE_NODES 256     // nodes copied at once by ddumb_clone_nodes()
+
+/**
+ * copy the nodes of full blocks from a file to another
+ *
+ * The blocks are not read, they just get one more reference. The source
+ * keeps its own reference while its zone is locked, the blocks cannot be
+ * freed in the meantime and ifile_mutex is not needed.
+ *
+ * @param src the source file
+ * @param src_off the offset of the first block in the source
+ * @param dst the destination file
+ * @param dst_off the offset of the first block in the destination
+ * @param n the number of blocks, up to CLONE_NODES
+ * @return 0 for success, -errno for error
+ */
+static int ddumb_clone_nodes(struct ddumb_fh *src, off_t src_off, struct ddumb_fh *dst, off_t dst_off, int n)
+{
+    unsigned char nodes[CLONE_NODES*NODE_SIZE];
+    unsigned char old_nodes[CLONE_NODES*NODE_SIZE];
+    int size=n*ddfs->c_node_size;
+    int i, len, old_len=0;
+    int ret=0;
+
+    off_t src_node_off=(src_off>>ddfs->block_size_shift)*ddfs->c_node_size+ddfs->c_file_header_size;
+    off_t dst_node_off=(dst_off>>ddfs->block_size_shift)*ddfs->c_node_size+ddfs->c_file_header_size;
+
+    len=pread(src->fd, nodes, size, src_node_off);
+    if (len==-1)
+    {
+        DDFS_LOG(LOG_ERR, "ddumb_clone_nodes cannot read nodes offset=%lld %s (%s)\n", (long long int)src_node_off, src->filename, strerror(errno));
+        return -errno;
+    }
+    // the nodes after the end of the underlying file are blocks of zeros
+    if (len<size) memset(nodes+len, 0, size-len);
+
+    // like ddumb_block_write(), reclaim() must not start in the middle
+    pthread_mutex_lock_d(&reclaim_mutex);
+    reclaim_ddumb_buf_write_is_in_use++;
+    pthread_mutex_unlock_d(&reclaim_mutex);
+
+    for (i=0; i<n; i++) refcount_inc(ddfs_get_node_addr(nodes+i*ddfs->c_node_size));
+
+    if (refcount)
+    {   // the destination will forget the blocks currently in the range
+        old_len=pread(dst->fd, old_nodes, size, dst_node_off);
+        if (old_len<0) old_len=0;
+    }
+
+    len=pwrite(dst->fd, nodes, size, dst_node_off);
+    for (i=0; i<n; i++)
+    {
+        if (len!=size) refcount_dec(ddfs_get_node_addr(nodes+i*ddfs->c_node_size)); // the references were not written
+        else if ((i+1)*ddfs->c_node_size<=old_len) refcount_dec(ddfs_get_node_addr(old_nodes+i*ddfs->c_node_size));
+    }
+
+    pthread_spin_lock(&reclaim_spinlock);
+    if (reclaim_enable) for (i=0; i<n; i++) bit_array_set(&ba_found_in_files, ddfs_get_node_addr(nodes+i*ddfs->c_node_size));
+    pthread_spin_unlock(&reclaim_spinlock);
+
+    pthread_mutex_lock_d(&reclaim_mutex);
+    reclaim_ddumb_buf_write_is_in_use--;
+    if (reclaim_ddumb_buf_write_is_in_use==0) pthread_cond_signal(&reclaim_ddumb_buf_write_is_unused);
+    pthread_mutex_unlock_d(&reclaim_mutex);
+
+    if (len==-1)
+    {
+        DDFS_LOG(LOG_ERR, "ddumb_clone_nodes cannot write nodes offset=%lld %s (%s)\n", (long long int)dst_node_off, dst->filename, strerror(errno));
+        ret=-errno;
+    }
+    else if (len!=size)
+    {
+        DDFS_LOG(LOG_ERR, "ddumb_clone_nodes offset=%lld wrote only %d/%d %s\n", (long long int)dst_node_off, len, size, dst->filename);
+        ret=-EIO;
+    }
+    else ddumb_statistic.clone_node+=n;
+    return ret;
+}
+
+/**
+ * copy a part of a block by reading it from the source and writing it
+ * in the destination, for the blocks that have a buffer loaded
+ *
+ * @param buf a buffer of one block
+ * @return 0 for success, -errno for error
+ */
+static int ddumb_clone_data(struct ddumb_fh *src, off_t src_off, struct ddumb_fh *dst, off_t dst_off, size_t size, char *buf)
+{
+    int res=_ddumb_read(src->filename, buf, size, src_off, src);
+    if (res<0) return res;
+    if (res<size) memset(buf+res, 0, size-res);
+
+    ddumb_statistic.clone_data++;
+    res=_ddumb_write(dst->filename, buf, size, dst_off, dst);
+    return (res<0)?res:0;
+}
+
+static int xstat_buf_loaded(struct xstat *xstat, off_t off)
+{
+    pthread_mutex_lock_d(&xstat->xstat_lock);
+    int loaded=(xstat_buf_find(xstat, off)!=NULL);
+    pthread_mutex_unlock_d(&xstat->xstat_lock);
+    return loaded;
+}
+
+#define DDUMB_CRED_GROUPS 256 // the other supplementary groups are ignored
+
+// the credentials of a user of the socket or of the ioctl
+struct ddumb_cred
+{
+    uid_t uid;
+    gid_t gid;
+    int ngroups;
+    gid_t groups[DDUMB_CRED_GROUPS];
+};
+
+/**
+ * fill the credentials of a process, its supplementary groups are read in /proc
+ *
+ * the groups are left empty if they cannot be read, this only denies more
+ */
+static void ddumb_cred_init(struct ddumb_cred *cred, uid_t uid, gid_t gid, pid_t pid)
+{
+    char filename[64];
+    char line[4096];
+
+    cred->uid=uid;
+    cred->gid=gid;
+    cred->ngroups=0;
+    snprintf(filename, sizeof(filename), "/proc/%d/status", (int)pid);
+    FILE *file=fopen(filename, "r");
+    if (file==NULL) return;
+    while (fgets(line, sizeof(line), file))
+    {
+        if (strncmp(line, "Groups:", 7)) continue;
+        char *p=line+7;
+        char *end;
+        while (cred->ngroups<DDUMB_CRED_GROUPS)
+        {
+            unsigned long g=strtoul(p, &end, 10);
+            if (end==p) break;
+            cred->groups[cred->ngroups++]=g;
+            p=end;
+        }
+        break;
+    }
+    fclose(file);
+}
+
+/**
+ * tell if a user has some rights on a file, the ACLs are ignored
+ *
+ * @param mask the rights, like for access(), R_OK and/or X_OK
+ * @return 1 if the user has the rights
+ */
+static int ddumb_cred_access(struct ddumb_cred *cred, struct stat *st, int mask)
+{
+    int i;
+
+    if (cred->uid==0) return 1;
+    if (st->st_uid==cred->uid) return ((st->st_mode>>6) & mask)==mask;
+    int in_group=(st->st_gid==cred->gid);
+    for (i=0; i<cred->ngroups && !in_group; i++) in_group=(st->st_gid==cred->groups[i]);
+    if (in_group) return ((st->st_mode>>3) & mask)==mask;
+    return (st->st_mode & mask)==mask;
+}
+
+/**
+ * open a file of the filesystem for reading without leaving its root
+ *
+ * the path cannot hold a '..' and no symlink is followed, even in the
+ * directories. The user must be able to search every directory from the
+ * root and to read the file.
+ *
+ * @param path the path of the file, starting with '/'
+ * @param cred the user asking to read the file
+ * @return the file descriptor or -errno
+ */
+static int ddumb_open_beneath(const char *path, struct ddumb_cred *cred)
+{
+    char name[FILENAME_MAX];
+    char *save=NULL;
+    struct stat st;
+
+    if (strlen(path)>=sizeof(name)) return -ENAMETOOLONG;
+    strcpy(name, path);
+    int dirfd=open(".", O_RDONLY | O_DIRECTORY);
+    if (dirfd==-1) return -errno;
+    char *comp=strtok_r(name, "/", &save);
+    while (comp)
+    {
+        char *next=strtok_r(NULL, "/", &save);
+        if (0==strcmp(comp, "..") || fstat(dirfd, &st)==-1 || !ddumb_cred_access(cred, &st, X_OK))
+        {
+            close(dirfd);
+            return -EACCES;
+        }
+        int fd=openat(dirfd, comp, O_RDONLY | O_NOFOLLOW | (next?O_DIRECTORY:0));
+        int err=errno;
+        close(dirfd);
+        if (fd==-1) return -err;
+        dirfd=fd;
+        comp=next;
+    }
+    if (fstat(dirfd, &st)==-1 || !ddumb_cred_access(cred, &st, R_OK))
+    {
+        close(dirfd);
+        return -EACCES;
+    }
+    return dirfd;
+}
+
+/**
+ * clone a range of a file into another one
+ *
+ * The full blocks are cloned by copying their nodes, without reading nor
+ * hashing the data. A block with a buffer loaded in any open fh of one of
+ * the files, and the last partial block, are copied with their data. The
+ * buffer of dst is flushed first.
+ *
+ * @param dst the destination file, open for writing
+ * @param src_path the path of the source file
+ * @param src_off the offset in the source, aligned on a block
+ * @param dst_off the offset in the destination, aligned on a block
+ * @param size the size of the range, 0 for up to the end of the source
+ * @param cred the user asking for the clone, it must be able to read the source
+ * @return the size cloned or -errno
+ */
+static long long int ddumb_clone(struct ddumb_fh *dst, const char *src_path, off_t src_off, off_t dst_off, long long int size, struct ddumb_cred *cred)
+{
+    struct xstat *xstat=dst->xstat;
+    struct xzone src_zone, dst_zone;
+    struct stat st;
+    long long int done=0;
+    long long int bs=ddfs->c_block_size;
+    int res;
+
+    if (dst->rdonly || dst->special) return -EBADF;
+    if (src_off<0 || dst_off<0 || size<0 || ((src_off|dst_off) & ddfs->block_gap_mask)) return -EINVAL;
+    if (src_path[0]!='/') return -EINVAL;
+    if (0==strncmp(src_path, SPECIAL_DIR, ddfs->special_dir_len)) return -EACCES;
+
+    res=ddumb_write_check_space();
+    if (res) return res;
+
+    // the nodes of the source are trusted, it must be a file of the filesystem
+    int fd=ddumb_open_beneath(src_path, cred);
+    if (fd<0) return fd;
+    uint64_t hsize;
+    if (fstat(fd, &st)==-1 || !S_ISREG(st.st_mode) || file_header_set_conv(fd, &hsize)!=ddfs->c_file_header_size)
+    {
+        close(fd);
+        return -EINVAL;
+    }
+
+    struct fuse_file_info fi;
+    struct ddumb_fh *src=ddumb_alloc_fh(&fi, fd, 1, 0, src_path);
+    if (src==NULL)
+    {
+        close(fd);
+        DDFS_LOG(LOG_ERR, "ddumb_clone not enough memory for ddumb_alloc_fh(): %s\n", src_path);
+        return -ENOMEM;
+    }
+    int same=(src->xstat==xstat);
+
+    ddumb_statistic.clone++;
+    DDFS_LOG_DEBUG("[%lu]++  ddumb_clone %s offset=0x%llx(%lld) to %s offset=0x%llx(%lld) size=%lld\n", thread_id(), src_path, (long long int)src_off, (long long int)src_off, dst->filename, (long long int)dst_off, (long long int)dst_off, size);
+
+    long long int src_size=src->xstat->h.size;
+    if (size==0 || size>src_size-src_off) size=(src_off<src_size)?src_size-src_off:0;
+
+    pthread_mutex_lock_d(&dst->lock);
+    if (same)
+    {   // one zone for both ranges, that must not overlap
+        long long int start=(src_off<dst_off)?src_off:dst_off;
+        long long int end=((src_off<dst_off)?dst_off:src_off)+size;
+        if (src_off<dst_off+size && dst_off<src_off+size) res=-EINVAL;
+        else xzone_lock(dst, &dst_zone, start, end-start, 'W');
+    }
+    else if (src->xstat->ino<xstat->ino)
+    {   // always lock the files in the same order
+        xzone_lock(src, &src_zone, src_off, size, 'R');
+        xzone_lock(dst, &dst_zone, dst_off, size, 'W');
+    }
+    else
+    {
+        xzone_lock(dst, &dst_zone, dst_off, size, 'W');
+        xzone_lock(src, &src_zone, src_off, size, 'R');
+    }
+    if (res)
+    {
+        pthread_mutex_unlock_d(&dst->lock);
+        ddumb_free_fh(&fi);
+        close(fd);
+        return res;
+    }
+
+    // the source could have been truncated before the lock
+    src_size=src->xstat->h.size;
+    if (src_off+size>src_size) size=(src_off<src_size)?src_size-src_off:0;
+
+    if (dst->buf_loaded) res=ddumb_buffer_flush(dst);
+    if (res==0 && size>0 && dst_off>xstat->h.size)
+    {   // like _ddumb_write(), fill the gap first
+        ddumb_statistic.eof_write++;
+        res=do_truncate(dst, dst_off);
+    }
+
+    char *buf=NULL;
+    while (res==0 && done<size)
+    {
+        long long int remain=size-done;
+        int n=0;
+        while (n<CLONE_NODES && (n+1)*bs<=remain && !xstat_buf_loaded(src->xstat, src_off+done+n*bs) && !xstat_buf_loaded(xstat, dst_off+done+n*bs)) n++;
+
+        if (n)
+        {
+            res=ddumb_clone_nodes(src, src_off+done, dst, dst_off+done, n);
+            done+=n*bs;
+            if (res==0 && dst_off+done>xstat->h.size)
+            {
+                xstat->h.size=dst_off+done;
+                xstat->saved=0;
+            }
+        }
+        else
+        {   // a loaded buffer or the last partial block
+            long long int sz=(remain<bs)?remain:bs;
+            if (buf==NULL) buf=malloc(bs);
+            res=buf?ddumb_clone_data(src, src_off+done, dst, dst_off+done, sz, buf):-ENOMEM;
+            done+=sz;
+        }
+    }
+    free(buf);
+    if (!xstat->saved) xstat_save_fh(dst);
+
+    if (!same) xzone_unlock(src, &src_zone);
+    xzone_unlock(dst, &dst_zone);
+    pthread_mutex_unlock_d(&dst->lock);
+
+    ddumb_free_fh(&fi);
+    close(fd);
+
+    return (res<0)?res:size;
+}
+
+#if FUSE_VERSION >= 29
+/**
+ * move data from the fuse buffers to a memory buffer
+ *
+ * @return 0 for success, -errno for error
+ */
+static int ddumb_bufvec_copy(char *dst, struct fuse_bufvec *bufv, size_t size)
+{
+    struct fuse_bufvec dstv=FUSE_BUFVEC_INIT(size);
+    dstv.buf[0].mem=dst;
+    ssize_t len=fuse_buf_copy(&dstv, bufv, 0);
+    if (len<0) return len;
+    if (len!=size) return -EIO;
+    return 0;
+}
+
+/**
+ * write data that fuse has spliced into a pipe
+ *
+ * the full aligned blocks are read from the pipe straight into the block
+ * buffer of fh, the other parts go through _ddumb_write()
+ */
+static int ddumb_write_buf(const char *path, struct fuse_bufvec *bufv, off_t offset, struct fuse_file_info *fi)
+{
+    size_t size=fuse_buf_size(bufv);
+    struct fuse_buf *first=bufv->buf+bufv->idx;
+
+    if (bufv->count-bufv->idx==1 && !(first->flags & FUSE_BUF_IS_FD))
+    {   // a memory buffer, there is nothing to save
+        return ddumb_write(path, (char *)first->mem+bufv->off, size, offset, fi);
+    }
+
+    int res=ddumb_write_check_space();
+    if (res) return res;
+
+    struct ddumb_fh *fh=ddumb_get_fh(fi);
+    assert(!fh->rdonly);
+    assert(!fh->special);
+
+    struct xstat *xstat=fh->xstat;
+    char *tmp=NULL;
+    struct xzone zone;
+    long long int start=nanonow();
+    pthread_mutex_lock_d(&fh->lock);
+    xzone_lock(fh, &zone, (long long int)offset, (long long int)size, 'W');
+    int buf_none=xstat_buf_none(xstat, offset, size);
+
+    size_t remain=size;
+    long long int off=offset;
+    while (remain>0)
+    {
+        long long int gap=(off & ddfs->block_gap_mask);
+        long long int block_boundary=(off & ddfs->block_boundary_mask);
+        long long int sz=ddfs->c_block_size-gap;
+        if (remain<sz) sz=remain;
+
+        int direct=0;
+        if (sz==ddfs->c_block_size && block_boundary<=xstat->h.size)
+        {
+            if (buf_none) direct=1;
+            else
+            {
+                pthread_mutex_lock_d(&xstat->xstat_lock);
+                direct=(xstat_buf_find(xstat, block_boundary)==NULL);
+                pthread_mutex_unlock_d(&xstat->xstat_lock);
+            }
+        }
+
+        if (direct)
+        {   // like _ddumb_write() but without the copy
+            ddumb_statistic.write++;
+            ddumb_statistic.write_splice++;
+            if (block_boundary < xstat->h.size)
+            {
+                reclaim_could_find_free_blocks=1; // we can run reclaim
+            }
+            if (fh->buf_loaded)
+            {
+                ddumb_statistic.write_save++;
+                res=ddumb_buffer_flush(fh);
+                if (res<0) break;
+            }
+            res=ddumb_bufvec_copy(fh->buf, bufv, sz);
+            if (res<0) break;
+            fh->buf_firstwrite=time(NULL);
+            pthread_mutex_lock_d(&xstat->xstat_lock);
+            fh->buf_off=block_boundary;
+            xstat_buf_load(xstat, fh, DDFS_BUF_RDWR);
+            pthread_mutex_unlock_d(&xstat->xstat_lock);
+            res=ddumb_buffer_flush(fh);
+            if (res<0) break;
+            if (off+sz > xstat->h.size)
+            {
+                xstat->h.size=off+sz;
+                xstat->saved=0;
+            }
+        }
+        else
+        {
+            if (tmp==NULL && (tmp=malloc(ddfs->c_block_size))==NULL)
+            {
+                res=-ENOMEM;
+                break;
+            }
+            res=ddumb_bufvec_copy(tmp, bufv, sz);
+            if (res<0) break;
+            res=_ddumb_write(path, tmp, sz, off, fh);
+            if (res<0) break;
+        }
+        remain-=sz;
+        off+=sz;
+    }
+    if (res>=0 && !xstat->saved) xstat_save_fh(fh);
+
+    xzone_unlock(fh, &zone);
+    pthread_mutex_unlock_d(&fh->lock);
+    free(tmp);
+    hist_add(hist_write, start);
+    return (res<0)?res:size;
+}
+#endif
+
 static int ddumb_statfs(const char *path, struct statvfs *stbuf)
 {
     int res;
@@ -2772,14 +5084,89 @@ static int ddumb_release(const char *path, struct fuse_file_info *fi)
             DDFS_LOG(LOG_ERR, "ddumb_release close() %s (%s)\n", path, strerror(errno));
             return -errno;
         }
-    }
-
-    return res;
+    }
+
+    return res;
+}
+
+/**
+ * sync the BlockFile, the IndexFile and the files of all the requests
+ *
+ * @param batch the list of the requests to commit, their res is updated
+ */
+static void fsync_commit(struct fsync_request *batch)
+{
+    struct fsync_request *req;
+    int res=0;
+
+    // the blocks and the index must reach the disk before the files that
+    // reference them
+    if (fdatasync(ddfs->bfile)==-1) res=-errno;
+    else if (fdatasync(ddfs->ifile)==-1) res=-errno;
+
+    for (req=batch; req; req=req->next)
+    {
+        if (res) req->res=res;
+#ifdef HAVE_FDATASYNC
+        else if (req->isdatasync) req->res=(fdatasync(req->fd)==-1)?-errno:0;
+#endif
+        else req->res=(fsync(req->fd)==-1)?-errno:0;
+    }
+    ddumb_statistic.fsync_commit++;
+}
+
+/**
+ * sync fd with the BlockFile and the IndexFile, the concurrent requests
+ * are grouped in one commit
+ *
+ * The caller takes a ticket and waits until a commit covers it. When no
+ * commit is running, the caller does the commit for all the requests
+ * waiting.
+ *
+ * @param fd the file to sync
+ * @param isdatasync if only the data must be synced
+ * @return 0 for success, -errno for error
+ */
+static int fsync_group(int fd, int isdatasync)
+{
+    struct fsync_request req;
+    long long int ticket;
+
+    req.fd=fd;
+    req.isdatasync=isdatasync;
+    req.res=0;
+
+    pthread_mutex_lock_d(&fsync_mutex);
+    req.next=fsync_pending;
+    fsync_pending=&req;
+    ticket=++fsync_ticket;
+    while (fsync_done<ticket)
+    {
+        if (fsync_running)
+        {   // wait for the running commit, a new one could be required
+            pthread_cond_wait(&fsync_cond, &fsync_mutex);
+            continue;
+        }
+        // do the commit for everybody
+        struct fsync_request *batch=fsync_pending;
+        long long int epoch=fsync_ticket;
+        fsync_pending=NULL;
+        fsync_running=1;
+        pthread_mutex_unlock_d(&fsync_mutex);
+
+        fsync_commit(batch);
+
+        pthread_mutex_lock_d(&fsync_mutex);
+        fsync_done=epoch;
+        fsync_running=0;
+        pthread_cond_broadcast(&fsync_cond);
+    }
+    pthread_mutex_unlock_d(&fsync_mutex);
+    return req.res;
 }
 
 static int ddumb_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
 {
-    int res;
     (void) path;
 
     struct ddumb_fh *fh=ddumb_get_fh(fi);
@@ -2788,23 +5175,7 @@ static int ddumb_fsync(const char *path, int isdatasync, struct fuse_file_info *
 
     _ddumb_flush(fh);
 
-#ifndef HAVE_FDATASYNC
-    (void) isdatasync;
-#else
-    if (isdatasync)
-        res = fdatasync(fh->fd);
-    else
-#endif
-        res = fsync(fh->fd);
-
-    if (res==-1) return -errno;
-#if 1
-    res=fsync(ddfs->bfile);
-    if (res==-1) return -errno;
-    res=fsync(ddfs->ifile);
-    if (res==-1) return -errno;
-#endif
-    return 0;
+    return fsync_group(fh->fd, isdatasync);
 }
 
 #ifdef HAVE_SETXATTR
@@ -2851,6 +5222,34 @@ static int ddumb_lock(const char *path, struct fuse_file_info *fi, int cmd, stru
     return res;
 }
 
+#if FUSE_VERSION >= 28
+/**
+ * handle DDFS_IOC_CLONE, the size cloned is returned in the struct
+ */
+static int ddumb_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data)
+{
+    (void) path;
+    (void) arg;
+
+    if (flags & FUSE_IOCTL_COMPAT) return -ENOSYS;
+#ifdef FUSE_IOCTL_DIR
+    if (flags & FUSE_IOCTL_DIR) return -ENOTTY; // fi is not a ddumb_fh
+#endif
+    if ((unsigned int)cmd!=DDFS_IOC_CLONE) return -ENOTTY;
+
+    struct ddumb_fh *fh=ddumb_get_fh(fi);
+    struct ddfs_clone_range *range=data;
+    range->src[sizeof(range->src)-1]='\0';
+    struct fuse_context *ctx=fuse_get_context();
+    struct ddumb_cred cred;
+    ddumb_cred_init(&cred, ctx->uid, ctx->gid, ctx->pid);
+    long long int res=ddumb_clone(fh, range->src, range->src_offset, range->dst_offset, range->size, &cred);
+    if (res<0) return res;
+    range->size=res;
+    return 0;
+}
+#endif
+
 void *ddumbfs_lockindex(void *ptr)
 {
     // Advise that the index is about to be read sequentially
@@ -2907,11 +5306,13 @@ void *ddumbfs_background(void *ptr)
         if (res==ETIMEDOUT) ddumbfs_save_usedblocks(1000 * (131072 / ddfs->c_block_size));
         else ddumbfs_save_usedblocks(0);
         pthread_mutex_unlock_d(&ifile_mutex);
+        ddumbfs_save_usedblocks_finish();
 
         // reclaim ?
         if (ddfs->usedblock>=ddfs->c_block_count/100*next_reclaim && reclaim_could_find_free_blocks)
         {
             reclaim(NULL);
+            ddumbfs_save_usedblocks_finish();
         }
 
         if (time(NULL)>next_sync)
@@ -2925,8 +5326,11 @@ void *ddumbfs_background(void *ptr)
 		    // Sync the index first
         	    fsync(ddfs->ifile);
 
-		    // Save the used blocks list
+		    // Save the used blocks list, the filesystem is clean only
+		    // when the save is completed
+		    ddumbfs_save_usedblocks_finish();
 		    ddumbfs_save_usedblocks(0);
+		    ddumbfs_save_usedblocks_finish();
 
 		    // Mark the filesystem as clean
 		    ddfs_lock(".autofsck.clean");
@@ -2951,6 +5355,7 @@ void *ddumbfs_background(void *ptr)
 
     }
     pthread_mutex_unlock_d(&ddumb_background_mutex);
+    ddumbfs_save_usedblocks_finish();
     pthread_exit(NULL);
 }
 
@@ -2958,14 +5363,24 @@ void *ddumbfs_background(void *ptr)
 
 pthread_t ddumbfs_socket_pthread;
 
-enum socket_operation_command { sop_noop, sop_open, sop_read, sop_write, sop_fsync, sop_flush, sop_close, sop_dump };
+#define SOCKET_MAX_CLIENTS 64
 
-struct socket_operation
+pthread_mutex_t socket_mutex=PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t socket_cond=PTHREAD_COND_INITIALIZER;
+int socket_clients[SOCKET_MAX_CLIENTS];   // socket of the connected clients, -1 when free
+int socket_clients_n=0;
+
+// the state of one connection to the socket interface
+struct socket_client
 {
-    int command;
-    long long int offset;
-    long long int size;
-    long long int aux;
+    int slot;               // index in socket_clients[]
+    int sock;
+    char *buffer;           // one block for sop_read and sop_write
+    char *shm;              // memory shared with the client, or NULL
+    long long int shm_size;
+    int open;               // fi hold an open file
+    struct fuse_file_info fi;
+    char filename[4096];
 };
 
 ssize_t socket_send(int sockfd, const void *buf, size_t len, int flags)
@@ -3009,187 +5424,412 @@ ssize_t socket_recv(int sockfd, void *buf, size_t len, int flags)
     }
     return len;
 }
+
+/**
+ * receive the file descriptor sent with SCM_RIGHTS along with one byte
+ *
+ * @return the file descriptor or -1
+ */
+static int socket_recv_fd(int sockfd)
+{
+    char byte;
+    struct iovec iov={ &byte, 1 };
+    union { struct cmsghdr cm; char control[CMSG_SPACE(sizeof(int))]; } control;
+    struct msghdr msg;
+    int fd=-1;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov=&iov;
+    msg.msg_iovlen=1;
+    msg.msg_control=control.control;
+    msg.msg_controllen=sizeof(control.control);
+    if (recvmsg(sockfd, &msg, 0)!=1) return -1;
+
+    struct cmsghdr *cmsg=CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level==SOL_SOCKET && cmsg->cmsg_type==SCM_RIGHTS) memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+    return fd;
+}
+
+/**
+ * return the path of the socket, relative to the ddfsroot directory
+ */
+static const char *socket_path()
+{
+    return ddumb_param.socket?ddumb_param.socket:SOCKET_PATH;
+}
+
+/**
+ * serve the requests of one client until it disconnect
+ */
+static void *ddumbfs_socket_client(void *ptr)
+{
+    struct socket_client *cli=ptr;
+    struct socket_operation sop;
+    int n, res, drop=0;
+
+    while (!ddumbfs_terminate)
+    {
+        n=socket_recv(cli->sock, &sop, sizeof(struct socket_operation), 0);
+        if (n<=0) break;
+
+        if (sop.size<0 || ((sop.command==sop_read || sop.command==sop_write) && sop.size>ddfs->c_block_size))
+        {
+            DDFS_LOG(LOG_ERR, "socket: invalid size %lld for operation %d\n", sop.size, sop.command);
+            break;
+        }
+        if (sop.command==sop_noop) continue; // to shutdown cleanly
+
+        res=0;
+        switch (sop.command)
+        {
+            case sop_open:
+                if (sop.size>=sizeof(cli->filename) || socket_recv(cli->sock, cli->filename, sop.size, 0)!=sop.size)
+                {
+                    DDFS_LOG(LOG_ERR, "socket: cannot read filename\n");
+                    drop=1;
+                    break;
+                }
+                cli->filename[sop.size]='\0';
+                if (cli->open)
+                {
+                    ddumb_flush(cli->filename, &cli->fi);
+                    ddumb_release(cli->filename, &cli->fi);
+                    cli->open=0;
+                }
+                cli->fi.flags=sop.offset;
+                if (pathexists(cli->filename+1))
+                {
+                    res=ddumb_open(cli->filename, &cli->fi);
+                }
+                else
+                {
+                    struct fuse_context *ctx=fuse_get_context();
+                    ctx->gid=0;
+                    ctx->uid=0;
+                    res=ddumb_create(cli->filename, sop.aux, &cli->fi);
+                }
+                cli->open=(res==0);
+                DDFS_LOG_DEBUG("socket: open = %d %s\n", res, cli->filename);
+                break;
+            case sop_write:
+                if (socket_recv(cli->sock, cli->buffer, sop.size, 0)!=sop.size)
+                {
+                    DDFS_LOG(LOG_ERR, "socket: short read reading buffer\n");
+                    drop=1;
+                    break;
+                }
+                res=cli->open?ddumb_write(cli->filename, cli->buffer, sop.size, sop.offset, &cli->fi):-EBADF;
+                break;
+            case sop_read:
+                res=cli->open?ddumb_read(cli->filename, cli->buffer, sop.size, sop.offset, &cli->fi):-EBADF;
+                break;
+            case sop_fsync:
+                res=cli->open?ddumb_fsync(cli->filename, sop.offset, &cli->fi):-EBADF;
+                break;
+            case sop_flush:
+                res=cli->open?ddumb_flush(cli->filename, &cli->fi):-EBADF;
+                break;
+            case sop_close:
+                if (cli->open)
+                {
+                    res=ddumb_flush(cli->filename, &cli->fi);
+                    res=ddumb_release(cli->filename, &cli->fi);
+                    cli->open=0;
+                }
+                else res=-EBADF;
+                break;
+            case sop_dump:
+                dump_all();
+                break;
+            case sop_shm:
+            {
+                int fd=socket_recv_fd(cli->sock);
+                if (fd==-1)
+                {
+                    DDFS_LOG(LOG_ERR, "socket: cannot receive shared memory\n");
+                    drop=1;
+                    break;
+                }
+                // access past the end of the file would kill ddumbfs with SIGBUS
+                struct stat st;
+                if (sop.size<=0 || fstat(fd, &st)==-1 || st.st_size<sop.size) res=-EINVAL;
+#ifdef F_SEAL_SHRINK
+                int seals=fcntl(fd, F_GET_SEALS);
+                if (res==0 && (seals==-1 || (seals & F_SEAL_SHRINK)==0)) res=-EPERM;
+#endif
+                if (res)
+                {
+                    DDFS_LOG(LOG_ERR, "socket: shared memory can shrink or is too small\n");
+                    close(fd);
+                    break;
+                }
+                if (cli->shm) munmap(cli->shm, cli->shm_size);
+                cli->shm=mmap(NULL, sop.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                if (cli->shm==MAP_FAILED)
+                {
+                    res=-errno;
+                    cli->shm=NULL;
+                }
+                else cli->shm_size=sop.size;
+                close(fd);
+                break;
+            }
+            case sop_shm_write:
+            case sop_shm_read:
+                // the reply is an int, the size too
+                if (!cli->open) res=-EBADF;
+                else if (cli->shm==NULL || sop.aux<0 || sop.size<0 || sop.size>INT_MAX || sop.aux>cli->shm_size || sop.size>cli->shm_size-sop.aux) res=-EINVAL;
+                else if (sop.command==sop_shm_write)
+                {   // hash the blocks from a private copy, the client can still modify the shm
+                    struct ddumb_fh *fh=ddumb_get_fh(&cli->fi);
+                    fh->shared_buf=1;
+                    res=ddumb_write(cli->filename, cli->shm+sop.aux, sop.size, sop.offset, &cli->fi);
+                    fh->shared_buf=0;
+                }
+                else res=ddumb_read(cli->filename, cli->shm+sop.aux, sop.size, sop.offset, &cli->fi);
+                break;
+            case sop_shm_hashes:
+            {
+                long long int blocks=sop.size>>ddfs->block_size_shift;
+                struct ddumb_fh *fh=ddumb_get_fh(&cli->fi);
+                if (!cli->open || fh->rdonly) res=-EBADF;
+                else if (cli->shm==NULL || sop.aux<0 || blocks<0 || sop.aux>cli->shm_size || blocks>(cli->shm_size-sop.aux)/(ddfs->c_hash_size+1)) res=-EINVAL;
+                else res=ddumb_write_hashes(fh, (unsigned char *)cli->shm+sop.aux, cli->shm+sop.aux+blocks*ddfs->c_hash_size, sop.size, sop.offset);
+                break;
+            }
+            case sop_shm_info:
+            {
+                struct socket_info info;
+                if (cli->shm==NULL || sop.aux<0 || sop.aux>cli->shm_size || sizeof(info)>cli->shm_size-sop.aux) res=-EINVAL;
+                else
+                {
+                    memset(&info, 0, sizeof(info));
+                    info.block_size=ddfs->c_block_size;
+                    info.hash_size=ddfs->c_hash_size;
+                    strncpy(info.hash, ddfs->c_hash, sizeof(info.hash)-1);
+                    memcpy(cli->shm+sop.aux, &info, sizeof(info));
+                }
+                break;
+            }
+            case sop_clone:
+            {
+                struct ddfs_clone_range range;
+                if (sop.size!=sizeof(range) || socket_recv(cli->sock, &range, sizeof(range), 0)!=sizeof(range))
+                {
+                    DDFS_LOG(LOG_ERR, "socket: cannot read clone range\n");
+                    drop=1;
+                    break;
+                }
+                range.src[sizeof(range.src)-1]='\0';
+                struct ucred peer;
+                socklen_t peer_len=sizeof(peer);
+                if (!cli->open) res=-EBADF;
+                else if (getsockopt(cli->sock, SOL_SOCKET, SO_PEERCRED, &peer, &peer_len)==-1) res=-errno;
+                else
+                {   // the source is read with the rights of the client
+                    struct ddumb_cred cred;
+                    ddumb_cred_init(&cred, peer.uid, peer.gid, peer.pid);
+                    long long int len=ddumb_clone(ddumb_get_fh(&cli->fi), range.src, range.src_offset, range.dst_offset, range.size, &cred);
+                    res=(len<0)?len:0;
+                }
+                break;
+            }
+            default:
+                DDFS_LOG(LOG_ERR, "socket: unknown operation %d\n", sop.command);
+                drop=1;
+                break;
+        }
+        if (drop) break; // the stream is out of sync
+
+        if (socket_send(cli->sock, &res, sizeof(res), 0)!=sizeof(res))
+        {
+            DDFS_LOG(LOG_ERR, "socket: short write writing result\n");
+            break;
+        }
+        if (sop.command==sop_read && socket_send(cli->sock, cli->buffer, sop.size, 0)!=sop.size)
+        {
+            DDFS_LOG(LOG_ERR, "socket: short write writing buffer\n");
+            break;
+        }
+    }
+
+    if (cli->open)
+    {
+        ddumb_flush(cli->filename, &cli->fi);
+        ddumb_release(cli->filename, &cli->fi);
+    }
+    if (cli->shm) munmap(cli->shm, cli->shm_size);
+    close(cli->sock);
+    free(cli->buffer);
+
+    pthread_mutex_lock(&socket_mutex);
+    socket_clients[cli->slot]=-1;
+    socket_clients_n--;
+    pthread_cond_signal(&socket_cond);
+    pthread_mutex_unlock(&socket_mutex);
+    free(cli);
+    return NULL;
+}
+
 void *ddumbfs_socket(void *ptr)
 {
 
-    int s_srv, s_cli, len, sz;
+    int s_srv, s_cli, len, i;
     struct sockaddr_un local, remote;
-    char *buffer;
-    struct fuse_file_info fi;
-    char filename[4096];
+    pthread_attr_t attr;
+    pthread_t thread;
 
-    int res=posix_memalign((void *)&buffer, BLOCK_ALIGMENT, ddfs->c_block_size);
-    if (res)
+    for (i=0; i<SOCKET_MAX_CLIENTS; i++) socket_clients[i]=-1;
+
+    if (strlen(socket_path())>=sizeof(local.sun_path))
     {
-        fprintf(stderr,"ERROR: cannot allocate buffer: %s\n", strerror(res));
-        exit(1);
+        DDFS_LOG(LOG_ERR, "socket path is too long: %s\n", socket_path());
+        pthread_exit(NULL);
     }
 
     if ((s_srv = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-        perror("socket");
-        exit(1);
+        DDFS_LOG(LOG_ERR, "socket: %s\n", strerror(errno));
+        pthread_exit(NULL);
     }
 
     local.sun_family = AF_UNIX;
-    strcpy(local.sun_path, SOCKET_PATH);
+    strcpy(local.sun_path, socket_path());
     unlink(local.sun_path);
     len = strlen(local.sun_path) + sizeof(local.sun_family);
     if (bind(s_srv, (struct sockaddr *)&local, len) == -1) {
-        perror("bind");
-        exit(1);
+        DDFS_LOG(LOG_ERR, "socket bind %s: %s\n", local.sun_path, strerror(errno));
+        close(s_srv);
+        pthread_exit(NULL);
     }
 
     if (listen(s_srv, 5) == -1) {
-        perror("listen");
-        exit(1);
+        DDFS_LOG(LOG_ERR, "socket listen: %s\n", strerror(errno));
+        close(s_srv);
+        pthread_exit(NULL);
     }
 
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
     while(!ddumbfs_terminate) {
 
-        fprintf(stderr, "Waiting for a connection...\n");
         socklen_t t = sizeof(remote);
         if ((s_cli = accept(s_srv, (struct sockaddr *)&remote, &t)) == -1) {
-            perror("accept");
-            exit(1);
+            if (errno==EINTR) continue;
+            DDFS_LOG(LOG_ERR, "socket accept: %s\n", strerror(errno));
+            break;
+        }
+        if (ddumbfs_terminate)
+        {   // the connection from ddumb_destroy()
+            close(s_cli);
+            break;
         }
 
-        fprintf(stderr, "Connected.\n");
-        while (!ddumbfs_terminate)
+        struct socket_client *cli=calloc(1, sizeof(struct socket_client));
+        if (cli==NULL || posix_memalign((void *)&cli->buffer, BLOCK_ALIGMENT, ddfs->c_block_size))
         {
-            struct socket_operation sop;
-            int n;
-            n=socket_recv(s_cli, &sop, sizeof(struct socket_operation), 0);
-            if (n<0)
-            {
-                perror("recv");
-                break;
-            }
-            if (n==0) break;
-            switch (sop.command)
+            DDFS_LOG(LOG_ERR, "socket: not enough memory for a new client\n");
+            free(cli);
+            close(s_cli);
+            continue;
+        }
+        cli->sock=s_cli;
+
+        pthread_mutex_lock(&socket_mutex);
+        for (i=0; i<SOCKET_MAX_CLIENTS && socket_clients[i]!=-1; i++) ;
+        if (i<SOCKET_MAX_CLIENTS)
+        {
+            cli->slot=i;
+            socket_clients[i]=s_cli;
+            socket_clients_n++;
+            if (pthread_create(&thread, &attr, ddumbfs_socket_client, cli))
             {
-                case sop_noop:
-                    // to shutdown cleanly
-                    break;
-                case sop_open:
-                    // fprintf(stderr, "socket: open\n");
-                    n=socket_recv(s_cli, &filename, sop.size, 0);
-                    if (n!=sop.size)
-                    {
-                        fprintf(stderr, "short read reading filename\n");
-                        exit(1);
-                    }
-                    fi.flags=sop.offset;
-                    if (pathexists(filename+1))
-                    {
-                        fprintf(stderr, "socket: open %s\n", filename);
-                        res=ddumb_open(filename, &fi);
-                        fprintf(stderr, "socket: open = %d %s\n", res, filename);
-                    }
-                    else
-                    {
-                        struct fuse_context *ctx=fuse_get_context();
-                        ctx->gid=0;
-                        ctx->uid=0;
-                        fprintf(stderr, "socket: create %s\n", filename);
-                        res=ddumb_create(filename, sop.aux, &fi);
-                        struct ddumb_fh *fh=ddumb_get_fh(&fi);
-                        fprintf(stderr, "buf=%p\n", fh->buf);
-                        fh->buf[0]='H';
-                        fprintf(stderr, "socket: create = %d %s\n", res, filename);
-                    }
-                    res=socket_send(s_cli, &res, sizeof(res), 0);
-                    if (res!=sizeof(res))
-                    {
-                        fprintf(stderr, "short write writing res\n");
-                        exit(1);
-                    }
-                    break;
-                case sop_write:
-                    // fprintf(stderr, "socket: write %lld\n", sop.size);
-                    sz=0;
-                    while (sz<sop.size)
-                    {
-                        n=socket_recv(s_cli, buffer+sz, sop.size-sz, 0);
-                        if (n==-1)
-                        {
-                            perror("sop_write, recv error:");
-                            exit(1);
-                        }
-                        sz+=n;
-                    }
-                    res=ddumb_write(filename, buffer, sop.size, sop.offset, &fi);
-                    res=socket_send(s_cli, &res, sizeof(res), 0);
-                    if (res!=sizeof(res))
-                    {
-                        fprintf(stderr, "short write writing buffer\n");
-                        exit(1);
-                    }
-                    break;
-                case sop_read:
-                    // fprintf(stderr, "socket: read %lld\n", sop.size);
-                    res=ddumb_read(filename, buffer, sop.size, sop.offset, &fi);
-                    res=socket_send(s_cli, &res, sizeof(res), 0);
-                    if (res!=sizeof(res))
-                    {
-                        fprintf(stderr, "short write writing buffer\n");
-                        exit(1);
-                    }
-                    sz=0;
-                    while (sz<sop.size)
-                    {
-                        n=socket_send(s_cli, buffer+sz, sop.size-sz, 0);
-                        if (n==-1)
-                        {
-                            perror("sop_read, send error:");
-                            exit(1);
-                        }
-                        sz+=n;
-                    }
-                    break;
-                case sop_fsync:
-                    // fprintf(stderr, "socket: fsync\n");
-                    res=ddumb_fsync(filename, sop.offset, &fi);
-                    res=socket_send(s_cli, &res, sizeof(res), 0);
-                    if (res!=sizeof(res))
-                    {
-                        fprintf(stderr, "socket fsync: short write writing res\n");
-                        exit(1);
-                    }
-                    break;
-                case sop_flush:
-                    // fprintf(stderr, "socket: flush\n");
-                    res=ddumb_flush(filename, &fi);
-                    res=socket_send(s_cli, &res, sizeof(res), 0);
-                    if (res!=sizeof(res))
-                    {
-                        fprintf(stderr, "socket flush: short write writing res\n");
-                        exit(1);
-                    }
-                    break;
-                case sop_close:
-                    // fprintf(stderr, "socket: close\n");
-                    res=ddumb_flush(filename, &fi);
-                    res=ddumb_release(filename, &fi);
-                    res=socket_send(s_cli, &res, sizeof(res), 0);
-                    if (res!=sizeof(res))
-                    {
-                        fprintf(stderr, "socket close: short write writing res\n");
-                        exit(1);
-                    }
-                    break;
-                case sop_dump:
-                    // fprintf(stderr, "socket: dump\n");
-                    dump_all();
-                    res=0;
-                    res=socket_send(s_cli, &res, sizeof(res), 0);
-                    break;
+                socket_clients[i]=-1;
+                socket_clients_n--;
+                i=SOCKET_MAX_CLIENTS;
             }
         }
-        close(s_cli);
+        pthread_mutex_unlock(&socket_mutex);
+        if (i==SOCKET_MAX_CLIENTS)
+        {
+            DDFS_LOG(LOG_ERR, "socket: too many clients, connection refused\n");
+            close(s_cli);
+            free(cli->buffer);
+            free(cli);
+        }
     }
+    pthread_attr_destroy(&attr);
+    close(s_srv);
     pthread_exit(NULL);
 }
+
+/**
+ * stop the socket interface, disconnect the clients and wait for them
+ */
+static void ddumbfs_socket_stop()
+{
+    int s, len, i;
+    struct sockaddr_un remote;
+    struct socket_operation sop;
+
+    // wake up accept()
+    if ((s=socket(AF_UNIX, SOCK_STREAM, 0))!=-1)
+    {
+        remote.sun_family = AF_UNIX;
+        strncpy(remote.sun_path, socket_path(), sizeof(remote.sun_path)-1);
+        remote.sun_path[sizeof(remote.sun_path)-1]='\0';
+        len=strlen(remote.sun_path) + sizeof(remote.sun_family);
+        if (connect(s, (struct sockaddr *)&remote, len)!=-1)
+        {
+            sop.command=sop_noop;
+            socket_send(s, &sop, sizeof(struct socket_operation), 0);
+        }
+        close(s);
+    }
+    pthread_join(ddumbfs_socket_pthread, NULL);
+
+    pthread_mutex_lock(&socket_mutex);
+    for (i=0; i<SOCKET_MAX_CLIENTS; i++) if (socket_clients[i]!=-1) shutdown(socket_clients[i], SHUT_RDWR);
+    while (socket_clients_n>0) pthread_cond_wait(&socket_cond, &socket_mutex);
+    pthread_mutex_unlock(&socket_mutex);
+}
+#endif
+
+/**
+ * adjust the size of the requests to the block size
+ *
+ * fuse and the kernel limit max_write and max_readahead, they can only be
+ * lowered here. A request covering whole blocks is processed by _ddumb_write()
+ * under a single zone lock, a request ending in the middle of a block
+ * leaves a partial block in the buffer that the next request must complete.
+ *
+ * @param conn the connection parameters given to ddumb_init()
+ */
+static void ddumb_negotiate(struct fuse_conn_info *conn)
+{
+    if (conn->max_write>=(unsigned)ddfs->c_block_size)
+    {
+        conn->max_write&=ddfs->block_boundary_mask;
+    }
+    if (conn->max_readahead>=(unsigned)ddfs->c_block_size)
+    {
+        conn->max_readahead&=ddfs->block_boundary_mask;
+    }
+#if FUSE_VERSION >= 29
+    if (conn->max_background==0)
+    {   // not set by the user, the kernel default is only 12
+        conn->max_background=FUSE_MAX_BACKGROUND;
+        conn->congestion_threshold=FUSE_MAX_BACKGROUND*3/4;
+    }
 #endif
+    ddumb_conn=*conn;
+
+    DDFS_LOG(LOG_INFO, "fuse: max_write=%u max_readahead=%u async_read=%u\n", conn->max_write, conn->max_readahead, conn->async_read);
+    if (conn->max_write<(unsigned)ddfs->c_block_size)
+    {
+        DDFS_LOG(LOG_WARNING, "fuse: max_write=%u is smaller than the block size %d, use -o big_writes,max_write=%d\n", conn->max_write, ddfs->c_block_size, ddfs->c_block_size);
+    }
+}
 
 static void* ddumb_init(struct fuse_conn_info *conn)
 {
@@ -3198,7 +5838,13 @@ static void* ddumb_init(struct fuse_conn_info *conn)
     assert(res==0); // TODO: do it better
 
     // reset all stats to 0
-    memset(&ddumb_statistic, 0x00, sizeof(struct ddumb_statistic));
+    statistic_reset();
+
+#if FUSE_VERSION >= 29
+    // splice the replies of ddumb_read_buf() and the requests of ddumb_write_buf()
+    conn->want|=conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_READ);
+#endif
+    ddumb_negotiate(conn);
 
     // lock index component into memory if needed
     if (ddfs->lock_index)
@@ -3210,6 +5856,8 @@ static void* ddumb_init(struct fuse_conn_info *conn)
     // ddfs_save_usedblocks(); // is done by ddumbfs_background at startup
 
     pthread_create(&ddumbfs_background_pthread, NULL, ddumbfs_background, NULL);
+    if (refcount) pthread_create(&ddumbfs_refcount_pthread, NULL, ddumbfs_refcount, NULL);
+    if (journal_fd!=-1) pthread_create(&ddumbfs_journal_pthread, NULL, ddumbfs_journal, NULL);
 
 #ifdef SOCKET_INTERFACE
     pthread_create(&ddumbfs_socket_pthread, NULL, ddumbfs_socket, NULL);
@@ -3247,29 +5895,35 @@ static void ddumb_destroy(void* nothing)
 
     pthread_join(ddumbfs_background_pthread, NULL);
 
+    if (refcount)
+    {
+        pthread_mutex_lock_d(&refcount_mutex);
+        pthread_cond_signal(&refcount_cond);
+        pthread_mutex_unlock_d(&refcount_mutex);
+        pthread_join(ddumbfs_refcount_pthread, NULL);
+    }
+
+    if (journal_fd!=-1)
+    {
+        pthread_mutex_lock_d(&journal_mutex);
+        pthread_cond_signal(&journal_cond);
+        pthread_mutex_unlock_d(&journal_mutex);
+        pthread_join(ddumbfs_journal_pthread, NULL);
+    }
+
     // wait for index lock thread if needed
     if (ddfs->lock_index)
         pthread_join(ddumbfs_lockindex_pthread, NULL);
 #ifdef SOCKET_INTERFACE
-    int s, len;
-    struct sockaddr_un remote;
-    struct socket_operation sop;
-    if ((s=socket(AF_UNIX, SOCK_STREAM, 0))!=-1)
-    {
-        remote.sun_family = AF_UNIX;
-        strcpy(remote.sun_path, SOCKET_PATH);
-        len=strlen(remote.sun_path) + sizeof(remote.sun_family);
-        if (connect(s, (struct sockaddr *)&remote, len)!=-1)
-        {
-            sop.command=sop_noop;
-            socket_send(s, &sop, sizeof(struct socket_operation), 0);
-            close(s);
-        }
-    }
-
-    pthread_join(ddumbfs_socket_pthread, NULL);
+    ddumbfs_socket_stop();
 #endif
     ddfs_close();
+    refcount_close();
+    if (journal_fd!=-1)
+    {   // not needed after a clean umount
+        close(journal_fd);
+        ddfs_journal_remove();
+    }
 
     // ok cleanly unmounted
     ddfs_unlock(".autofsck");
@@ -3388,7 +6042,13 @@ static struct fuse_operations ddumb_ops = {
     .create         = ddumb_create,
     .open           = ddumb_open,
     .read           = ddumb_read,
+#if FUSE_VERSION >= 29
+    .read_buf       = ddumb_read_buf,
+#endif
     .write          = ddumb_write,
+#if FUSE_VERSION >= 29
+    .write_buf      = ddumb_write_buf,
+#endif
     .statfs         = ddumb_statfs,
     .flush          = ddumb_flush,
     .release        = ddumb_release,
@@ -3400,11 +6060,17 @@ static struct fuse_operations ddumb_ops = {
     .removexattr    = ddumb_removexattr,
 #endif
     .lock           = ddumb_lock,
+#if FUSE_VERSION >= 28
+    .ioctl          = ddumb_ioctl,
+#endif
     .init           = ddumb_init,
     .destroy        = ddumb_destroy,
 #if FUSE_VERSION >= 28
     .flag_nullpath_ok = 1,
 #endif
+#if FUSE_VERSION >= 29
+    .flag_nopath = 1,
+#endif
 };
 
 
@@ -3429,6 +6095,13 @@ static const struct fuse_opt ddumb_opts[] = {
         DDUMB_OPT("nodio", direct_io, 0),
         DDUMB_OPT("fuse_default", fuse_default, 1),
         DDUMB_OPT("nofuse_default", fuse_default, 0),
+        DDUMB_OPT("refcount", refcount, 1),
+        DDUMB_OPT("norefcount", refcount, 0),
+        DDUMB_OPT("reclaim_summary", reclaim_summary, 1),
+        DDUMB_OPT("noreclaim_summary", reclaim_summary, 0),
+        DDUMB_OPT("journal", journal, 1),
+        DDUMB_OPT("nojournal", journal, 0),
+        DDUMB_OPT("socket=%s", socket, 0),
 //        DDUMB_OPT("attr_timeout=%lf", attr_timeout, 0), // handled by ddumb_opt_proc() tokeep order of arguments
 
         FUSE_OPT_KEY("-d", KEY_DEBUG),
@@ -3469,6 +6142,10 @@ static int ddumb_opt_proc(void *data, const char *arg, int key, struct fuse_args
                     "    -o [no]fuse_default enable default fuse options* (default on)\n"
                     "    -o check           force filesystem check at startup\n"
                     "    -o reclaim=NUM     a reclaim() is started when disk usage is above this value in %%\n"
+                    "    -o [no]refcount    count block references to free blocks without reclaim (default off)\n"
+                    "    -o [no]reclaim_summary reclaim reuse the block list of the unchanged files (default off)\n"
+                    "    -o [no]journal     journal block allocations to speed up the check after a crash (default off)\n"
+                    "    -o socket=PATH     path of the socket for the native clients (default ../socket, relative to ddfsroot)\n"
                     "\n\n"
                     "    fuse_default_options = \"%s\"\n"
 //                    , outargs->argv[0]
@@ -3589,8 +6266,12 @@ int main(int argc, char *argv[])
 
 
     fprintf(stderr,"hash:      %s\n", ddfs->c_hash);
+    fprintf(stderr,"compress:  %d\n", ddfs->c_compress);
     fprintf(stderr,"direct_io: %d %s\n", ddumb_param.direct_io, ddumb_param.direct_io?(ddumb_param.direct_io==2?"auto":"enable"):"disable");
     fprintf(stderr,"reclaim:   %d\n", ddumb_param.reclaim);
+    fprintf(stderr,"refcount:  %s\n", ddumb_param.refcount?"enable":"disable");
+    fprintf(stderr,"reclaim_summary: %s\n", ddumb_param.reclaim_summary?"enable":"disable");
+    fprintf(stderr,"journal:   %s\n", ddumb_param.journal?"enable":"disable");
     //
     // writers pool
     //
@@ -3635,9 +6316,11 @@ int main(int argc, char *argv[])
     // init xstat root
     xstat_root.root=NULL;
     pthread_mutex_init(&xstat_root.mutex, NULL);
+    pthread_mutex_init(&xstat_cache.mutex, NULL);
     xstat_root.xstat=NULL;
 
     pthread_spin_init(&reclaim_spinlock, 0);
+    block_lock_init();
 
     // force all index block to be read/loaded at statup
     for (i=0; i<ddfs->c_node_block_count; i++)
@@ -3686,5 +6369,27 @@ int main(int argc, char *argv[])
         reclaim_could_find_free_blocks=0;
     }
 
+    if (ddumb_param.refcount && refcount_open())
+    {
+        fprintf(stderr, "ERROR cannot initialize block reference counters\n");
+        return 1;
+    }
+    else if (!ddumb_param.refcount && ddfs_refcount_invalidate()==-1)
+    {   // the counters will miss the references added by this mount
+        perror(REFCOUNT_FILENAME);
+        return 1;
+    }
+
+    if (bit_array_track_dirty(&ddfs->ba_usedblocks))
+    {
+        fprintf(stderr, "WARNING cannot track the modifications of the used block list\n");
+    }
+
+    if (ddumb_param.journal && journal_open())
+    {
+        fprintf(stderr, "ERROR cannot create the journal\n");
+        return 1;
+    }
+
     return fuse_main(args.argc, args.argv, &ddumb_ops, NULL);
 }
@@ -61,6 +61,7 @@ static struct option long_options[] =
        {"rebuild-block",  no_argument,       0, 'R'},
        {"pack",           no_argument,       0, 'k'},
        {"debug",          no_argument,       0, 'd'},
+       {"queue-depth",    required_argument, 0, 'q'},
        {0, 0, 0, 0}
 };
 
@@ -86,15 +87,17 @@ void usage()
             "  -r, --rebuild         re-hash known blocks and build new index (slow)\n"
             "  -R, --rebuild-block   re-hash ALL blocks and build new index (slowest)\n"
             "  -k, --pack            pack the block file. READ the manual before to use this!\n"
+            "  -q, --queue-depth N   number of simultaneous reads when re-hashing blocks\n"
 
     );
 }
 
-enum bb_state { bb_empty, bb_reading, bb_read, bb_hashing, bb_hashed };
+enum bb_state { bb_empty, bb_reading, bb_read, bb_error, bb_hashing, bb_hashed, bb_skipped };
 
 struct blocks_buffer
 {
-	int state;
+	volatile int state;
+	volatile long long int seq;	// position in the ring, identify the block in the buffer
 	char *buffer;
 	blockaddr addr;
 	unsigned char hash[HASH_SIZE];
@@ -102,105 +105,152 @@ struct blocks_buffer
 
 char *pack_buf;
 
+/*
+ * The blocks are read by ddfs_background_reader_count threads, each one
+ * reads a run of consecutive used blocks with one pread() into consecutive
+ * buffers of the ring. The buffers go through the states
+ * empty -> reading -> read -> hashing -> hashed -> empty
+ * (or reading -> error -> skipped -> empty for unreadable blocks and blocks
+ * after the end of the block file) without any lock, each buffer
+ * has a sequence number and ddfs_hash_blocks() process them in sequence.
+ * The sequence numbers are never reset, the hashers can wait for the next
+ * run using the sequence numbers they already got.
+ */
+#define FSCK_READ_RUN_SIZE	1048576		// max size of one read
+#define FSCK_QUEUE_DEPTH	4		// default number of simultaneous reads
+
 struct blocks_buffer *blocks_buffers=NULL;
-pthread_t ddfs_background_reader_thread;
+char *blocks_area=NULL;
+pthread_t *ddfs_background_reader_threads;
 pthread_t *ddfs_background_hasher_threads;
-pthread_mutex_t ddfs_background_mutex=PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t ddfs_background_mutex=PTHREAD_MUTEX_INITIALIZER;	// protect the run start and the scan of the bit array
 pthread_cond_t ddfs_background_ba_ready=PTHREAD_COND_INITIALIZER;
-pthread_cond_t ddfs_background_empty_ready=PTHREAD_COND_INITIALIZER;
-pthread_cond_t ddfs_background_read_ready=PTHREAD_COND_INITIALIZER;
-pthread_cond_t ddfs_background_hash_ready=PTHREAD_COND_INITIALIZER;
 int ddfs_background_buf_count=-1;
 int ddfs_background_hasher_count=-1;
-int ddfs_background_empty;
-int ddfs_background_read;
-int ddfs_background_hashed;
-int ddfs_background_next_empty;
-int ddfs_background_next_read;
-int ddfs_background_next_hashed;
-int ddfs_background_read_done=0;
+int ddfs_background_reader_count=-1;
+int ddfs_background_run_blocks;		// max number of blocks in one read
+int ddfs_background_run=0;		// incremented at each new run
+int ddfs_background_readers;		// number of readers still working on the current run
+long long int ddfs_background_head=0;	// next sequence to reserve by readers
+long long int ddfs_background_hash_next=0;	// next sequence to hash
+long long int ddfs_background_tail=0;	// next sequence to process
+volatile int ddfs_background_read_done=1;
+int ddfs_background_eof;
 long long int ddfs_background_read_error;
+long long int ddfs_background_read_bytes;
 long long int ddfs_background_block_count;
 struct bit_array *ddfs_background_ba=NULL;
-long long int ddfs_background_ba_start;
+blockaddr ddfs_background_next_addr;	// next address to read, -1 at the end
+
+/**
+ * mark the buffers of a run that cannot be read, the hashers will skip them
+ *
+ * @param seq the sequence of the first buffer
+ * @param count the number of buffers
+ */
+static void ddfs_background_read_failed(long long int seq, int count)
+{
+	int i;
+	__sync_synchronize();
+	for (i=0; i<count; i++) blocks_buffers[(seq+i)%ddfs_background_buf_count].state=bb_error;
+}
 
 /**
  * Read the block file in background and load buffers
  */
 void *ddfs_background_reader(void *ptr)
 {
+	int run=0;
 
 	while (1)
 	{
 		pthread_mutex_lock(&ddfs_background_mutex);
-		while (ddfs_background_ba==NULL) pthread_cond_wait(&ddfs_background_ba_ready, &ddfs_background_mutex);
+		while (ddfs_background_run==run) pthread_cond_wait(&ddfs_background_ba_ready, &ddfs_background_mutex);
+		run=ddfs_background_run;
 		struct bit_array *ba=ddfs_background_ba;
-		ddfs_background_ba=NULL;
-		pthread_mutex_unlock(&ddfs_background_mutex);
 
-		blockaddr addr=bit_array_search_first_set(ba, ddfs_background_ba_start);
-		while (addr>0)
+		while (ddfs_background_next_addr>0 && !ddfs_background_eof)
 		{
-	//		DDFS_LOG(LOG_NOTICE, "reader addr=%lld\n", addr);
-			// search an empty block
-			pthread_mutex_lock(&ddfs_background_mutex);
-			while (ddfs_background_empty==0) pthread_cond_wait(&ddfs_background_empty_ready, &ddfs_background_mutex);
-			while (blocks_buffers[ddfs_background_next_empty].state!=bb_empty) ddfs_background_next_empty=(ddfs_background_next_empty+1)%ddfs_background_buf_count;
-
-			struct blocks_buffer *bb=blocks_buffers+ddfs_background_next_empty;
-			bb->state=bb_reading;
-			bb->addr=addr;
-			ddfs_background_empty--;
+			// reserve a run of used blocks and the buffers to read them,
+			// the buffers must be consecutive in memory
+			blockaddr addr=ddfs_background_next_addr;
+			long long int seq=ddfs_background_head;
+			int first=seq%ddfs_background_buf_count;
+			int count=1;
+			while (count<ddfs_background_run_blocks && first+count<ddfs_background_buf_count
+					&& addr+count<ba->size && bit_array_get(ba, addr+count)) count++;
+
+			int spin=0;
+			while (seq+count>ddfs_background_tail+ddfs_background_buf_count) ddfs_spin_pause(&spin);
+
+			int i;
+			for (i=0; i<count; i++)
+			{
+				struct blocks_buffer *bb=blocks_buffers+first+i;
+				bb->addr=addr+i;
+				bb->seq=seq+i;
+				__sync_synchronize();
+				bb->state=bb_reading;
+			}
+			ddfs_background_head=seq+count;
+			ddfs_background_next_addr=bit_array_search_first_set(ba, addr+count);
 			pthread_mutex_unlock(&ddfs_background_mutex);
-			ddfs_background_next_empty=(ddfs_background_next_empty+1)%ddfs_background_buf_count;
-			int len=pread(ddfs->bfile_ro, bb->buffer, ddfs->c_block_size, addr<<ddfs->block_size_shift);
-			if (len!=ddfs->c_block_size)
+
+			int size=count*ddfs->c_block_size;
+			int done=0;
+			int len=0;
+			char *buffer=blocks_buffers[first].buffer;
+			while (done<size)
+			{
+				len=pread(ddfs->bfile_ro, buffer+done, size-done, (addr<<ddfs->block_size_shift)+done);
+				if (len<=0) break;
+				done+=len;
+			}
+			if (done>0) __sync_add_and_fetch(&ddfs_background_read_bytes, done);
+
+			int full=done/ddfs->c_block_size;
+			__sync_synchronize();
+			for (i=0; i<full; i++) blocks_buffers[first+i].state=bb_read;
+
+			if (full<count)
 			{
-				pthread_mutex_lock(&ddfs_background_mutex);
-				bb->state=bb_empty;
-				ddfs_background_empty++;
-				pthread_mutex_unlock(&ddfs_background_mutex);
+				blockaddr err_addr=addr+full;
 				if (len==-1)
 				{
-					ddfs_background_read_error++;
+					__sync_add_and_fetch(&ddfs_background_read_error, count-full);
 					if (!check_flag)
 					{
-						DDFS_LOG(LOG_ERR, "block %lld, cannot read: %s\n", addr, strerror(errno));
+						DDFS_LOG(LOG_ERR, "block %lld, cannot read: %s\n", err_addr, strerror(errno));
 					}
-					else if (verbose_flag) printf("block %lld, cannot read: %s\n", addr, strerror(errno));
+					else if (verbose_flag) printf("block %lld, cannot read: %s\n", err_addr, strerror(errno));
+					ddfs_background_read_failed(seq+full, count-full);
 				}
-				else if (len!=0)
-				{
-					ddfs_background_read_error++;
-					if(!check_flag)
+				else
+				{	// EOF, a partial block is an error
+					if (done%ddfs->c_block_size)
 					{
-						DDFS_LOG(LOG_ERR, "block %lld, cannot read: %d/%d\n", addr, len, ddfs->c_block_size);
+						__sync_add_and_fetch(&ddfs_background_read_error, 1);
+						if(!check_flag)
+						{
+							DDFS_LOG(LOG_ERR, "block %lld, cannot read: %d/%d\n", err_addr, done%ddfs->c_block_size, ddfs->c_block_size);
+						}
+						else if (verbose_flag) printf("block %lld, cannot read: %d/%d\n", err_addr, done%ddfs->c_block_size, ddfs->c_block_size);
+						ddfs_background_read_failed(seq+full, 1);
+						full++;
 					}
-					else if (verbose_flag) printf("block %lld, cannot read: %d/%d\n", addr, len, ddfs->c_block_size);
-				}
-				else // len==0
-				{ // EOF
-					//DDFS_LOG(LOG_NOTICE, "reader EOF addr=%lld\n", addr);
-					break;
+					ddfs_background_read_failed(seq+full, count-full);
+					ddfs_background_eof=1;
 				}
 			}
-			else
-			{
-				pthread_mutex_lock(&ddfs_background_mutex);
-				bb->state=bb_read;
-				ddfs_background_read++;
-				pthread_cond_signal(&ddfs_background_read_ready);
-				pthread_mutex_unlock(&ddfs_background_mutex);
-			}
-			addr=bit_array_search_first_set(ba, addr+1);
-			// DDFS_LOG(LOG_NOTICE, "reader ba=0x%x %x\n", ddfs->ba_usedblocks.array[0], ddfs->ba_usedblocks.array[1]);
+			pthread_mutex_lock(&ddfs_background_mutex);
 		}
-		// DDFS_LOG(LOG_NOTICE, "reader END addr=%lld\n", addr);
 
-		// Wake up main thread and warn about the end
-		pthread_mutex_lock(&ddfs_background_mutex);
-		ddfs_background_read_done=1;
-		pthread_cond_signal(&ddfs_background_hash_ready);
+		// Warn the main thread about the end
+		if (--ddfs_background_readers==0)
+		{
+			__sync_synchronize();
+			ddfs_background_read_done=1;
+		}
 		pthread_mutex_unlock(&ddfs_background_mutex);
 	}
     pthread_exit(NULL);
@@ -214,27 +264,41 @@ void *ddfs_background_hasher(void *ptr)
 //    DDFS_LOG(LOG_NOTICE, "start ddfs_background_hasher\n");
     while (1)
     {
-        // search an empty block
-        pthread_mutex_lock(&ddfs_background_mutex);
-        while (ddfs_background_read==0) pthread_cond_wait(&ddfs_background_read_ready, &ddfs_background_mutex);
-        while (blocks_buffers[ddfs_background_next_read].state!=bb_read) ddfs_background_next_read=(ddfs_background_next_read+1)%ddfs_background_buf_count;
-
-        struct blocks_buffer *bb=blocks_buffers+ddfs_background_next_read;
-        bb->state=bb_hashing;
-        ddfs_background_read--;
-        ddfs_background_next_read=(ddfs_background_next_read+1)%ddfs_background_buf_count; // must be in the lock, because multiple hash
-        pthread_mutex_unlock(&ddfs_background_mutex);
-        ddfs_hash(bb->buffer, bb->hash);
-        pthread_mutex_lock(&ddfs_background_mutex);
-        bb->state=bb_hashed;
-        ddfs_background_hashed++;
-        pthread_cond_signal(&ddfs_background_hash_ready);
-        pthread_mutex_unlock(&ddfs_background_mutex);
+        long long int seq=__sync_fetch_and_add(&ddfs_background_hash_next, 1);
+        struct blocks_buffer *bb=blocks_buffers+seq%ddfs_background_buf_count;
+        int spin=0;
+        while (1)
+        {
+            if (bb->seq==seq)
+            {
+                __sync_synchronize();
+                if (__sync_bool_compare_and_swap(&bb->state, bb_read, bb_hashing))
+                {
+                    // a corrupted compressed block is hashed as is and don't match its hash
+                    if (ddfs->c_compress) ddfs_decode_block(bb->addr, bb->buffer, bb->buffer);
+                    ddfs_hash(bb->buffer, bb->hash);
+                    __sync_synchronize();
+                    bb->state=bb_hashed;
+                    break;
+                }
+                if (__sync_bool_compare_and_swap(&bb->state, bb_error, bb_skipped)) break;
+            }
+            ddfs_spin_pause(&spin);
+        }
     }
     pthread_exit(NULL);
 }
 
-int ddfs_background_init(int buf_count, int hasher_count)
+/**
+ * start the reader and hasher threads
+ *
+ * @param buf_count the number of buffers in the ring
+ * @param hasher_count the number of hasher threads
+ * @param reader_count the number of reader threads, this is the number of
+ *        simultaneous reads
+ * @return 0 for success, -1 for error
+ */
+int ddfs_background_init(int buf_count, int hasher_count, int reader_count)
 {
 	//  DDFS_LOG(LOG_NOTICE, "start ddfs_background_init\n");
 	int i;
@@ -245,7 +309,8 @@ int ddfs_background_init(int buf_count, int hasher_count)
 	}
 
 	blocks_buffers=malloc(buf_count*sizeof(struct blocks_buffer));
-	if (blocks_buffers==NULL)
+	blocks_area=malloc((long long int)buf_count*ddfs->c_block_size);
+	if (blocks_buffers==NULL || blocks_area==NULL)
 	{
 		DDFS_LOG(LOG_ERR, "cannot allocate %d background buffers\n", buf_count);
 		return -1;
@@ -253,16 +318,22 @@ int ddfs_background_init(int buf_count, int hasher_count)
 
 	for(i=0; i<buf_count; i++)
 	{
-		blocks_buffers[i].buffer=malloc(ddfs->c_block_size);
-		if (blocks_buffers[i].buffer==NULL)
-		{
-			DDFS_LOG(LOG_ERR, "cannot allocate %d/%d background buffers\n", i+1, buf_count);
-			return -1;
-		}
+		blocks_buffers[i].buffer=blocks_area+(long long int)i*ddfs->c_block_size;
+		blocks_buffers[i].state=bb_empty;
+		blocks_buffers[i].seq=-1;
 	}
 
+	ddfs_background_buf_count=buf_count;
+	ddfs_background_hasher_count=hasher_count;
+	ddfs_background_reader_count=reader_count;
+	ddfs_background_run_blocks=FSCK_READ_RUN_SIZE/ddfs->c_block_size;
+	if (ddfs_background_run_blocks>buf_count/(2*reader_count)) ddfs_background_run_blocks=buf_count/(2*reader_count);
+	if (ddfs_background_run_blocks<1) ddfs_background_run_blocks=1;
+	ddfs_background_ba=NULL;
+
 	ddfs_background_hasher_threads=malloc(hasher_count*sizeof(pthread_t));
-	if (ddfs_background_hasher_threads==NULL)
+	ddfs_background_reader_threads=malloc(reader_count*sizeof(pthread_t));
+	if (ddfs_background_hasher_threads==NULL || ddfs_background_reader_threads==NULL)
 	{
 		DDFS_LOG(LOG_ERR, "cannot allocate the thread list\n");
 		return -1;
@@ -277,36 +348,46 @@ int ddfs_background_init(int buf_count, int hasher_count)
 	    }
 	}
 
-	ddfs_background_buf_count=buf_count;
-	ddfs_background_hasher_count=hasher_count;
-	ddfs_background_ba=NULL;
-
-	if (pthread_create(&ddfs_background_reader_thread, NULL, ddfs_background_reader, NULL))
-    {
-		DDFS_LOG(LOG_ERR, "cannot allocate reader threads\n");
-    	return -1;
-    }
+	for(i=0; i<reader_count; i++)
+	{
+	    if (pthread_create(ddfs_background_reader_threads+i, NULL, ddfs_background_reader, NULL))
+	    {
+			DDFS_LOG(LOG_ERR, "cannot allocate reader threads\n");
+	    	return -1;
+	    }
+	}
 
 	return 0;
 }
 
 void ddfs_background_start(struct bit_array *ba, long long int ba_start)
 {
-	int i;
 	ddfs_background_read_error=0;
-	ddfs_background_read_done=0;
-	ddfs_background_empty=ddfs_background_buf_count;
-	ddfs_background_read=ddfs_background_hashed=0;
-	ddfs_background_next_empty=ddfs_background_next_read=ddfs_background_next_hashed=0;
+	ddfs_background_read_bytes=0;
 	ddfs_background_block_count=0;
-	for(i=0; i<ddfs_background_buf_count; i++) blocks_buffers[i].state=bb_empty;
 	pthread_mutex_lock(&ddfs_background_mutex);
 	ddfs_background_ba=ba;
-	ddfs_background_ba_start=ba_start;
-	pthread_cond_signal(&ddfs_background_ba_ready);
+	ddfs_background_next_addr=bit_array_search_first_set(ba, ba_start);
+	ddfs_background_eof=0;
+	ddfs_background_readers=ddfs_background_reader_count;
+	ddfs_background_read_done=0;
+	ddfs_background_run++;
+	pthread_cond_broadcast(&ddfs_background_ba_ready);
 	pthread_mutex_unlock(&ddfs_background_mutex);
 }
 
+/**
+ * return the read throughput of the current run in MB/s
+ *
+ * @param start the time the run started, see now()
+ */
+double ddfs_background_throughput(long long int start)
+{
+	long long int elapsed=now()-start;
+	if (elapsed<=0) return 0.0;
+	return ddfs_background_read_bytes*1.0*NOW_PER_SEC/elapsed/(1024*1024);
+}
+
 /*
  * Hash all block in 'ba' and call 'bb_process'() with the hashed result
  * reading and hashing are done by threads in background
@@ -333,46 +414,39 @@ int ddfs_hash_blocks(struct bit_array* ba, long long int ba_start, int (*bb_proc
         if (progress_flag && now()-last>NOW_PER_SEC)
         {
 			last=now();
-			printf("block %5.1f%% in %llds\r", i*100.0/block_count, (last-start)/NOW_PER_SEC);
+			printf("block %5.1f%% in %llds %.1fMB/s\r", i*100.0/block_count, (last-start)/NOW_PER_SEC, ddfs_background_throughput(start));
 			fflush(stdout);
         }
 
-        // search an empty block
-        pthread_mutex_lock(&ddfs_background_mutex);
-        while (ddfs_background_hashed==0)
+        // wait for the next block
+        long long int seq=ddfs_background_tail;
+        struct blocks_buffer *bb=blocks_buffers+seq%ddfs_background_buf_count;
+        int spin=0;
+        while (bb->seq!=seq || (bb->state!=bb_hashed && bb->state!=bb_skipped))
         {
-        	if (ddfs_background_read_done && ddfs_background_empty==ddfs_background_buf_count)
-        	{
-        		pthread_mutex_unlock(&ddfs_background_mutex);
-        		return 0;
-        	}
-        	pthread_cond_wait(&ddfs_background_hash_ready, &ddfs_background_mutex);
-            //DDFS_LOG(LOG_NOTICE, "ddfs_background_read_done=%d  ddfs_background_hashed=%d ddfs_background_empty=%d!\n",ddfs_background_read_done, ddfs_background_hashed, ddfs_background_empty);
+            if (ddfs_background_read_done)
+            {
+                __sync_synchronize();
+                if (ddfs_background_head==seq) return 0;
+            }
+            ddfs_spin_pause(&spin);
         }
+        __sync_synchronize();
 
-        while (blocks_buffers[ddfs_background_next_hashed].state!=bb_hashed) ddfs_background_next_hashed=(ddfs_background_next_hashed+1)%ddfs_background_buf_count;
-
-        struct blocks_buffer *bb=blocks_buffers+ddfs_background_next_hashed;
-		// bb->state=bb_indexing;
-        ddfs_background_hashed--;
-        pthread_mutex_unlock(&ddfs_background_mutex);
-        ddfs_background_next_hashed=(ddfs_background_next_hashed+1)%ddfs_background_buf_count;
-
-        ddfs_background_block_count++;
-        if (bb_process(bb, ctx))
+        if (bb->state==bb_hashed)
         {
-			// TODO: I should cleanly terminate all threads, hopefully functions are called only once
-        	return 1;
+            ddfs_background_block_count++;
+            if (bb_process(bb, ctx))
+            {
+                // TODO: I should cleanly terminate all threads, hopefully functions are called only once
+                return 1;
+            }
+            i++;
         }
 
-        pthread_mutex_lock(&ddfs_background_mutex);
         bb->state=bb_empty;
-        ddfs_background_empty++;
-        pthread_cond_signal(&ddfs_background_empty_ready);
-
-        pthread_mutex_unlock(&ddfs_background_mutex);
-
-        i++;
+        __sync_synchronize();
+        ddfs_background_tail=seq+1;
     }
 	return 0;
 }
@@ -554,7 +628,7 @@ int bb_check_hash(struct blocks_buffer *bb, void *ctx)
 
     if (0==memcmp(bb->hash, ddfs->zero_block_hash, ddfs->c_hash_size))
     {
-        ddfs_background_read_error++;
+        __sync_add_and_fetch(&ddfs_background_read_error, 1);
         if (verbose_flag) printf("block %lld is the zero block, should not be referenced by a node\n", bb->addr);
     }
     else
@@ -837,7 +911,7 @@ int ddfs_check(int chk_block)
         errors_in_block=ddfs_background_read_error;
         end=now();
         if (errors_in_block<0) return 1;
-        printf("== Checked %lld blocks in %.1fs\n", block_in_index, (end-start)*1.0/NOW_PER_SEC);
+        printf("== Checked %lld blocks in %.1fs (%.1fMB/s)\n", block_in_index, (end-start)*1.0/NOW_PER_SEC, ddfs_background_throughput(start));
 
         bit_array_count(&na_node_to_check, &block_unmatching, &u);
         printf("== Check unmatching %lld block\n", block_unmatching);
@@ -1047,7 +1121,7 @@ int ddfs_rebuild(int all_blocks)
     if (res) return 1;
 
     DDFS_LOG(LOG_INFO, "Read errors: %lld\n", ddfs_background_read_error);
-    DDFS_LOG(LOG_INFO, "Read, hashed and updated index for %lld blocks in %.1fs\n", ddfs_background_block_count, (end-start)*1.0/NOW_PER_SEC);
+    DDFS_LOG(LOG_INFO, "Read, hashed and updated index for %lld blocks in %.1fs (%.1fMB/s)\n", ddfs_background_block_count, (end-start)*1.0/NOW_PER_SEC, ddfs_background_throughput(start));
 
     //
     // update files regarding new index
@@ -1215,6 +1289,7 @@ int pack()
 	int buffer_size=4*1048576;
 	int buffer_off=0;
 	char *buffer;
+	char *raw;  // the slots in buffer stored as is that look compressed
 	int res=0;
 
 	fprintf(stderr, "Pack\n");
@@ -1224,7 +1299,8 @@ int pack()
     if (to_move==0) goto TRUNCATE;
 
 	buffer=malloc(buffer_size);
-	if (buffer==NULL)
+	raw=malloc(buffer_size/ddfs->c_block_size);
+	if (buffer==NULL || raw==NULL)
 	{
 		perror("malloc pack buffer");
 		return 1;
@@ -1250,6 +1326,7 @@ int pack()
         blockaddr addr=used_idx;
         // No direct_io on 'bfile_ro'
 		int len=pread(ddfs->bfile_ro, buffer+buffer_off, ddfs->c_block_size, addr<<ddfs->block_size_shift);
+		raw[buffer_off/ddfs->c_block_size]=ddfs_rawzblock_get(addr);
 		if (len!=ddfs->c_block_size)
 		{
 			if (len==-1)
@@ -1278,7 +1355,18 @@ int pack()
 				addr=free_idx;
 		        // buffer must be aligned when using direct_io, then use double buffering
 		        memcpy(ddfs->aux_buffer, buffer+off, ddfs->c_block_size);
-		        int len=pwrite(ddfs->bfile, ddfs->aux_buffer, ddfs->c_block_size, addr<<ddfs->block_size_shift);
+		        // the slot is moved as is, compressed or not
+		        int rawz=raw[off/ddfs->c_block_size];
+		        int len=0;
+		        if (ddfs->c_compress && rawz!=ddfs_rawzblock_get(addr)) len=ddfs_rawzblock_set(addr, rawz);
+		        int size=ddfs->c_compress?ddfs_slot_size(addr, ddfs->aux_buffer):ddfs->c_block_size;
+		        if (len==0) len=pwrite(ddfs->bfile, ddfs->aux_buffer, size, addr<<ddfs->block_size_shift);
+		        else
+		        {
+		            errno=-len;
+		            len=-1;
+		        }
+		        if (len==size && size<ddfs->c_block_size) ddfs_punch_block(addr, size);
 		        count++;
 		        if (progress_flag && now()-last>NOW_PER_SEC)
 				{
@@ -1287,7 +1375,7 @@ int pack()
 					fflush(stdout);
 				}
 
-		        if (len!=ddfs->c_block_size)
+		        if (len!=size)
 				{
 					if (len==-1)
 					{
@@ -1295,7 +1383,7 @@ int pack()
 					}
 					else
 					{
-						fprintf(stderr, "block %lld, cannot write: %d/%d\n", addr, len, ddfs->c_block_size);
+						fprintf(stderr, "block %lld, cannot write: %d/%d\n", addr, len, size);
 					}
 				}
 		        free_idx=bit_array_search_first_unset(&ddfs->ba_usedblocks, free_idx+1);
@@ -1340,6 +1428,7 @@ int pack()
     bit_array_reset_zone(&ddfs->ba_usedblocks, used_block, ddfs->c_block_count-1, 0);
 
     free(buffer);
+    free(raw);
 
 TRUNCATE:
 	if (!ddfs->bfile_isblk)
@@ -1371,6 +1460,7 @@ int main(int argc, char *argv[])
     int normal_relaxed_flag=0;
     int rebuild_flag=0;
     int rebuild_block_flag=0;
+    int queue_depth=FSCK_QUEUE_DEPTH;
 
     ddfs=&ddfsctx;
     while (1)
@@ -1378,7 +1468,7 @@ int main(int argc, char *argv[])
         // getopt_long stores the option index here.
         int option_index=0;
 
-        c=getopt_long(argc, argv, "hvlfpcCnNrRdk", long_options, &option_index);
+        c=getopt_long(argc, argv, "hvlfpcCnNrRdkq:", long_options, &option_index);
 
         // Detect the end of the options.
         if (c==-1) break;
@@ -1435,6 +1525,15 @@ int main(int argc, char *argv[])
                 ddfs_debug=1;
                 break;
 
+            case 'q':
+                queue_depth=atoi(optarg);
+                if (queue_depth<1)
+                {
+                    fprintf(stderr, "invalid queue depth: %s\n", optarg);
+                    return 1;
+                }
+                break;
+
             case '?':
                 // getopt_long already printed an error message.
                 break;
@@ -1494,11 +1593,11 @@ int main(int argc, char *argv[])
     {
     	int cpu=ddfs_cpu_count();
     	if (cpu<=0) cpu=2;
-    	// read at least 1Mo in buffers
-    	int buffers=1048576/ddfs->c_block_size;
+    	// enough buffers for all the reads in progress and for the hashers
+    	int buffers=2*queue_depth*(FSCK_READ_RUN_SIZE/ddfs->c_block_size);
     	if (2+2*cpu>buffers) buffers=2+2*cpu;
-        if (ddfs_background_init(buffers, cpu)) return 1;
-        printf("started %d hashing thread(s)\n", cpu);
+        if (ddfs_background_init(buffers, cpu, queue_depth)) return 1;
+        printf("started %d hashing thread(s) and %d reading thread(s)\n", cpu, queue_depth);
     }
 
     if (check_flag || check_block_flag)
@@ -1508,7 +1607,9 @@ int main(int argc, char *argv[])
     else if (rebuild_flag || rebuild_block_flag)
     {
         ddfs_lock(".autofsck"); // I don't care if it works or not
+        if (ddfs_refcount_invalidate()==-1) perror(REFCOUNT_FILENAME);
         if (ddfs_lock(".rebuildfsck")) perror(".rebuildfsck");
+        ddfs_journal_remove(); // the index is rebuilt from scratch
         res=ddfs_rebuild(rebuild_block_flag);
         if (0==res)
         {
@@ -1523,6 +1624,7 @@ int main(int argc, char *argv[])
     else if (normal_flag || normal_relaxed_flag)
     {
         ddfs_lock(".autofsck"); // I don't care if it works or not
+        if (ddfs_refcount_invalidate()==-1) perror(REFCOUNT_FILENAME);
         res=ddfs_fsck(normal_relaxed_flag, verbose_flag, progress_flag);
         if (0==res)
         {
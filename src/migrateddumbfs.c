@@ -126,6 +126,22 @@ int ddfs_index_migrate(struct ddfs_ctx *src, struct ddfs_ctx *dst)
         node_idx=bit_array_search_first_set(&src->ba_usedblocks, node_idx+1);
     }
 
+    // the block file is shared, copy the list of the blocks stored as is
+    if (src->rawzblocks_fd!=-1 && dst->rawzblocks_fd!=-1)
+    {
+        ddfs=dst;
+        node_idx=bit_array_search_first_set(&src->ba_rawzblocks, 0);
+        while (node_idx>=0)
+        {
+            if (ddfs_rawzblock_set(node_idx, 1))
+            {
+                perror(DDFS_RAWZBLOCKS_FILENAME);
+                return 1;
+            }
+            node_idx=bit_array_search_first_set(&src->ba_rawzblocks, node_idx+1);
+        }
+    }
+
     return 0;
 }
 
@@ -379,6 +395,12 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if (ddfs_refcount_invalidate()==-1)
+    {
+        fprintf(stderr, "cannot remove %s (%s)\n", REFCOUNT_FILENAME, strerror(errno));
+        return 1;
+    }
+
     ddfs=&ddfs_src;
     printf("mounting source: %s\n", pdir_src);
     if (ddfs_loadcfg(pdir_src, NULL))
@@ -405,6 +427,13 @@ int main(int argc, char *argv[])
         res=1;
         goto END;
     }
+
+    if ((ddfs_src.c_compress==0)!=(ddfs_dst.c_compress==0))
+    {
+        printf("compression mismatch !\n");
+        res=1;
+        goto END;
+    }
     // compare used block
     long long int src_block_count, src_block_free;
     long long int dst_block_count, dst_block_free;
@@ -427,7 +456,8 @@ int main(int argc, char *argv[])
     }
 
     printf("== migrating index\n");
-    ddfs_index_migrate(&ddfs_src, &ddfs_dst);
+    res=ddfs_index_migrate(&ddfs_src, &ddfs_dst);
+    if (res) goto END;
 
     printf("migrating free block list\n");
 
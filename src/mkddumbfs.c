@@ -55,6 +55,7 @@ static struct option long_options[] =
        {"size",         required_argument, 0, 's'},
        {"block-size",   required_argument, 0, 'B'},
        {"overflow",     required_argument, 0, 'o'},
+       {"compress",     required_argument, 0, 'z'},
        {0, 0, 0, 0}
 };
 
@@ -64,6 +65,7 @@ char *hash_name="TIGER";
 long long int partition_size=0;
 int block_size=131072;
 float overflow=1.3;
+int compress_level=0;
 off_t ALLOCATIONGRANULARITY=65536; // max(linux.mmap.ALLOCATIONGRANULARITY, windows.mmap.ALLOCATIONGRANULARITY)
 
 off_t boundary_align(off_t addr, off_t granularity)
@@ -97,7 +99,7 @@ int tree_delete(const char *fpath, const struct stat *sb, int typeflag, struct F
     return 0;
 }
 
-int init(char *parent_dir, char* blockfile, char *indexfile, long long int partition_size, int block_size, double overflow, const char *hash, int reuse_asap)
+int init(char *parent_dir, char* blockfile, char *indexfile, long long int partition_size, int block_size, double overflow, const char *hash, int reuse_asap, int compress_level)
 {
     int res, len, i;
 
@@ -114,6 +116,7 @@ int init(char *parent_dir, char* blockfile, char *indexfile, long long int parti
     ddfs->c_reuse_asap=reuse_asap;
     ddfs->c_auto_buffer_flush=60;
     ddfs->c_auto_sync=120;
+    ddfs->c_compress=compress_level;
     ddfs->c_index_block_size=INDEX_BLOCK_SIZE;
     ddfs->c_file_header_size=FILE_HEADER_SIZE;
 
@@ -488,6 +491,10 @@ int init(char *parent_dir, char* blockfile, char *indexfile, long long int parti
             case 'I':
                 fprintf(cfgfile,"%s: %d\n", c->name, *(int*)p);
                 break;
+            case 'i':
+                // optional, don't write the default
+                if (*(int*)p) fprintf(cfgfile,"%s: %d\n", c->name, *(int*)p);
+                break;
             case 'L':
                 fprintf(cfgfile,"%s: %lld\n", c->name, *(long long int*)p);
                 break;
@@ -537,10 +544,14 @@ void usage()
             "                        the block size (default is 128k)\n"
             "  -o OVERFLOW, --overflow=OVERFLOW\n"
             "                        the overflow factor (default is 1.3)\n"
+            "  -z LEVEL, --compress=LEVEL\n"
+            "                        compress the blocks with zlib, LEVEL is between 1\n"
+            "                        (fast) and 9 (best), default is no compression\n"
             "\nSamples:\n"
             "  mkddumbfs -s 20G -a /data/ddumbfs\n"
             "  mkddumbfs -s 20G -a -B 64k /data/ddumbfs\n"
             "  mkddumbfs -b /dev/sdb3 /data/ddumbfs\n"
+            "  mkddumbfs -s 20G -z 1 /data/ddumbfs\n"
     );
 }
 
@@ -557,7 +568,7 @@ int main(int argc, char *argv[])
         // getopt_long stores the option index here.
         int option_index = 0;
 
-        c=getopt_long(argc, argv, "hvfai:b:H:s:B:o:", long_options, &option_index);
+        c=getopt_long(argc, argv, "hvfai:b:H:s:B:o:z:", long_options, &option_index);
 
         // Detect the end of the options.
         if (c==-1) break;
@@ -608,6 +619,10 @@ int main(int argc, char *argv[])
                 overflow=strtod(optarg, NULL);
                 break;
 
+            case 'z':
+                compress_level=strtol(optarg, NULL, 10);
+                break;
+
             case '?':
                 // getopt_long already printed an error message.
                 break;
@@ -623,6 +638,11 @@ int main(int argc, char *argv[])
         fprintf(stderr, "block size must be between 4k and 128k (between 512 and 2Mo for test only): %d\n", block_size);
         return 1;
     }
+    if (compress_level && block_size<=DDFS_ZBLOCK_ALIGMENT)
+    {
+        fprintf(stderr, "block size must be bigger than %d to use compression: %d\n", DDFS_ZBLOCK_ALIGMENT, block_size);
+        return 1;
+    }
     int bs=block_size;
     while (bs>2)
     {
@@ -648,6 +668,13 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    // check compression level
+    if (compress_level<0 || 9<compress_level)
+    {
+        fprintf(stderr, "Compression level must be between 1 and 9: %d\n", compress_level);
+        return 1;
+    }
+
     // check HASH
     if (0!=strcmp("SHA1", hash_name) &&
         0!=strcmp("TIGER", hash_name) &&
@@ -677,5 +704,5 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    return init(pdir, block_filename, index_filename, partition_size, block_size, overflow, hash_name, reuse_asap_flag);
+    return init(pdir, block_filename, index_filename, partition_size, block_size, overflow, hash_name, reuse_asap_flag, compress_level);
 }
@@ -23,6 +23,7 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <getopt.h>
 #include <string.h>
 #include <time.h>
@@ -138,238 +139,73 @@ long long int micronow()
     return tv.tv_sec*1000*1000+tv.tv_usec;
 }
 
-#include <sys/socket.h>
-#include <sys/un.h>
-
-enum socket_operation_command { sop_noop, sop_open, sop_read, sop_write, sop_fsync, sop_flush, sop_close, sop_dump };
-
-struct socket_operation
-{
-    int command;
-    long long int offset;
-    long long int size;
-    long long int aux;
-};
-
-int sock_init(char *path)
-{
-    int sock, len;
-    struct sockaddr_un remote;
-
-    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-        perror("socket");
-        exit(1);
-    }
+#include "ddfsclient.h"
 
-    remote.sun_family = AF_UNIX;
-    strcpy(remote.sun_path, path);
-    len = strlen(remote.sun_path) + sizeof(remote.sun_family);
-    if (connect(sock, (struct sockaddr *)&remote, len) == -1) {
-        perror("connect");
-        exit(1);
-    }
-    return sock;
-}
+#define SOCKET_RING_SIZE (32*1024*1024) // the memory shared with ddumbfs
 
-ssize_t socket_send(int sockfd, const void *buf, size_t len, int flags)
-{
-//    fprintf(stderr,"socket_send %d\n", len);
-    int sz=0;
-    int n;
-    while (sz<len)
-    {
-//        fprintf(stderr,"send %d %d\n", len, sz);
-        n=send(sockfd, buf+sz, len-sz, flags);
-//        fprintf(stderr,"sent %d %d %d\n", len, sz, n);
-        if (n==0) return 0;
-        if (n==-1)
-        {
-            perror("socket_send");
-            return n;
-        }
-        sz+=n;
-    }
-    return len;
-}
+struct ddfs_client client;
 
-ssize_t socket_recv(int sockfd, void *buf, size_t len, int flags)
+void sock_init(char *path)
 {
-//    fprintf(stderr,"socket_recv %d\n", len);
-    int sz=0;
-    int n;
-    while (sz<len)
-    {
-//        fprintf(stderr,"recv %d %d\n", len, sz);
-        n=recv(sockfd, buf+sz, len-sz, flags);
-//        fprintf(stderr,"recv %d %d %d\n", len, sz, n);
-        if (n==0) return 0;
-        if (n==-1)
-        {
-            perror("socket_recv");
-            return n;
-        }
-        sz+=n;
-    }
-    return len;
-}
-
-int sock_open(int sock, char *filename, int flag, int mode)
-{   // open a file
-    int res=0;
-    struct socket_operation sop;
-    sop.command=sop_open;
-    sop.offset=flag;
-    sop.aux=mode;
-    sop.size=strlen(filename);
-//    fprintf(stderr,"Open %s\n", filename);
-    res=socket_send(sock, &sop, sizeof(struct socket_operation), 0);
-    if (res==-1)
-    {
-        perror("Open send ops");
-        exit(1);
-    }
-    res=socket_send(sock, filename, sop.size, 0);
-    if (res==-1)
-    {
-        perror("Open send filename:");
-        exit(1);
-    }
-    res=socket_recv(sock, &res, sizeof(res), 0);
-    if (res==-1)
+    long long int ring_size=SOCKET_RING_SIZE;
+    if (ring_size<4LL*block_size) ring_size=4LL*block_size;
+    int res=ddfs_client_connect(&client, path, ring_size);
+    if (res)
     {
-        perror("Open recv");
+        fprintf(stderr, "cannot connect to %s: %s\n", path, strerror(-res));
         exit(1);
     }
-    return res;
 }
 
-int sock_write(int sock, void *buf, long long int size, long long int offset)
-{   // write some data
-    int res=0;
-    struct socket_operation sop;
-    sop.command=sop_write;
-    sop.size=size;
-    sop.offset=offset;
-//    fprintf(stderr,"Write\n");
-    if (socket_send(sock, &sop, sizeof(struct socket_operation), 0) == -1)
-    {
-        perror("send");
-        exit(1);
-    }
-    if (socket_send(sock, buf, sop.size, 0) == -1)
+int sock_write(void *buf, long long int size, long long int offset)
+{   // queue a write, don't wait for the reply
+    char *p=ddfs_client_buffer(&client, size);
+    if (p==NULL)
     {
-        perror("send");
+        fprintf(stderr, "socket write: connection lost\n");
         exit(1);
     }
-    if (socket_recv(sock, &res, sizeof(res), 0)==-1)
-    {
-        perror("recv");
-        exit(1);
-    }
-    return size;
-}
-
-int sock_read(int sock, void *buf, long long int size, long long int offset)
-{   // write some data
-    int res=0;
-    struct socket_operation sop;
-    sop.command=sop_read;
-    sop.size=size;
-    sop.offset=offset;
-//    fprintf(stderr,"Read\n");
-    if (socket_send(sock, &sop, sizeof(struct socket_operation), 0) == -1)
-    {
-        perror("send");
-        exit(1);
-    }
-    if (socket_recv(sock, &res, sizeof(res), 0)==-1)
-    {
-        perror("recv");
-        exit(1);
-    }
-    int sz=socket_recv(sock, buf, size, 0);
-    return sz;
+    memcpy(p, buf, size);
+    int res=ddfs_client_write(&client, p, size, offset);
+    if (res) fprintf(stderr, "socket write: %s\n", strerror(-res));
+    return res?res:size;
 }
 
-int sock_fsync(int sock)
-{   // close
-    int res=0;
-    struct socket_operation sop;
-    sop.command=sop_fsync;
-//    fprintf(stderr,"sync\n");
-    if (socket_send(sock, &sop, sizeof(struct socket_operation), 0) == -1)
+int sock_read(void *buf, long long int size, long long int offset)
+{   // read some data
+    char *p=ddfs_client_buffer(&client, size);
+    if (p==NULL)
     {
-        perror("send");
-        exit(1);
-    }
-    if (socket_recv(sock, &res, sizeof(res), 0)==-1)
-    {
-        perror("recv");
-        exit(1);
-    }
-    return res;
-}
-
-int sock_close(int sock)
-{   // close
-    int res=0;
-    struct socket_operation sop;
-    sop.command=sop_close;
-//    fprintf(stderr,"close\n");
-    if (socket_send(sock, &sop, sizeof(struct socket_operation), 0) == -1)
-    {
-        perror("send");
-        exit(1);
-    }
-    if (socket_recv(sock, &res, sizeof(res), 0)==-1)
-    {
-        perror("recv");
-        exit(1);
-    }
-    return res;
-}
-
-int sock_dump(int sock)
-{   // dump
-    int res=0;
-    struct socket_operation sop;
-    sop.command=sop_dump;
-//    fprintf(stderr,"dump\n");
-    if (socket_send(sock, &sop, sizeof(struct socket_operation), 0) == -1)
-    {
-        perror("send");
-        exit(1);
-    }
-    if (socket_recv(sock, &res, sizeof(res), 0)==-1)
-    {
-        perror("recv");
+        fprintf(stderr, "socket read: connection lost\n");
         exit(1);
     }
+    int res=ddfs_client_read(&client, p, size, offset);
+    if (res>0) memcpy(buf, p, res);
     return res;
 }
 
 int test_socket(void)
 {
-    int sock=sock_init(target);
+    sock_init(target);
     fprintf(stderr,"Connected.\n");
-    int res=sock_open(sock, "/hello", O_RDWR|O_CREAT|O_TRUNC, 0644);
+    int res=ddfs_client_open(&client, "/hello", O_RDWR|O_CREAT|O_TRUNC, 0644);
     int size=128*1024;
     char *data=malloc(size);
     memset(data, 'A', size);
-    res=sock_write(sock, data, size, 0);
-    res=sock_fsync(sock);
-    res=sock_close(sock);
+    res=sock_write(data, size, 0);
+    res=ddfs_client_fsync(&client, 0);
+    res=ddfs_client_close(&client);
 
-    close(sock);
+    ddfs_client_disconnect(&client);
     return res;
 }
 
 int test_dump(void)
 {
-    int sock=sock_init(target);
+    sock_init(target);
     fprintf(stderr,"Connected.\n");
-    int res=sock_dump(sock);
-    close(sock);
+    int res=ddfs_client_dump(&client);
+    ddfs_client_disconnect(&client);
     return res;
 }
 
@@ -447,21 +283,20 @@ int genfile(unsigned long seed, char *filename, unsigned char *hash, int compare
     }
 
     int fd;
-    if (compare) fd=open(filename, O_RDONLY);
-    else
+    if (issocket)
     {
-        if (issocket)
-        {
-            fd=issocket;
-            strncpy(sfilename+1, filename, sizeof(sfilename)-1);
-            sfilename[0]='/';
-            sock_open(fd, sfilename, O_RDWR|O_CREAT|O_TRUNC, 0644);
-        }
-        else
+        strncpy(sfilename+1, filename, sizeof(sfilename)-2);
+        sfilename[sizeof(sfilename)-1]='\0';
+        sfilename[0]='/';
+        fd=ddfs_client_open(&client, sfilename, compare?O_RDONLY:O_RDWR|O_CREAT|O_TRUNC, 0644);
+        if (fd<0)
         {
-            fd=open(filename, O_WRONLY|O_CREAT, 0644);
+            errno=-fd;
+            fd=-1;
         }
     }
+    else if (compare) fd=open(filename, O_RDONLY);
+    else fd=open(filename, O_WRONLY|O_CREAT, 0644);
     if (fd==-1)
     {
         perror(filename);
@@ -500,7 +335,7 @@ int genfile(unsigned long seed, char *filename, unsigned char *hash, int compare
         {
             if (issocket)
             {
-                len=sock_read(fd, block_buf_aux, block_size, size);
+                len=sock_read(block_buf_aux, block_size, size);
             }
             else
             {
@@ -513,7 +348,7 @@ int genfile(unsigned long seed, char *filename, unsigned char *hash, int compare
         {
             if (issocket)
             {
-                len=sock_write(fd, block_buf, block_size, size);
+                len=sock_write(block_buf, block_size, size);
             }
             else
             {
@@ -527,8 +362,8 @@ int genfile(unsigned long seed, char *filename, unsigned char *hash, int compare
 
     if (issocket)
     {
-        sock_fsync(fd);
-        sock_close(fd);
+        if (ddfs_client_fsync(&client, 0)) err=1;
+        ddfs_client_close(&client);
     }
     else
     {
@@ -571,7 +406,7 @@ int speed_test()
 
     if (issocket)
     {
-        issocket=sock_init(target);
+        sock_init(target);
     }
     else
     {